@@ -0,0 +1,218 @@
+#!/bin/sh
+# Benchmark and stress harness for imcsh, used by `make bench` and `make stress`
+# - every run drives ./imcsh in batch mode with a generated script, so nothing here needs a terminal
+# - results are written as key=value lines in a fixed order, so two result files can simply be diffed
+#
+# Usage: ./bench.sh bench|stress|loadtest [RESULTS_FILE]
+
+set -e
+
+MODE=${1:-bench}
+IMCSH=${IMCSH:-./imcsh}
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/imcsh-bench.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+# Sizes of the runs, can be overridden from the environment (or the makefile)
+BUILTIN_RUNS=${BUILTIN_RUNS:-100000}
+HELP_RUNS=${HELP_RUNS:-20000}
+EXEC_RUNS=${EXEC_RUNS:-2000}
+BG_JOBS=${BG_JOBS:-10000}
+REDIRECT_RUNS=${REDIRECT_RUNS:-100000}
+REDIRECT_MB=${REDIRECT_MB:-256}
+STRESS_JOBS=${STRESS_JOBS:-5000}
+STRESS_ROUNDS=${STRESS_ROUNDS:-3}
+LOAD_CLIENTS=${LOAD_CLIENTS:-8}
+LOAD_REQUESTS=${LOAD_REQUESTS:-5000}
+LOAD_COMMAND=${LOAD_COMMAND:-echo hello}
+CLIENT=${CLIENT:-./imcsh-client}
+
+now()
+{
+    date +%s.%N
+}
+
+# result KEY VALUE - prints a metric and appends it to the results file
+result()
+{
+    echo "$1=$2"
+    echo "$1=$2" >> "$RESULTS"
+}
+
+# elapsed START END - seconds between two `now` readings
+elapsed()
+{
+    awk -v a="$1" -v b="$2" 'BEGIN { printf "%.3f", b - a }'
+}
+
+# rate COUNT SECONDS - COUNT per second
+rate()
+{
+    awk -v n="$1" -v s="$2" 'BEGIN { if (s > 0) printf "%.0f", n / s; else print 0 }'
+}
+
+# repeat COUNT LINE - writes LINE COUNT times, one per line
+repeat()
+{
+    awk -v n="$1" -v line="$2" 'BEGIN { for (i = 0; i < n; i++) print line }'
+}
+
+# run_script NAME - runs $WORK/NAME.imc through imcsh and sets SECONDS_TAKEN, the output ends up in $WORK/NAME.out
+run_script()
+{
+    start=$(now)
+    "$IMCSH" "$WORK/$1.imc" > "$WORK/$1.out" 2>&1 || {
+        echo "imcsh failed on $1, see the last lines of its output:" >&2
+        tail -n 5 "$WORK/$1.out" >&2
+        exit 1
+    }
+    SECONDS_TAKEN=$(elapsed "$start" "$(now)")
+}
+
+# Metadata first, so a result file says what it measured
+header()
+{
+    : > "$RESULTS"
+    result mode "$MODE"
+    result commit "$(git rev-parse --short HEAD 2> /dev/null || echo unknown)"
+    result kernel "$(uname -r)"
+    result cpus "$(nproc)"
+}
+
+bench()
+{
+    # Builtins - parsing, dispatch and the buffered stdout
+    repeat "$BUILTIN_RUNS" "echo hello world" > "$WORK/echo.imc"
+    run_script echo
+    result echo_commands "$BUILTIN_RUNS"
+    result echo_seconds "$SECONDS_TAKEN"
+    result echo_commands_per_second "$(rate "$BUILTIN_RUNS" "$SECONDS_TAKEN")"
+
+    repeat "$HELP_RUNS" "help" > "$WORK/help.imc"
+    run_script help
+    result help_commands "$HELP_RUNS"
+    result help_seconds "$SECONDS_TAKEN"
+    result help_commands_per_second "$(rate "$HELP_RUNS" "$SECONDS_TAKEN")"
+
+    # Trivial foreground programs - spawning, waiting and reaping one at a time
+    repeat "$EXEC_RUNS" "exec true" > "$WORK/exec.imc"
+    run_script exec
+    result exec_commands "$EXEC_RUNS"
+    result exec_seconds "$SECONDS_TAKEN"
+    result exec_commands_per_second "$(rate "$EXEC_RUNS" "$SECONDS_TAKEN")"
+
+    # Concurrent background jobs - all of them sleep for a second, so they are alive at the same time
+    # - the script only ends once every job was reaped, the overhead is everything beyond that second
+    repeat "$BG_JOBS" "exec sleep 1 &" > "$WORK/background.imc"
+    run_script background
+    reaped=$(grep -c "terminated with exit status 0" "$WORK/background.out" || true)
+    result background_jobs "$BG_JOBS"
+    result background_reaped "$reaped"
+    result background_seconds "$SECONDS_TAKEN"
+    result background_overhead_seconds "$(awk -v s="$SECONDS_TAKEN" 'BEGIN { printf "%.3f", s - 1 }')"
+
+    # Redirections - appending with a builtin (the cached writer) and a program streaming into a file
+    repeat "$REDIRECT_RUNS" "echo the quick brown fox jumps over the lazy dog >> $WORK/append.txt" > "$WORK/append.imc"
+    run_script append
+    result append_commands "$REDIRECT_RUNS"
+    result append_seconds "$SECONDS_TAKEN"
+    result append_commands_per_second "$(rate "$REDIRECT_RUNS" "$SECONDS_TAKEN")"
+    result append_bytes "$(wc -c < "$WORK/append.txt" | tr -d ' ')"
+
+    echo "exec head -c ${REDIRECT_MB}M /dev/zero > $WORK/stream.bin" > "$WORK/stream.imc"
+    run_script stream
+    result stream_megabytes "$REDIRECT_MB"
+    result stream_seconds "$SECONDS_TAKEN"
+    result stream_megabytes_per_second "$(rate "$REDIRECT_MB" "$SECONDS_TAKEN")"
+    rm -f "$WORK/stream.bin"
+}
+
+# Launches thousands of background jobs per round and has them killed by their timeout while more are started
+# - exercises the job table, the pidfds (and the SIGCHLD fallback once they run out), the timerfd and reaping
+stress()
+{
+    round=1
+    total_seconds=0
+    failures=0
+    while [ "$round" -le "$STRESS_ROUNDS" ]
+    do
+        # Every fourth job exits on its own, the others are killed by SIGTERM after their timeout
+        awk -v n="$STRESS_JOBS" 'BEGIN {
+            for (i = 0; i < n; i++)
+                print (i % 4 == 0) ? "exec true &" : "exec --timeout=0.2 sleep 30 &"
+            print "jobs"
+        }' > "$WORK/stress.imc"
+        run_script stress
+        exited=$(grep -c "terminated with exit status 0" "$WORK/stress.out" || true)
+        killed=$(grep -c "terminated due to signal" "$WORK/stress.out" || true)
+        reaped=$((exited + killed))
+        if [ "$reaped" -ne "$STRESS_JOBS" ]
+        then
+            failures=$((failures + 1))
+            echo "round $round: started $STRESS_JOBS jobs, but only $reaped were reaped" >&2
+        fi
+        result "round${round}_seconds" "$SECONDS_TAKEN"
+        result "round${round}_exited" "$exited"
+        result "round${round}_killed" "$killed"
+        total_seconds=$(awk -v a="$total_seconds" -v b="$SECONDS_TAKEN" 'BEGIN { printf "%.3f", a + b }')
+        round=$((round + 1))
+    done
+    result stress_jobs "$((STRESS_JOBS * STRESS_ROUNDS))"
+    result stress_seconds "$total_seconds"
+    result stress_jobs_per_second "$(rate "$((STRESS_JOBS * STRESS_ROUNDS))" "$total_seconds")"
+    result stress_failed_rounds "$failures"
+    [ "$failures" -eq 0 ]
+}
+
+# Serves a socket and has many clients send the same command over it at once
+# - every client is its own connection, so its own forked worker of the server
+loadtest()
+{
+    "$IMCSH" --serve "$WORK/imcsh.sock" > "$WORK/server.out" 2>&1 &
+    server=$!
+    tries=0
+    while [ ! -S "$WORK/imcsh.sock" ]
+    do
+        tries=$((tries + 1))
+        if [ "$tries" -gt 100 ] || ! kill -0 "$server" 2> /dev/null
+        then
+            echo "imcsh --serve did not start, see its output:" >&2
+            tail -n 5 "$WORK/server.out" >&2
+            exit 1
+        fi
+        sleep 0.05
+    done
+    status=0
+    line=$("$CLIENT" --load "$LOAD_CLIENTS" "$LOAD_REQUESTS" "$WORK/imcsh.sock" "$LOAD_COMMAND") || status=$?
+    kill "$server"
+    wait "$server" || true
+    result load_command "$LOAD_COMMAND"
+    for pair in $line
+    do
+        result "load_${pair%%=*}" "${pair#*=}"
+    done
+    [ "$status" -eq 0 ]
+}
+
+case "$MODE" in
+    bench)
+        RESULTS=${2:-bench-results.txt}
+        header
+        bench
+        ;;
+    stress)
+        RESULTS=${2:-stress-results.txt}
+        header
+        stress
+        ;;
+    loadtest)
+        RESULTS=${2:-loadtest-results.txt}
+        header
+        loadtest
+        ;;
+    *)
+        echo "Usage: $0 bench|stress|loadtest [RESULTS_FILE]" >&2
+        exit 2
+        ;;
+esac
+
+echo "Results written to $RESULTS"
@@ -0,0 +1,308 @@
+#define _GNU_SOURCE
+// Client of `imcsh --serve`, sends command lines over the Unix domain socket and prints what they wrote
+// - every request is a 4 byte length (big endian) and the command lines, every response a 4 byte length, the 4 byte
+//   exit status and the output of the commands, see the "Command server" section of imcsh.c
+// - `--load` connects many clients at once and reports the latency and throughput, like `imcsh --spawn-bench`
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#define ANSI_COLOR_RED "\x1b[31m" // For errors
+#define ANSI_COLOR_RESET "\x1b[0m"
+
+// Connects to the server, returns the socket or -1 after printing an error
+int connect_server(const char *path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh-client: socket path '%s' is too long\n" ANSI_COLOR_RESET, path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh-client: cannot connect to '%s': %s\n" ANSI_COLOR_RESET, path, strerror(errno));
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// Reads exactly `size` bytes, returns 0 or -1 for an error or EOF
+int read_full(int fd, void *buffer, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t bytes = read(fd, (char *)buffer + done, size - done);
+        if (bytes == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            return -1;
+        }
+        done += bytes;
+    }
+    return 0;
+}
+
+int write_full(int fd, const void *buffer, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t bytes = send(fd, (const char *)buffer + done, size - done, MSG_NOSIGNAL);
+        if (bytes == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            return -1;
+        }
+        done += bytes;
+    }
+    return 0;
+}
+
+// Sends one request and reads its response, the output is written to `out` (or dropped with NULL)
+// - returns the exit status of the commands, or -1 if the connection broke
+int run_request(int fd, const char *command, size_t length, FILE *out)
+{
+    uint32_t header = htonl((uint32_t)length);
+    if (write_full(fd, &header, sizeof(header)) == -1 || write_full(fd, command, length) == -1)
+    {
+        return -1;
+    }
+    uint32_t response[2];
+    if (read_full(fd, response, sizeof(response)) == -1)
+    {
+        return -1;
+    }
+    // The length covers the status, anything shorter isn't a response of the server
+    if (ntohl(response[0]) < sizeof(uint32_t))
+    {
+        return -1;
+    }
+    size_t left = ntohl(response[0]) - sizeof(uint32_t);
+    char buffer[65536];
+    while (left > 0)
+    {
+        size_t chunk = (left < sizeof(buffer)) ? left : sizeof(buffer);
+        if (read_full(fd, buffer, chunk) == -1)
+        {
+            return -1;
+        }
+        if (out != NULL)
+        {
+            fwrite(buffer, 1, chunk, out);
+        }
+        left -= chunk;
+    }
+    return (int)ntohl(response[1]);
+}
+
+// -----------------
+// |   Load test   |
+// -----------------
+// Every thread is a client of its own, sending its requests one after the other, and times each of them
+typedef struct
+{
+    const char *path;
+    const char *command;
+    long requests;
+    double *latencies; // One per request
+    long completed;    // Requests that got a response, only their latencies are set
+    long failed;       // Requests with a non-zero exit status
+    int broken;        // The connection could not be made or broke
+} load_client;
+
+double elapsed_seconds(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void *load_client_run(void *arg)
+{
+    load_client *client = arg;
+    int fd = connect_server(client->path);
+    if (fd == -1)
+    {
+        client->broken = 1;
+        return NULL;
+    }
+    size_t length = strlen(client->command);
+    for (long i = 0; i < client->requests; i++)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int status = run_request(fd, client->command, length, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (status == -1)
+        {
+            client->broken = 1;
+            break;
+        }
+        client->failed += (status != 0);
+        client->latencies[client->completed++] = elapsed_seconds(&start, &end);
+    }
+    close(fd);
+    return NULL;
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double diff = *(const double *)a - *(const double *)b;
+    return (diff > 0) - (diff < 0);
+}
+
+// Prints one `key=value` line: the clients, the requests, the p50 / p99 latency and the requests per second
+int load_test(const char *path, int num_clients, long requests, const char *command)
+{
+    load_client *clients = calloc(num_clients, sizeof(load_client));
+    pthread_t *threads = calloc(num_clients, sizeof(pthread_t));
+    double *latencies = calloc((size_t)num_clients * requests, sizeof(double));
+    if (clients == NULL || threads == NULL || latencies == NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh-client: allocation error\n" ANSI_COLOR_RESET);
+        exit(EXIT_FAILURE);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_clients; i++)
+    {
+        clients[i] = (load_client){path, command, requests, latencies + (size_t)i * requests, 0, 0, 0};
+        if (pthread_create(&threads[i], NULL, load_client_run, &clients[i]) != 0)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh-client: could not start client %d\n" ANSI_COLOR_RESET, i + 1);
+            exit(EXIT_FAILURE);
+        }
+    }
+    long failed = 0;
+    int broken = 0;
+    for (int i = 0; i < num_clients; i++)
+    {
+        pthread_join(threads[i], NULL);
+        failed += clients[i].failed;
+        broken += clients[i].broken;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // A broken client leaves its remaining slots unset, only the latencies of completed requests go into the percentiles
+    long total = 0;
+    for (int i = 0; i < num_clients; i++)
+    {
+        memmove(latencies + total, clients[i].latencies, clients[i].completed * sizeof(double));
+        total += clients[i].completed;
+    }
+    qsort(latencies, total, sizeof(double), compare_doubles);
+    double seconds = elapsed_seconds(&start, &end);
+    double p50 = (total > 0) ? latencies[total / 2] : 0;
+    double p99 = (total > 0) ? latencies[(total * 99) / 100] : 0;
+    printf("clients=%d requests=%ld failed=%ld broken_clients=%d p50_us=%.1f p99_us=%.1f commands_per_second=%.0f\n",
+           num_clients, total, failed, broken, p50 * 1e6, p99 * 1e6, total / seconds);
+    free(clients);
+    free(threads);
+    free(latencies);
+    return (failed > 0 || broken > 0);
+}
+
+void print_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s socket command...   run one command line and exit with its status\n", program);
+    fprintf(stderr, "       %s socket              run the lines of stdin one by one, the status is the one of the last\n", program);
+    fprintf(stderr, "       %s --load CLIENTS REQUESTS socket [command]\n", program);
+    fprintf(stderr, "           CLIENTS clients at once send REQUESTS requests each ('echo hello' by default)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 5 && argc <= 6 && strcmp(argv[1], "--load") == 0)
+    {
+        int num_clients = atoi(argv[2]);
+        long requests = atol(argv[3]);
+        if (num_clients < 1 || requests < 1)
+        {
+            print_usage(argv[0]);
+            return 2;
+        }
+        return load_test(argv[4], num_clients, requests, (argc == 6) ? argv[5] : "echo hello");
+    }
+    if (argc < 2 || argv[1][0] == '-')
+    {
+        print_usage(argv[0]);
+        return 2;
+    }
+
+    int fd = connect_server(argv[1]);
+    if (fd == -1)
+    {
+        return 1;
+    }
+
+    int status = 0;
+    if (argc > 2)
+    {
+        // The words are joined back into one command line, like a shell's `-c`
+        size_t length = 0;
+        for (int i = 2; i < argc; i++)
+        {
+            length += strlen(argv[i]) + 1;
+        }
+        char *command = malloc(length);
+        if (command == NULL)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh-client: allocation error\n" ANSI_COLOR_RESET);
+            return 1;
+        }
+        char *end = command;
+        for (int i = 2; i < argc; i++)
+        {
+            end += sprintf(end, "%s%s", (i > 2) ? " " : "", argv[i]);
+        }
+        status = run_request(fd, command, end - command, stdout);
+        free(command);
+    }
+    else
+    {
+        char *line = NULL;
+        size_t capacity = 0;
+        ssize_t length;
+        while (status != -1 && (length = getline(&line, &capacity, stdin)) != -1)
+        {
+            if (length > 0 && line[length - 1] == '\n')
+            {
+                length--;
+            }
+            status = run_request(fd, line, length, stdout);
+            fflush(stdout);
+        }
+        free(line);
+    }
+    close(fd);
+    if (status == -1)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh-client: the connection to the server broke\n" ANSI_COLOR_RESET);
+        return 1;
+    }
+    return status;
+}
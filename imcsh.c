@@ -1,4 +1,4 @@
-#define _XOPEN_SOURCE 700 // This was done to surpress warnings for `sigchild` / `signal`
+#define _GNU_SOURCE // Superset of `_XOPEN_SOURCE 700` (needed for `sigaction`), also exposes Linux extras like `pipe2` and `F_SETPIPE_SZ`
 // Source: https://stackoverflow.com/questions/6491019/struct-sigaction-incomplete-error
 
 #include <stdio.h>
@@ -13,18 +13,108 @@
 #include <fcntl.h>  // For writing stdout to a file
 #include <limits.h> // For HOST_NAME_MAX
 #include <pwd.h>    // For getpwuid
+#include <sys/stat.h>
+#include <sys/inotify.h> // For noticing changes in the PATH directories
+#include <poll.h>        // For waiting on the input and finished children at once
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h> // For `struct rusage` filled in by `wait4`
+#include <stdint.h>
+#include <ctype.h>
+#include <sys/epoll.h>    // The event loop
+#include <sys/timerfd.h>  // For job timeouts
+#include <sys/syscall.h>  // For `pidfd_open` and `clone3`
+#include <sys/mman.h>
+#include <linux/sched.h>  // For `struct clone_args`
+#include <sys/uio.h>      // For `writev`
+#include <pthread.h>      // For compacting the history in the background
+#include <dirent.h>       // For listing the PATH directories and files to complete
+#include <termios.h>      // For the raw mode of the line editor
+#include <sys/ioctl.h>    // For the width of the terminal
+#include <sched.h>        // For the CPU affinity and scheduling policy of jobs
+#include <sys/socket.h>   // For the command server
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <arpa/inet.h>    // For `htonl` / `ntohl`, the lengths of the server's frames
 
-#define MAX_INPUT_SIZE 1024
+#define MAX_PIPELINE_STAGES 64
 // #define HOST_NAME_MAX 100
 #define ANSI_COLOR_GREEN "\x1b[32m" // For coloring the prompt, source: https://stackoverflow.com/questions/3219393/stdlib-and-colored-output-in-c
 #define ANSI_COLOR_RED "\x1b[31m"   // For errors
 #define ANSI_COLOR_RESET "\x1b[0m"  // Reset color
 
+// Allocation counting, built with `make alloc-stats` (`-DALLOC_STATS`)
+// - every `malloc` / `calloc` / `realloc` / `strdup` / `free` of the shell itself is counted, and after every command the
+//   numbers are printed to stderr, so a steady state without any heap churn can be confirmed
+#ifdef ALLOC_STATS
+unsigned long g_alloc_count = 0;
+unsigned long g_free_count = 0;
+
+void *counted_malloc(size_t size)
+{
+    g_alloc_count++;
+    return malloc(size);
+}
+
+void *counted_calloc(size_t count, size_t size)
+{
+    g_alloc_count++;
+    return calloc(count, size);
+}
+
+void *counted_realloc(void *ptr, size_t size)
+{
+    g_alloc_count++;
+    return realloc(ptr, size);
+}
+
+char *counted_strdup(const char *str)
+{
+    g_alloc_count++;
+    return strdup(str);
+}
+
+char *counted_strndup(const char *str, size_t size)
+{
+    g_alloc_count++;
+    return strndup(str, size);
+}
+
+void counted_free(void *ptr)
+{
+    if (ptr != NULL)
+    {
+        g_free_count++;
+    }
+    free(ptr);
+}
+
+#define malloc(size) counted_malloc(size)
+#define calloc(count, size) counted_calloc(count, size)
+#define realloc(ptr, size) counted_realloc(ptr, size)
+#define strdup(str) counted_strdup(str)
+#define strndup(str, size) counted_strndup(str, size)
+#define free(ptr) counted_free(ptr)
+#endif
+
 // Initialize global variables to store username and hostname
 // Source: https://stackoverflow.com/questions/1451825/c-programming-printing-current-user
 const char *g_username = NULL;
 char g_hostname[HOST_NAME_MAX + 1] = {0};
 
+// Shell-wide settings, changeable at runtime via the `set` builtin
+// - `g_pipe_size` is the requested capacity of pipes between pipeline stages, 0 keeps the kernel default (64 KiB)
+long g_pipe_size = 0;
+
+// Captured output of background jobs (`set capture=on` or `exec --capture`), kept in a ring buffer of this size per job
+int g_capture = 0;
+long g_capture_size = 64 * 1024;
+
+// Whether a person is typing at a terminal, scripts, pipes and `-c` skip the title, prompts and confirmations
+int g_interactive = 1;
+// Exit status of the last command, also the exit status of the shell in batch mode
+int g_last_status = 0;
+
 // ------------------------
 // |   Helper functions   |
 // ------------------------
@@ -67,273 +157,4580 @@ void display_title()
 // Function to prompt user
 void prompt_user()
 {
+    if (!g_interactive)
+    {
+        return; // Scripts and pipes get no prompt, it would only end up mixed into the output
+    }
     printf(ANSI_COLOR_GREEN "%s@%s> " ANSI_COLOR_RESET, g_username, g_hostname); // From `stdio`
 }
 
-char *read_input()
+// Seconds passed between two CLOCK_MONOTONIC readings
+double elapsed_seconds(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+double timeval_seconds(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// Formats the resources a process (or a whole job) used, e.g. `real 1.204s user 0.950s sys 0.040s maxrss 12.3M ctxsw 15v/3i`
+// - maxrss comes in KiB on Linux, ctxsw are the voluntary / involuntary context switches
+void format_usage(char *buffer, size_t size, const struct rusage *usage, double wall)
+{
+    snprintf(buffer, size, "real %.3fs user %.3fs sys %.3fs maxrss %.1fM ctxsw %ldv/%ldi",
+             wall, timeval_seconds(&usage->ru_utime), timeval_seconds(&usage->ru_stime),
+             usage->ru_maxrss / 1024.0, usage->ru_nvcsw, usage->ru_nivcsw);
+}
+
+// Reports how a waited-on child terminated, along with what it cost
+void report_status(FILE *out, const char *prefix, pid_t pid, int status, const struct rusage *usage, double wall, const char *note)
 {
-    char *input = malloc(MAX_INPUT_SIZE); // Allocate memory for the input buffer, `stdlib`
-    // CHECK: allocation successful
-    if (!input)
+    char usage_text[160];
+    format_usage(usage_text, sizeof(usage_text), usage, wall);
+    if (WIFEXITED(status))
     {
-        fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
-        exit(EXIT_FAILURE); // For now simply exit, `stdlib`
+        fprintf(out, "%s %d terminated with exit status %d [%s]\n", prefix, pid, WEXITSTATUS(status), usage_text);
     }
-    // CHECK: input is not empty
-    if (fgets(input, 1024, stdin) == NULL) // From `stdin`
+    else if (WIFSIGNALED(status) && note != NULL)
     {
-        free(input);
-        return NULL;
+        fprintf(out, "%s %d terminated due to signal %d, %s [%s]\n", prefix, pid, WTERMSIG(status), note, usage_text);
     }
-    // Check that input fit into the allocated space
-    // - If newline char is not found in the string it didn't fit into buffer
-    if (strchr(input, '\n') == NULL) // From `stringh`
+    else if (WIFSIGNALED(status))
     {
-        fprintf(stderr, ANSI_COLOR_RED "imcsh: input too long\n" ANSI_COLOR_RESET);
-        free(input);
-        return NULL;
+        fprintf(out, "%s %d terminated due to signal %d [%s]\n", prefix, pid, WTERMSIG(status), usage_text);
+    }
+}
+
+// Adds up the usage of a job's processes, the peak memory is the largest single process
+void add_usage(struct rusage *total, const struct rusage *usage)
+{
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+    if (usage->ru_maxrss > total->ru_maxrss)
+    {
+        total->ru_maxrss = usage->ru_maxrss;
+    }
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
+}
+
+// Turns a `waitpid` status into a shell exit code, 128 + signal number for killed processes
+int exit_code(int status)
+{
+    if (WIFEXITED(status))
+    {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status))
+    {
+        return 128 + WTERMSIG(status);
     }
-    // Remove the trailing newline character
-    input[strcspn(input, "\n")] = '\0';
-    return input;
+    return 1;
 }
 
-// Keeping track of running processes
-#define INITIAL_MAX_PROCESSES 100
+// ---------------------
+// |   Command arena   |
+// ---------------------
+// Everything a single command needs only while it runs (its words, argv lists, listings, ...) is bump-allocated from an arena,
+// which is reset in one step once the command is done
+// - the chunks are kept for the next command, so in the steady state running a command does not touch the heap at all
+// - `arena_save` / `arena_restore` free up everything allocated in between, for loops inside of a command like `parallel`
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT 16
+
+typedef struct arena_chunk
+{
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} arena_chunk;
+
+typedef struct
+{
+    arena_chunk *first;
+    arena_chunk *current; // The chunks after it are empty, ready to be reused
+} arena;
+
+typedef struct
+{
+    arena_chunk *chunk;
+    size_t used;
+} arena_mark;
 
-// Declare a pointer to store process IDs
-pid_t *running_processes;
-size_t num_running_processes = 0;
-size_t max_processes = INITIAL_MAX_PROCESSES;
+arena g_arena = {NULL, NULL};
 
-void add_running_process(pid_t pid)
+void *arena_alloc(arena *a, size_t size)
 {
-    if (num_running_processes >= max_processes)
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    arena_chunk *chunk = a->current;
+    if (chunk != NULL && chunk->size - chunk->used >= size)
+    {
+        void *ptr = chunk->data + chunk->used;
+        chunk->used += size;
+        return ptr;
+    }
+
+    // Move on to the next free chunk, or add one - a request bigger than a chunk gets a chunk of its own
+    arena_chunk *next = (chunk != NULL) ? chunk->next : a->first;
+    if (next == NULL || next->size < size)
     {
-        // Optionally, resize the array if needed
-        max_processes *= 2;
-        running_processes = realloc(running_processes, max_processes * sizeof(pid_t));
-        if (running_processes == NULL)
+        size_t chunk_size = (size > ARENA_CHUNK_SIZE) ? size : ARENA_CHUNK_SIZE;
+        arena_chunk *added = malloc(sizeof(arena_chunk) + chunk_size);
+        if (added == NULL)
         {
-            fprintf(stderr, "Memory reallocation failed\n");
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
             exit(EXIT_FAILURE);
         }
+        added->size = chunk_size;
+        added->next = next;
+        if (chunk != NULL)
+        {
+            chunk->next = added;
+        }
+        else
+        {
+            a->first = added;
+        }
+        next = added;
+    }
+    next->used = size;
+    a->current = next;
+    return next->data;
+}
+
+arena_mark arena_save(const arena *a)
+{
+    arena_mark mark = {a->current, (a->current != NULL) ? a->current->used : 0};
+    return mark;
+}
+
+void arena_restore(arena *a, arena_mark mark)
+{
+    a->current = mark.chunk;
+    if (mark.chunk != NULL)
+    {
+        mark.chunk->used = mark.used;
     }
-    running_processes[num_running_processes++] = pid;
 }
 
-void remove_running_process(pid_t pid)
+// Bytes handed out since the last reset
+size_t arena_used(const arena *a)
 {
-    for (size_t i = 0; i < num_running_processes; ++i)
+    if (a->current == NULL)
+    {
+        return 0;
+    }
+    size_t used = 0;
+    for (arena_chunk *chunk = a->first; chunk != NULL; chunk = chunk->next)
     {
-        if (running_processes[i] == pid)
+        used += chunk->used;
+        if (chunk == a->current)
         {
-            // Shift remaining elements to the left
-            for (size_t j = i; j < num_running_processes - 1; ++j)
-            {
-                running_processes[j] = running_processes[j + 1];
-            }
-            --num_running_processes;
             break;
         }
     }
+    return used;
 }
 
-// ------------------------------------------------------
-// |   Define possible functions for the shell to use   |
-// ------------------------------------------------------
-void help(char *args, int background, const char *output_file)
+// Frees up everything at once, only the chunks made for a single oversized request are given back to the system
+void arena_reset(arena *a)
 {
-    (void)args;
-    (void)background;
-
-    if (output_file != NULL)
+    arena_chunk **link = &a->first;
+    while (*link != NULL)
     {
-        FILE *out = fopen(output_file, "a"); // Append mode
-        if (out == NULL)
+        arena_chunk *chunk = *link;
+        if (chunk->size > ARENA_CHUNK_SIZE)
         {
-            fprintf(stderr, ANSI_COLOR_RED "imcsh: Failed to open file '%s' for writing\n" ANSI_COLOR_RESET, output_file);
-            return;
+            *link = chunk->next;
+            free(chunk);
+            continue;
         }
+        chunk->used = 0;
+        link = &chunk->next;
+    }
+    a->current = NULL;
+}
 
-        fprintf(out, "Available commands:\n");
-        fprintf(out, "  globalusage - Display basic information about the shell\n");
-        fprintf(out, "  help        - Show this help message\n");
-        fprintf(out, "  echo        - Echos the user's input\n");
-        fprintf(out, "  quit        - Quit the shell\n");
-        fprintf(out, "  exec        - Execute a program like a regular shell would do\n");
-        fclose(out);
+// ---------------------
+// |   Ring buffers    |
+// ---------------------
+// Fixed size byte buffer that keeps the most recent data, used to capture the output of background jobs
+// - once full, new bytes overwrite the oldest ones, so a chatty job can't eat up the shell's memory
+typedef struct
+{
+    char *data;
+    size_t capacity;
+    size_t start;  // Oldest byte still kept
+    size_t length;
+    unsigned long long total; // Bytes ever written, `total - length` were dropped
+} ring_buffer;
 
-        printf("Output redirected to -> %s\n", output_file);
+ring_buffer *ring_create(size_t capacity)
+{
+    ring_buffer *ring = malloc(sizeof(ring_buffer));
+    char *data = malloc(capacity);
+    if (ring == NULL || data == NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+        exit(EXIT_FAILURE);
     }
-    else
+    ring->data = data;
+    ring->capacity = capacity;
+    ring->start = ring->length = 0;
+    ring->total = 0;
+    return ring;
+}
+
+void ring_destroy(ring_buffer *ring)
+{
+    if (ring != NULL)
     {
-        printf("Available commands:\n");
-        printf("  globalusage - Display basic information about the shell\n");
-        printf("  help        - Show this help message\n");
-        printf("  echo        - Echos the user's input\n");
-        printf("  quit        - Quit the shell\n");
-        printf("  exec        - Execute a program like a regular shell would do\n");
+        free(ring->data);
+        free(ring);
     }
 }
 
-void globalusage(char *args, int background, const char *output_file)
+void ring_write(ring_buffer *ring, const char *bytes, size_t count)
 {
-    (void)args;
-    (void)background;
+    ring->total += count;
+    if (count >= ring->capacity)
+    {
+        // Only the tail of it fits
+        memcpy(ring->data, bytes + count - ring->capacity, ring->capacity);
+        ring->start = 0;
+        ring->length = ring->capacity;
+        return;
+    }
+
+    // Copy in at most two pieces, wrapping around the end of the buffer
+    size_t end = (ring->start + ring->length) % ring->capacity;
+    size_t first = ring->capacity - end;
+    if (first > count)
+    {
+        first = count;
+    }
+    memcpy(ring->data + end, bytes, first);
+    memcpy(ring->data, bytes + first, count - first);
+
+    ring->length += count;
+    if (ring->length > ring->capacity)
+    {
+        // Overwrote the oldest bytes
+        ring->start = (ring->start + ring->length - ring->capacity) % ring->capacity;
+        ring->length = ring->capacity;
+    }
+}
 
-    if (output_file != NULL)
+// Writes the kept bytes from `offset` (counted from the oldest byte) to the end into `out`
+void ring_print(const ring_buffer *ring, size_t offset, FILE *out)
+{
+    for (size_t i = offset; i < ring->length;)
     {
-        FILE *out = fopen(output_file, "a"); // Append mode
-        if (out == NULL)
+        size_t position = (ring->start + i) % ring->capacity;
+        size_t piece = ring->capacity - position;
+        if (piece > ring->length - i)
         {
-            fprintf(stderr, ANSI_COLOR_RED "imcsh: Failed to open file '%s' for writing\n" ANSI_COLOR_RESET, output_file);
-            return;
+            piece = ring->length - i;
         }
+        fwrite(ring->data + position, 1, piece, out);
+        i += piece;
+    }
+}
 
-        fprintf(out, "IMCSH Version 1.1 created by David Fodor\n");
-        fclose(out);
-
-        printf("Output redirected to -> %s\n", output_file);
+// Offset of the first byte of the last `lines` lines (a trailing newline doesn't start a new line)
+size_t ring_tail_offset(const ring_buffer *ring, int lines)
+{
+    size_t i = ring->length;
+    if (i > 0 && ring->data[(ring->start + i - 1) % ring->capacity] == '\n')
+    {
+        i--;
     }
-    else
+    while (i > 0)
     {
-        printf("IMCSH Version 1.1 created by David Fodor\n");
+        if (ring->data[(ring->start + i - 1) % ring->capacity] == '\n' && --lines == 0)
+        {
+            return i;
+        }
+        i--;
     }
+    return 0;
 }
 
-void echo(char *args, int background, const char *output_file)
+// ------------------
+// |   Event loop   |
+// ------------------
+// The shell waits for everything it reacts to with a single `epoll_wait`:
+// - the input (stdin or the script)
+// - one pidfd per child process, which becomes readable when that process exits
+// - a timerfd, armed for the earliest job timeout
+// - the SIGCHLD self-pipe, only needed for children that didn't get a pidfd (e.g. when out of file descriptors)
+// - another timerfd for writing out the metrics, once a file was set for them
+// - in the copy of the shell running `on-change` or `watch`, its inotify instance and its timerfd
+// Docs: https://man7.org/linux/man-pages/man7/epoll.7.html, https://man7.org/linux/man-pages/man2/pidfd_open.2.html
+#define MAX_EVENTS 64
+
+enum event_type
 {
-    (void)background;
+    EVENT_INPUT = 1,
+    EVENT_SIGCHLD,
+    EVENT_PIDFD, // The value is the pid
+    EVENT_TIMER,
+    EVENT_CAPTURE, // The value is the job slot
+    EVENT_METRICS,
+    EVENT_WATCH_CHANGE, // The inotify instance of `on-change`
+    EVENT_WATCH_TIMER,  // The debounce timer of `on-change`, the interval of `watch`
+};
 
-    if (output_file != NULL)
+int g_epoll_fd = -1;
+
+// Adds a file descriptor to the epoll set, the type and value come back with its events
+int event_watch(int fd, enum event_type type, unsigned int value)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = ((uint64_t)type << 32) | value;
+    return epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+// `pidfd_open` has no glibc wrapper here, so it is called directly
+int pidfd_open(pid_t pid)
+{
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+}
+
+// ---------------
+// |   Metrics   |
+// ---------------
+// Counters and latency histograms of what the shell does, shown by `stats` and optionally written to a file
+// - the histograms have fixed buckets, so recording is a few additions and they map 1:1 onto a Prometheus histogram
+// - `set metricsfile=PATH` rewrites the file every `metricsinterval` seconds in the Prometheus text format,
+//   e.g. for the textfile collector of node_exporter
+// Docs: https://prometheus.io/docs/instrumenting/exposition_formats/
+#define NUM_LATENCY_BUCKETS 20
+
+// Upper bounds of the buckets in seconds, from a fast spawn up to a long running background job
+const double g_latency_bounds[NUM_LATENCY_BUCKETS] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1,
+    0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 300, 3600};
+
+typedef struct
+{
+    unsigned long buckets[NUM_LATENCY_BUCKETS + 1]; // Not cumulative, the last one is everything above the bounds
+    unsigned long count;
+    double sum;
+    double max;
+} histogram;
+
+typedef struct
+{
+    unsigned long commands;         // Command lines that were not empty, the builtins are counted with the function table
+    unsigned long syntax_errors;
+    unsigned long unknown_commands;
+    unsigned long spawns;           // Processes started, every stage of a pipeline is one
+    unsigned long spawn_failures;   // Stages that could not be started, not found or their `exec` failed
+    unsigned long reaped;           // Processes reaped
+    int peak_jobs;                  // Most jobs running (or stopped) at the same time
+    histogram command_time;         // A whole command line, including the wait for a foreground job
+    histogram spawn_time;           // Starting a single process, until the backend returned
+    histogram foreground_wait;      // Waiting for a foreground job (also one continued with `fg`), until it finished or stopped
+    histogram background_lifetime;  // A background job, from its spawn until its last process was reaped
+} shell_metrics;
+
+shell_metrics g_metrics;
+
+void histogram_observe(histogram *h, double seconds)
+{
+    int i = 0;
+    while (i < NUM_LATENCY_BUCKETS && seconds > g_latency_bounds[i])
+    {
+        i++;
+    }
+    h->buckets[i]++;
+    h->count++;
+    h->sum += seconds;
+    if (seconds > h->max)
+    {
+        h->max = seconds;
+    }
+}
+
+// Estimates a quantile from the buckets, interpolating linearly inside the bucket it falls into (like `histogram_quantile`)
+double histogram_quantile(const histogram *h, double q)
+{
+    if (h->count == 0)
     {
-        FILE *out = fopen(output_file, "a"); // Append mode
-        if (out == NULL)
+        return 0;
+    }
+    double rank = q * h->count;
+    unsigned long seen = 0;
+    for (int i = 0; i <= NUM_LATENCY_BUCKETS; i++)
+    {
+        if (seen + h->buckets[i] >= rank && h->buckets[i] > 0)
         {
-            fprintf(stderr, ANSI_COLOR_RED "imcsh: Failed to open file '%s' for writing\n" ANSI_COLOR_RESET, output_file);
-            return;
+            double lower = (i == 0) ? 0 : g_latency_bounds[i - 1];
+            double upper = (i == NUM_LATENCY_BUCKETS) ? h->max : g_latency_bounds[i];
+            double estimate = lower + (upper - lower) * (rank - seen) / h->buckets[i];
+            return (estimate < h->max) ? estimate : h->max;
         }
+        seen += h->buckets[i];
+    }
+    return h->max;
+}
+
+// The periodic export, armed by `set metricsfile=`
+char *g_metrics_file = NULL;
+double g_metrics_interval = 15;
+int g_metrics_fd = -1;
 
-        fprintf(out, "%s\n", args);
-        fclose(out);
+// Defined with the `stats` builtin, which needs the function table
+void metrics_export();
 
-        printf("Output redirected to -> %s\n", output_file);
+// Arms the export timer for every `g_metrics_interval` seconds, or disarms it when there is no file
+void metrics_arm()
+{
+    if (g_metrics_fd == -1 && g_metrics_file == NULL)
+    {
+        return;
     }
-    else
+    if (g_metrics_fd == -1)
+    {
+        g_metrics_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (g_metrics_fd == -1 || event_watch(g_metrics_fd, EVENT_METRICS, 0) == -1)
+        {
+            perror("imcsh: metrics timer");
+            return;
+        }
+    }
+    struct itimerspec timer = {0};
+    if (g_metrics_file != NULL)
     {
-        printf("%s\n", args);
+        timer.it_interval.tv_sec = (time_t)g_metrics_interval;
+        timer.it_interval.tv_nsec = (long)((g_metrics_interval - (time_t)g_metrics_interval) * 1e9);
+        timer.it_value = timer.it_interval;
     }
+    timerfd_settime(g_metrics_fd, 0, &timer, NULL);
 }
 
-void quit_shell(char *args, int background, const char *output_file)
+// ---------------
+// |   Tracing   |
+// ---------------
+// `trace on FILE` records where the time of the shell goes: running a command line, parsing it, spawning, waiting for
+// and reaping its processes, and how long every process ran
+// - the events go into a ring buffer that is allocated (and touched) when tracing starts, recording one is two clock
+//   reads and a copy, no allocation and no I/O, once it is full the oldest are overwritten
+// - a span is recorded once it ended, with its start and end, so a ring that wrapped around never holds half of one
+// - `trace off` (or the shell exiting) writes them as Chrome trace-event JSON, for chrome://tracing or Perfetto: the
+//   shell is one track, every job another one, so background jobs running at the same time show up next to each other
+// Docs: https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU (Trace Event Format)
+#define DEFAULT_TRACE_EVENTS 65536
+#define TRACE_TEXT 64
+
+enum trace_kind
 {
-    (void)args;
-    (void)background;
-    (void)output_file;
+    TRACE_COMMAND, // A whole command line
+    TRACE_PARSE,
+    TRACE_SPAWN, // One process started by the spawn backend
+    TRACE_WAIT,  // Waiting for a foreground job
+    TRACE_REAP,  // Collecting an exited process and booking it into its job
+    TRACE_PROCESS, // The life of a process, on the track of its job
+};
+
+const char *g_trace_names[] = {"command", "parse", "spawn", "wait", "reap", "process"};
+
+typedef struct
+{
+    uint64_t start; // Nanoseconds of CLOCK_MONOTONIC
+    uint64_t end;
+    pid_t track; // The job's first process, 0 for the shell itself
+    pid_t pid;
+    int status; // The exit code, for a spawn the error of the backend
+    unsigned char kind;
+    char text[TRACE_TEXT];
+} trace_event;
 
-    if (num_running_processes > 0)
+typedef struct
+{
+    trace_event *events; // NULL while tracing is off
+    size_t capacity;
+    size_t count; // Recorded so far, the ring only holds the last `capacity`
+    char *file;
+    uint64_t started;
+} tracer;
+
+tracer g_trace = {NULL, 0, 0, NULL, 0};
+
+uint64_t timespec_ns(const struct timespec *time)
+{
+    return (uint64_t)time->tv_sec * 1000000000 + time->tv_nsec;
+}
+
+// Records a span from `start` to `end` (NULL for now), nothing while tracing is off
+void trace_span(enum trace_kind kind, const struct timespec *start, const struct timespec *end, pid_t track, pid_t pid,
+                int status, const char *text)
+{
+    if (g_trace.events == NULL)
     {
-        printf("The following processes are running:\n");
-        for (size_t i = 0; i < num_running_processes; ++i)
-        {
-            printf("    -> pid: %d\n", running_processes[i]);
-        }
+        return;
     }
+    struct timespec now;
+    if (end == NULL)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        end = &now;
+    }
+    trace_event *event = &g_trace.events[g_trace.count++ % g_trace.capacity];
+    event->start = timespec_ns(start);
+    event->end = timespec_ns(end);
+    event->track = track;
+    event->pid = pid;
+    event->status = status;
+    event->kind = (unsigned char)kind;
+    snprintf(event->text, TRACE_TEXT, "%s", text != NULL ? text : "");
+}
 
-    char answer;
-    int valid = 0; // Interesting how C didn't have bool in it's original form
+// Defined with the `trace` builtin, writes the trace out
+void trace_stop();
 
-    while (!valid)
+// The start of a span, only read from the clock while tracing
+void trace_begin(struct timespec *start)
+{
+    if (g_trace.events != NULL)
     {
-        printf("Are you sure you want to quit? [Y/n]: ");
+        clock_gettime(CLOCK_MONOTONIC, start);
+    }
+}
 
-        // Attempt to read a single character input
-        int result = scanf(" %c", &answer); // The space before %c skips any leading whitespace
+// -----------------
+// |   Job table   |
+// -----------------
+// Every `exec` (a single program or a whole pipeline) becomes a job, stored in a slot array
+// - the job id is simply the slot index + 1, freed slots are kept on a stack for reuse, so adding / removing is O(1)
+// - a pid -> slot hash map finds the job of a reaped child in O(1), no matter how many jobs are running
+// - the active jobs are also chained into a doubly linked list, so listing them never scans empty slots
+#define INITIAL_MAX_JOBS 64
+#define PIDFD_REAPED -2 // The pid may already belong to some other process, nothing must be sent to it
 
-        if (result == 1) // If successfull `scanf` returns 1
-        {
-            if (answer == 'y' || answer == 'Y' || answer == 'n' || answer == 'N')
-            {
-                valid = 1; // Valid input received
-            }
-            else
-            {
-                printf("Invalid input. Please enter 'Y' or 'n'.\n\n");
-            }
-        }
-        else
-        {
-            printf("Invalid input. Please enter 'Y' or 'n'.\n\n");
-        }
+// Resource limits of a job, from `exec --mem=1G ...` or the shell-wide ones of `limit`, RLIM_INFINITY where there is none
+#define NUM_LIMITS 5
+typedef struct
+{
+    rlim_t values[NUM_LIMITS];
+} job_limits;
 
-        // Clear the input buffer to remove any remaining characters
-        // This prevents leftover characters from being read in the next iteration
-        while (getchar() != '\n' && getchar() != EOF)
-            ;
-    }
+job_limits g_limits = {{RLIM_INFINITY, RLIM_INFINITY, RLIM_INFINITY, RLIM_INFINITY, RLIM_INFINITY}};
 
-    if (answer == 'n' || answer == 'N')
+typedef struct
+{
+    int in_use;
+    int background;
+    pid_t *pids;   // Every process of the pipeline, in stage order
+    int *pidfds;   // Their pidfds, -1 if none could be opened, PIDFD_REAPED once reaped
+    int proc_capacity; // Room in `pids` and `pidfds`, the arrays stay with the slot for its next job
+    int num_procs;
+    int num_alive; // The job is finished once this reaches 0
+    int status;    // `waitpid` status of the last stage, which decides the job's exit status
+    int spawn_error; // Exit code to report instead, when some stage of the pipeline could not be started
+    int quiet;     // Don't report the single processes, the one who started the job reports it as a whole
+    char *command; // The command line, for listings
+    size_t command_capacity;
+    struct timespec start_time; // When it was spawned (CLOCK_MONOTONIC)
+    struct timespec end_time;   // When its last process was reaped
+    struct rusage usage;        // Summed up from `wait4` for every reaped process
+    double timeout;             // Seconds the job may run, 0 for no limit
+    struct timespec deadline;   // When the timeout expires, moved forward once SIGTERM was sent
+    int timeout_stage;          // 0 = still running, 1 = SIGTERM sent, 2 = SIGKILL sent
+    int capture_fd;             // Read end of the pipe the job's stdout / stderr go into, -1 if not captured (or at EOF)
+    ring_buffer *capture;       // The most recent captured output
+    int finished;               // Done, but kept around so its captured output can still be looked at
+    pid_t pgid;                 // Process group of the job with job control, 0 when it stays in the shell's own
+    int stopped;                // Signal that stopped the job (e.g. SIGTSTP for Ctrl+Z), 0 while it runs
+    struct termios tmodes;      // Terminal modes the job had when it was stopped in the foreground, for `fg`
+    int has_tmodes;
+    job_limits limits;          // What the job was started with, to tell which limit a killed process ran into
+    int prev;      // Neighbours in the active list (slot indexes, -1 at the ends)
+    int next;
+} job;
+
+job *g_jobs = NULL;
+int g_jobs_capacity = 0;
+int g_jobs_used = 0;       // Slots handed out at least once, the ones above are untouched
+int *g_free_slots = NULL;  // Stack of released slots
+int g_num_free_slots = 0;
+int g_active_head = -1;
+int g_num_active_jobs = 0;
+int g_num_background_jobs = 0;
+int g_num_stopped_jobs = 0;
+
+// Finished jobs with captured output, oldest first - the oldest is dropped when a new one would not fit
+#define MAX_FINISHED_JOBS 16
+int g_finished_jobs[MAX_FINISHED_JOBS];
+int g_finished_first = 0;
+int g_num_finished_jobs = 0;
+
+// Children that have no pidfd, and can only be found by reaping on SIGCHLD
+int g_num_untracked = 0;
+
+// pid -> slot map, open addressing with linear probing, pid 0 marks an empty entry
+typedef struct
+{
+    pid_t pid;
+    int slot;
+    int index; // Position of the process in its job
+} pid_map_entry;
+
+pid_map_entry *g_pid_map = NULL;
+size_t g_pid_map_capacity = 0; // Always a power of 2
+size_t g_pid_map_count = 0;
+
+pid_map_entry *pid_map_find(pid_map_entry *map, size_t capacity, pid_t pid)
+{
+    size_t i = ((size_t)pid * 2654435761u) & (capacity - 1); // Knuth's multiplicative hash spreads consecutive pids
+    while (map[i].pid != 0 && map[i].pid != pid)
     {
-        return;
+        i = (i + 1) & (capacity - 1);
     }
-    else
+    return &map[i];
+}
+
+void pid_map_insert(pid_t pid, int slot, int index)
+{
+    // Keep the load factor under 1/2, so the probe sequences stay short
+    if ((g_pid_map_count + 1) * 2 > g_pid_map_capacity)
     {
-        // Loop through all the remaining children, killing them to not get orphan processes
-        // Source: https://stackoverflow.com/questions/6501522/how-to-kill-a-child-process-by-the-parent-process
-        if (num_running_processes > 0)
+        size_t new_capacity = g_pid_map_capacity ? g_pid_map_capacity * 2 : INITIAL_MAX_JOBS * 2;
+        pid_map_entry *new_map = calloc(new_capacity, sizeof(pid_map_entry));
+        if (new_map == NULL)
         {
-            // printf("The following processes are running:\n");
-            for (size_t i = 0; i < num_running_processes; ++i)
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < g_pid_map_capacity; i++)
+        {
+            if (g_pid_map[i].pid != 0)
             {
-                printf("Killing process with pid: %d...\n", running_processes[i]);
-                kill(running_processes[i], SIGKILL);
+                *pid_map_find(new_map, new_capacity, g_pid_map[i].pid) = g_pid_map[i];
             }
         }
+        free(g_pid_map);
+        g_pid_map = new_map;
+        g_pid_map_capacity = new_capacity;
     }
 
-    printf("Quitting shell...\n");
-    exit(0);
+    pid_map_entry *entry = pid_map_find(g_pid_map, g_pid_map_capacity, pid);
+    entry->pid = pid;
+    entry->slot = slot;
+    entry->index = index;
+    g_pid_map_count++;
 }
 
-void execute_program(char *args, int background, const char *output_file)
+// Looks up and removes a pid in one go, returns its slot (and position in the job) or -1 for a pid that is not ours
+int pid_map_take(pid_t pid, int *index)
 {
-    // Tokenize the args to create argv array of the function we actually want to execute
-    int bufsize = 64;
-    int position = 0;
-    char **argv = malloc(bufsize * sizeof(char *));
-    if (!argv)
+    if (g_pid_map_count == 0)
     {
-        fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
-        exit(EXIT_FAILURE);
+        return -1;
+    }
+    pid_map_entry *entry = pid_map_find(g_pid_map, g_pid_map_capacity, pid);
+    if (entry->pid == 0)
+    {
+        return -1;
     }
+    int slot = entry->slot;
+    *index = entry->index;
+    entry->pid = 0;
+    g_pid_map_count--;
 
-    char *token = strtok(args, " ");
-    while (token != NULL)
+    // Re-insert the rest of the probe cluster, so no lookup stops early at the new hole
+    size_t i = ((size_t)(entry - g_pid_map) + 1) & (g_pid_map_capacity - 1);
+    while (g_pid_map[i].pid != 0)
     {
-        argv[position++] = token;
+        pid_map_entry moved = g_pid_map[i];
+        g_pid_map[i].pid = 0;
+        *pid_map_find(g_pid_map, g_pid_map_capacity, moved.pid) = moved;
+        i = (i + 1) & (g_pid_map_capacity - 1);
+    }
+    return slot;
+}
 
-        if (position >= bufsize) // Dynamically add to the buffer size if it were exceeded
+// Registers the processes of a freshly spawned job, returns its slot
+// - `pidfds` are the ones the spawn backend already made (-1 where it didn't), the job takes them over
+// - `command` is copied, into the buffer the slot kept from its previous job when that is big enough
+int job_create(const pid_t *pids, const int *pidfds, int num_procs, int background, const char *command, const struct timespec *start_time)
+{
+    int slot;
+    if (g_num_free_slots > 0)
+    {
+        slot = g_free_slots[--g_num_free_slots];
+    }
+    else
+    {
+        if (g_jobs_used >= g_jobs_capacity)
         {
-            bufsize += 64;
-            argv = realloc(argv, bufsize * sizeof(char *));
-            if (!argv)
+            // Resize the arrays when all slots are taken
+            g_jobs_capacity = g_jobs_capacity ? g_jobs_capacity * 2 : INITIAL_MAX_JOBS;
+            g_jobs = realloc(g_jobs, g_jobs_capacity * sizeof(job));
+            g_free_slots = realloc(g_free_slots, g_jobs_capacity * sizeof(int));
+            if (g_jobs == NULL || g_free_slots == NULL)
             {
-                fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+                fprintf(stderr, "Memory reallocation failed\n");
                 exit(EXIT_FAILURE);
             }
         }
-
-        token = strtok(NULL, " ");
+        slot = g_jobs_used++;
+        g_jobs[slot].pids = NULL;
+        g_jobs[slot].pidfds = NULL;
+        g_jobs[slot].proc_capacity = 0;
+        g_jobs[slot].command = NULL;
+        g_jobs[slot].command_capacity = 0;
     }
-    argv[position] = NULL; // Null-terminate the argument list - expected by both `execvp` and `posix-spawn`
 
-    // ---------------
-    // SOLUTION 1:
-    // Fork a child process and run the function via execvp, that replaces the processes to be run
-    // Source: https://stackoverflow.com/questions/5460421/how-do-you-write-a-c-program-to-execute-another-program
-    // pid_t pid = fork();
-    // if (pid < 0)
+    // The freed slots are reused last in first out, so the same few buffers keep serving short foreground commands
+    job *j = &g_jobs[slot];
+    j->in_use = 1;
+    j->background = background;
+    if (j->proc_capacity < num_procs)
+    {
+        j->pids = realloc(j->pids, num_procs * sizeof(pid_t));
+        j->pidfds = realloc(j->pidfds, num_procs * sizeof(int));
+        j->proc_capacity = num_procs;
+    }
+    size_t command_size = strlen(command) + 1;
+    if (j->command_capacity < command_size)
+    {
+        free(j->command);
+        j->command = malloc(command_size);
+        j->command_capacity = command_size;
+    }
+    if (j->pids == NULL || j->pidfds == NULL || j->command == NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(j->pids, pids, num_procs * sizeof(pid_t));
+    memcpy(j->command, command, command_size);
+    j->num_procs = num_procs;
+    j->num_alive = num_procs;
+    j->status = 0;
+    j->spawn_error = 0;
+    j->quiet = 0;
+    j->start_time = *start_time;
+    memset(&j->usage, 0, sizeof(j->usage));
+    j->timeout = 0;
+    j->timeout_stage = 0;
+    j->capture_fd = -1;
+    j->capture = NULL;
+    j->finished = 0;
+    j->pgid = 0;
+    j->stopped = 0;
+    j->has_tmodes = 0;
+    for (int i = 0; i < NUM_LIMITS; i++)
+    {
+        j->limits.values[i] = RLIM_INFINITY; // `spawn_pipeline` sets the ones it was started with
+    }
+
+    // Push to the front of the active list
+    j->prev = -1;
+    j->next = g_active_head;
+    if (g_active_head != -1)
+    {
+        g_jobs[g_active_head].prev = slot;
+    }
+    g_active_head = slot;
+    g_num_active_jobs++;
+    if (g_num_active_jobs > g_metrics.peak_jobs)
+    {
+        g_metrics.peak_jobs = g_num_active_jobs;
+    }
+    if (background)
+    {
+        g_num_background_jobs++;
+    }
+
+    for (int i = 0; i < num_procs; i++)
+    {
+        pid_map_insert(pids[i], slot, i);
+
+        // The child can't be reaped by anybody else in between, so even an already exited one still has its pidfd
+        j->pidfds[i] = (pidfds[i] != -1) ? pidfds[i] : pidfd_open(pids[i]);
+        if (j->pidfds[i] != -1 && event_watch(j->pidfds[i], EVENT_PIDFD, (unsigned int)pids[i]) == -1)
+        {
+            close(j->pidfds[i]);
+            j->pidfds[i] = -1;
+        }
+        if (j->pidfds[i] == -1)
+        {
+            g_num_untracked++; // Falls back to being reaped on SIGCHLD
+        }
+    }
+    return slot;
+}
+
+// Takes a job out of the active list
+void job_unlink(int slot)
+{
+    job *j = &g_jobs[slot];
+    if (j->prev != -1)
+    {
+        g_jobs[j->prev].next = j->next;
+    }
+    else
+    {
+        g_active_head = j->next;
+    }
+    if (j->next != -1)
+    {
+        g_jobs[j->next].prev = j->prev;
+    }
+    g_num_active_jobs--;
+    if (j->background)
+    {
+        g_num_background_jobs--;
+    }
+    if (j->stopped)
+    {
+        j->stopped = 0;
+        g_num_stopped_jobs--;
+    }
+}
+
+// Frees what a job that is no longer in the active list holds and puts its slot back on the stack
+// - the pid arrays and the command buffer stay with the slot, for the next job to reuse
+void job_release(int slot)
+{
+    job *j = &g_jobs[slot];
+    if (j->capture_fd != -1)
+    {
+        close(j->capture_fd); // Also takes it out of the epoll set
+    }
+    ring_destroy(j->capture);
+    j->capture = NULL;
+    j->capture_fd = -1;
+    j->in_use = 0;
+    g_free_slots[g_num_free_slots++] = slot;
+}
+
+// Releases a finished job's slot
+void job_free(int slot)
+{
+    job_unlink(slot);
+    job_release(slot);
+}
+
+// A finished job with captured output is kept for `output` / `tail`, in place of the oldest such job
+void job_retire(int slot)
+{
+    job_unlink(slot);
+    g_jobs[slot].finished = 1;
+    if (g_num_finished_jobs == MAX_FINISHED_JOBS)
+    {
+        job_release(g_finished_jobs[g_finished_first]);
+        g_finished_first = (g_finished_first + 1) % MAX_FINISHED_JOBS;
+        g_num_finished_jobs--;
+    }
+    g_finished_jobs[(g_finished_first + g_num_finished_jobs) % MAX_FINISHED_JOBS] = slot;
+    g_num_finished_jobs++;
+}
+
+// -------------------
+// |   Job control   |
+// -------------------
+// An interactive shell on a terminal puts every job into a process group of its own, led by the job's first process
+// - the terminal belongs to one group at a time, so Ctrl+C and Ctrl+Z only reach the foreground job, never the shell
+//   itself or the jobs in the background
+// - the shell ignores the stop signals, a child gets their defaults back before it runs its program
+// - scripts keep every child in the shell's group, like other shells do, so a Ctrl+C on the script stops all of it
+// Source: https://www.gnu.org/software/libc/manual/html_node/Implementing-a-Shell.html
+int g_job_control = 0;
+pid_t g_shell_pgid = 0;
+pid_t g_original_pgid = 0;     // Owner of the terminal before the shell took it, it gets it back on exit
+struct termios g_shell_tmodes; // The shell's terminal modes, restored whenever it takes the terminal back
+sigset_t g_job_signals;        // Signals the shell ignores (or handles), reset to their default in the children
+volatile sig_atomic_t g_interrupted = 0; // Ctrl+C while the shell itself had the terminal, e.g. during `wait`
+int g_current_job = -1;        // The job `fg` and `bg` pick without an id, the one stopped or continued last
+
+// Takes the terminal, and starts to ignore the signals meant for the foreground job
+void job_control_init()
+{
+    if (!isatty(STDIN_FILENO))
+    {
+        return;
+    }
+    // Started in the background, e.g. `imcsh &` from another shell - wait until it is our turn instead of stealing the terminal
+    while (tcgetpgrp(STDIN_FILENO) != (g_original_pgid = getpgrp()))
+    {
+        kill(-g_original_pgid, SIGTTIN);
+    }
+
+    sigemptyset(&g_job_signals);
+    sigaddset(&g_job_signals, SIGINT); // Handled, not ignored, see `sigint_handler`
+    int ignored[] = {SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU};
+    for (size_t i = 0; i < sizeof(ignored) / sizeof(ignored[0]); i++)
+    {
+        signal(ignored[i], SIG_IGN);
+        sigaddset(&g_job_signals, ignored[i]);
+    }
+
+    // Lead a group of our own (a session leader already does), and make it the foreground one
+    setpgid(0, 0);
+    g_shell_pgid = getpgrp();
+    tcsetpgrp(STDIN_FILENO, g_shell_pgid);
+    tcgetattr(STDIN_FILENO, &g_shell_tmodes);
+    g_job_control = 1;
+}
+
+// Gives the terminal back to whoever had it before the shell
+void job_control_exit()
+{
+    if (g_job_control && g_original_pgid != g_shell_pgid)
+    {
+        tcsetpgrp(STDIN_FILENO, g_original_pgid);
+    }
+}
+
+// Hands the terminal to a job that runs in the foreground, with the modes it had when it was stopped
+void terminal_give(int slot)
+{
+    job *j = &g_jobs[slot];
+    if (!g_job_control || j->pgid == 0)
+    {
+        return;
+    }
+    if (j->has_tmodes)
+    {
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &j->tmodes);
+    }
+    tcsetpgrp(STDIN_FILENO, j->pgid);
+}
+
+// Takes the terminal back from a foreground job that finished or stopped, and restores the shell's modes
+// - a stopped job keeps its own modes for later, e.g. an editor that put the terminal in raw mode
+void terminal_take(int slot)
+{
+    if (!g_job_control)
+    {
+        return;
+    }
+    job *j = &g_jobs[slot];
+    if (j->stopped)
+    {
+        j->has_tmodes = (tcgetattr(STDIN_FILENO, &j->tmodes) == 0);
+    }
+    tcsetpgrp(STDIN_FILENO, g_shell_pgid);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &g_shell_tmodes);
+}
+
+// Marks a job as stopped by `sig`, or running again with 0
+void job_set_stopped(int slot, int sig)
+{
+    job *j = &g_jobs[slot];
+    g_num_stopped_jobs += (sig != 0) - (j->stopped != 0);
+    j->stopped = sig;
+    if (sig != 0)
+    {
+        g_current_job = slot;
+    }
+}
+
+// Sends `sig` to the processes of a job that were not reaped yet
+void job_signal(int slot, int sig)
+{
+    job *j = &g_jobs[slot];
+    if (j->pgid != 0)
+    {
+        // The group lives on as long as any member does, even a zombie, so its id can't have been reused
+        // - this also reaches whatever the job's processes started themselves
+        kill(-j->pgid, sig);
+        return;
+    }
+    for (int i = 0; i < j->num_procs; i++)
+    {
+        if (j->pidfds[i] >= 0)
+        {
+            syscall(SYS_pidfd_send_signal, j->pidfds[i], sig, NULL, 0); // Can't hit a recycled pid, unlike `kill`
+        }
+        else if (j->pidfds[i] == -1)
+        {
+            kill(j->pids[i], sig); // Not reaped yet, so the pid is still ours (a zombie at worst)
+        }
+    }
+}
+
+// Lets a stopped job run again
+void job_continue(int slot)
+{
+    if (g_jobs[slot].stopped)
+    {
+        job_set_stopped(slot, 0);
+        job_signal(slot, SIGCONT);
+    }
+}
+
+// The job `fg` and `bg` mean without an id: the current one, otherwise the newest in the background
+int current_job()
+{
+    if (g_current_job != -1 && g_jobs[g_current_job].in_use && !g_jobs[g_current_job].finished && g_jobs[g_current_job].background)
+    {
+        return g_current_job;
+    }
+    for (int slot = g_active_head; slot != -1; slot = g_jobs[slot].next)
+    {
+        if (g_jobs[slot].background)
+        {
+            return slot; // The list is newest first
+        }
+    }
+    return -1;
+}
+
+// ----------------------------
+// |   Reaping the children   |
+// ----------------------------
+// Children are reaped when their pidfd becomes readable, each one with a targeted `wait4`
+// The SIGCHLD handler only writes a byte into a self-pipe, for the rare child that has no pidfd
+// - `printf`, `malloc` and the job table are not async-signal-safe, using them from the handler corrupted output under load
+// Source: https://cr.yp.to/docs/selfpipe.html
+int g_sigchld_pipe[2] = {-1, -1};
+
+// Set while the prompt is showing and the shell waits for a line
+int g_at_prompt = 0;
+// Set while the line editor reads a line, it draws the prompt (and what was typed) again after a report
+int g_editing = 0;
+void editor_refresh();
+// `set notify=on` reports finished background jobs right away, otherwise they are reported before the next prompt
+// - reporting right away prints over whatever was typed at the prompt so far
+int g_notify = 0;
+
+// Background job reports waiting for the next prompt
+FILE *g_pending_reports = NULL;
+char *g_pending_buffer = NULL;
+size_t g_pending_size = 0;
+int g_printed_at_prompt = 0; // Something was printed over the prompt, which needs to be drawn again
+
+// Where a background job report should go right now
+FILE *report_stream()
+{
+    if (!g_interactive)
+    {
+        return stdout; // Scripts just get it in order
+    }
+    if (g_notify)
+    {
+        if (g_at_prompt && !g_printed_at_prompt)
+        {
+            printf(g_editing ? "\r\x1b[K" : "\n"); // Move off the line of the prompt, the editor clears it instead
+        }
+        g_printed_at_prompt = g_at_prompt;
+        return stdout;
+    }
+    if (g_pending_reports == NULL)
+    {
+        g_pending_reports = open_memstream(&g_pending_buffer, &g_pending_size);
+        if (g_pending_reports == NULL)
+        {
+            return stdout;
+        }
+    }
+    return g_pending_reports;
+}
+
+// Prints the reports collected since the last prompt
+void flush_reports()
+{
+    if (g_pending_reports == NULL)
+    {
+        return;
+    }
+    fclose(g_pending_reports); // Finalizes the buffer and its size
+    fwrite(g_pending_buffer, 1, g_pending_size, stdout);
+    free(g_pending_buffer);
+    g_pending_reports = NULL;
+    g_pending_buffer = NULL;
+}
+
+// Moves what a captured job has written so far into its ring buffer, without blocking
+void drain_capture(int slot)
+{
+    job *j = &g_jobs[slot];
+    char buffer[65536];
+    while (j->capture_fd != -1)
+    {
+        ssize_t bytes = read(j->capture_fd, buffer, sizeof(buffer));
+        if (bytes > 0)
+        {
+            ring_write(j->capture, buffer, bytes);
+        }
+        else if (bytes == 0 || (errno != EAGAIN && errno != EINTR))
+        {
+            // EOF - every process holding the write end is gone
+            close(j->capture_fd);
+            j->capture_fd = -1;
+        }
+        else if (errno == EAGAIN)
+        {
+            break;
+        }
+    }
+}
+
+// Defined with the spawn backends, which apply the limits
+int limit_note(char *buffer, size_t size, const job_limits *limits, int status, const struct rusage *usage);
+
+// Books a reaped process into its job, reports it and releases a finished background job
+void process_exited(int slot, int index, int status, const struct rusage *usage, const struct timespec *now)
+{
+    job *j = &g_jobs[slot];
+    pid_t pid = j->pids[index];
+    if (j->pidfds[index] != -1)
+    {
+        close(j->pidfds[index]); // Also takes it out of the epoll set
+    }
+    else
+    {
+        g_num_untracked--;
+    }
+    j->pidfds[index] = PIDFD_REAPED;
+
+    if (index == j->num_procs - 1)
+    {
+        j->status = status;
+    }
+    j->num_alive--;
+    j->end_time = *now;
+    g_metrics.reaped++;
+    trace_span(TRACE_PROCESS, &j->start_time, now, j->pids[0], pid, exit_code(status), j->command);
+    add_usage(&j->usage, usage);
+    double wall = elapsed_seconds(&j->start_time, now);
+    char note[96];
+    const char *limit = limit_note(note, sizeof(note), &j->limits, status, usage) ? note : NULL;
+
+    if (!j->background)
+    {
+        if (!j->quiet)
+        {
+            report_status(stdout, "Process", pid, status, usage, wall, limit);
+        }
+        return; // Freed by `wait_for_job` (or `parallel`), which still needs the status
+    }
+
+    report_status(report_stream(), "Background process", pid, status, usage, wall, limit);
+    if (j->num_alive == 0)
+    {
+        histogram_observe(&g_metrics.background_lifetime, wall);
+        if (j->capture != NULL)
+        {
+            drain_capture(slot); // Whatever is still in the pipe, without waiting for EOF
+            job_retire(slot);
+        }
+        else
+        {
+            job_free(slot);
+        }
+    }
+}
+
+// Reaps a single child whose pidfd became readable
+void reap_pid(pid_t pid, const struct timespec *now)
+{
+    int status;
+    struct rusage usage; // CPU time, memory and context switches of the terminated process
+    struct timespec trace_start;
+    trace_begin(&trace_start);
+    // `wait4` is `waitpid` that also hands back the resource usage of the reaped child
+    if (wait4(pid, &status, WNOHANG, &usage) <= 0)
+    {
+        return; // Already reaped by the SIGCHLD fallback
+    }
+    int index;
+    int slot = pid_map_take(pid, &index);
+    if (slot != -1)
+    {
+        process_exited(slot, index, status, &usage, now);
+    }
+    trace_span(TRACE_REAP, &trace_start, NULL, 0, pid, exit_code(status), NULL);
+}
+
+// Books a process that was stopped by `sig`, or continued with 0, into its job
+// - a job counts as stopped as soon as one of its processes is, Ctrl+Z stops all of them at once anyway
+void process_stopped(pid_t pid, int sig)
+{
+    if (g_pid_map_count == 0)
+    {
+        return;
+    }
+    pid_map_entry *entry = pid_map_find(g_pid_map, g_pid_map_capacity, pid);
+    if (entry->pid == 0 || (sig != 0) == (g_jobs[entry->slot].stopped != 0))
+    {
+        return; // Not ours, or the job is already in that state
+    }
+    int slot = entry->slot;
+    job_set_stopped(slot, sig);
+    if (sig != 0 && g_jobs[slot].background)
+    {
+        // A stopped foreground job is reported by `wait_for_job`, once the shell has the terminal back
+        fprintf(report_stream(), "Job %d stopped by SIG%s: %s\n", slot + 1, sigabbrev_np(sig), g_jobs[slot].command);
+    }
+}
+
+// Reaps every finished child, used when SIGCHLD arrives and some children have no pidfd
+// - also the only place stopped and continued children show up, their pidfd only becomes readable once they exit
+void reap_untracked(const struct timespec *now)
+{
+    char drain[256];
+    while (read(g_sigchld_pipe[0], drain, sizeof(drain)) > 0)
+        ;
+
+    // Without WEXITED `waitid` leaves the exited children alone, those stay with their pidfds
+    siginfo_t info;
+    info.si_pid = 0;
+    while (waitid(P_ALL, 0, &info, WSTOPPED | WCONTINUED | WNOHANG) == 0 && info.si_pid != 0)
+    {
+        process_stopped(info.si_pid, (info.si_code == CLD_STOPPED) ? info.si_status : 0);
+        info.si_pid = 0;
+    }
+
+    if (g_num_untracked == 0)
+    {
+        return; // Every child has a pidfd, those report themselves
+    }
+
+    pid_t pid;           // Init storage of terminated PID
+    int status;          // Init storage of status of the terminated process
+    struct rusage usage; // CPU time, memory and context switches of the terminated process
+
+    // Loop to reap all terminated child processes - avoinding zombies
+    // - loop is apparently used because SIGCHIL signal might indicate more than 1 terminated children
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) // -1 = we wait for any process, WHOHANG means there is no blocking if no zombie child process found
+    {
+        int index;
+        int slot = pid_map_take(pid, &index);
+        if (slot != -1)
+        {
+            process_exited(slot, index, status, &usage, now);
+        }
+    }
+}
+
+// ---------------------
+// |   Job timeouts    |
+// ---------------------
+// `exec --timeout=SECS ...` gives a job a deadline, a single timerfd is armed for the earliest one
+// - on expiry the job gets SIGTERM, and if it is still around after a grace period SIGKILL
+#define TIMEOUT_KILL_GRACE 3.0
+
+int g_timer_fd = -1;
+
+struct timespec timespec_add(struct timespec time, double seconds)
+{
+    time.tv_sec += (time_t)seconds;
+    time.tv_nsec += (long)((seconds - (time_t)seconds) * 1e9);
+    if (time.tv_nsec >= 1000000000L)
+    {
+        time.tv_sec++;
+        time.tv_nsec -= 1000000000L;
+    }
+    return time;
+}
+
+// Arms the timer for the earliest pending deadline, or disarms it when there is none
+void arm_job_timer()
+{
+    struct itimerspec timer = {0};
+    int found = 0;
+    for (int slot = g_active_head; slot != -1; slot = g_jobs[slot].next)
+    {
+        job *j = &g_jobs[slot];
+        if (j->timeout > 0 && j->timeout_stage < 2 && j->num_alive > 0 &&
+            (!found || elapsed_seconds(&j->deadline, &timer.it_value) > 0))
+        {
+            timer.it_value = j->deadline;
+            found = 1;
+        }
+    }
+    if (found && timer.it_value.tv_sec == 0 && timer.it_value.tv_nsec == 0)
+    {
+        timer.it_value.tv_nsec = 1; // An all-zero value would disarm instead
+    }
+    timerfd_settime(g_timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+// Gives a freshly spawned job its deadline
+void job_set_timeout(int slot, double timeout)
+{
+    job *j = &g_jobs[slot];
+    j->timeout = timeout;
+    j->deadline = timespec_add(j->start_time, timeout);
+    arm_job_timer();
+}
+
+// Signals every job whose deadline passed
+void handle_timeouts(const struct timespec *now)
+{
+    uint64_t expirations;
+    read(g_timer_fd, &expirations, sizeof(expirations));
+
+    for (int slot = g_active_head; slot != -1; slot = g_jobs[slot].next)
+    {
+        job *j = &g_jobs[slot];
+        if (j->timeout == 0 || j->timeout_stage >= 2 || j->num_alive == 0 || elapsed_seconds(&j->deadline, now) < 0)
+        {
+            continue;
+        }
+
+        int sig = (j->timeout_stage == 0) ? SIGTERM : SIGKILL;
+        if (j->timeout_stage == 0)
+        {
+            fprintf(j->background ? report_stream() : stdout, "Job %d timed out after %gs, sending SIGTERM\n", slot + 1, j->timeout);
+            j->deadline = timespec_add(*now, TIMEOUT_KILL_GRACE);
+        }
+        else
+        {
+            fprintf(j->background ? report_stream() : stdout, "Job %d still running, sending SIGKILL\n", slot + 1);
+        }
+        j->timeout_stage++;
+        job_signal(slot, sig);
+        if (j->stopped)
+        {
+            job_continue(slot); // A stopped process would only act on the signal once it runs again
+        }
+    }
+    arm_job_timer();
+}
+
+// ------------------------
+// |   Waiting on events  |
+// ------------------------
+int g_input_fd = -1;      // The input file descriptor currently in the epoll set
+int g_input_ready = 0;
+
+// Defined with the `on-change` and `watch` builtins
+void watcher_changed();
+void watcher_due();
+
+// Creates the epoll set, watching the SIGCHLD self-pipe and the job timer from the start
+// - also run by a list in the background, in its copy of the shell, which must not share the set with the shell
+void events_init()
+{
+    // The self-pipe the SIGCHLD handler writes into, non-blocking on both ends
+    if (pipe2(g_sigchld_pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+    {
+        perror("imcsh: pipe");
+        exit(EXIT_FAILURE);
+    }
+    g_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    g_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (g_epoll_fd == -1 || g_timer_fd == -1 ||
+        event_watch(g_sigchld_pipe[0], EVENT_SIGCHLD, 0) == -1 || event_watch(g_timer_fd, EVENT_TIMER, 0) == -1)
+    {
+        perror("imcsh: epoll");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Waits up to `timeout_ms` (-1 = forever) for events and handles all of them
+void run_events(int timeout_ms)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int count = epoll_wait(g_epoll_fd, events, MAX_EVENTS, timeout_ms);
+    if (count == -1)
+    {
+        if (errno != EINTR)
+        {
+            perror("imcsh: epoll_wait");
+        }
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    g_printed_at_prompt = 0;
+    for (int i = 0; i < count; i++)
+    {
+        unsigned int value = (unsigned int)events[i].data.u64;
+        switch ((enum event_type)(events[i].data.u64 >> 32))
+        {
+        case EVENT_INPUT:
+            g_input_ready = 1;
+            break;
+        case EVENT_SIGCHLD:
+            reap_untracked(&now);
+            break;
+        case EVENT_PIDFD:
+            reap_pid((pid_t)value, &now);
+            break;
+        case EVENT_TIMER:
+            handle_timeouts(&now);
+            break;
+        case EVENT_CAPTURE:
+            if (g_jobs[value].in_use && g_jobs[value].capture_fd != -1)
+            {
+                drain_capture((int)value);
+            }
+            break;
+        case EVENT_METRICS:
+            metrics_export();
+            break;
+        case EVENT_WATCH_CHANGE:
+            watcher_changed();
+            break;
+        case EVENT_WATCH_TIMER:
+            watcher_due();
+            break;
+        }
+    }
+
+    if (g_printed_at_prompt)
+    {
+        // Reports were printed over the prompt, draw a fresh one - with the editor including what was typed so far
+        if (g_editing)
+        {
+            editor_refresh();
+        }
+        else
+        {
+            prompt_user();
+        }
+    }
+    fflush(stdout); // Ensure the message is printed immediately - disregarding current input wait
+}
+
+// Sleeps until a child changes state (or another event arrives) and handles it
+void wait_for_children()
+{
+    run_events(-1);
+}
+
+// The exit code of a finished job, as a shell would report it
+int job_exit_code(int slot)
+{
+    job *j = &g_jobs[slot];
+    return j->spawn_error ? j->spawn_error : exit_code(j->status);
+}
+
+// Totals of the last foreground job, picked up by the `time` builtin
+struct rusage g_last_job_usage;
+double g_last_job_wall = 0;
+int g_last_job_valid = 0;
+
+// Blocks until every process of a foreground job has finished, then releases it
+// - returns the exit code of the job
+// - a job stopped with Ctrl+Z is not released, it goes on in the background (stopped) and 128 + the signal is returned
+int wait_for_job(int slot)
+{
+    job *j = &g_jobs[slot];
+    struct timespec wait_start, wait_end;
+    clock_gettime(CLOCK_MONOTONIC, &wait_start);
+    while (j->num_alive > 0 && !j->stopped)
+    {
+        wait_for_children();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &wait_end);
+    histogram_observe(&g_metrics.foreground_wait, elapsed_seconds(&wait_start, &wait_end));
+    trace_span(TRACE_WAIT, &wait_start, &wait_end, 0, j->pids[0], 0, j->command);
+    terminal_take(slot);
+    if (j->stopped && j->num_alive > 0)
+    {
+        j->background = 1;
+        g_num_background_jobs++;
+        printf("\nJob %d stopped by SIG%s: %s\n", slot + 1, sigabbrev_np(j->stopped), j->command);
+        return 128 + j->stopped;
+    }
+    int code = job_exit_code(slot);
+    g_last_job_usage = g_jobs[slot].usage;
+    g_last_job_wall = elapsed_seconds(&g_jobs[slot].start_time, &g_jobs[slot].end_time);
+    g_last_job_valid = 1;
+    if (j->capture != NULL)
+    {
+        drain_capture(slot); // A captured job brought to the foreground with `fg`, its output is kept for `output`
+        job_retire(slot);
+    }
+    else
+    {
+        job_free(slot);
+    }
+    return code;
+}
+
+// Blocks until `fd` has input, handling every other event in the meantime
+// - the input is registered one-shot, so typed-ahead input doesn't wake the loop while a foreground job runs
+void wait_for_input(int fd)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.u64 = (uint64_t)EVENT_INPUT << 32;
+    int op = (fd == g_input_fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (op == EPOLL_CTL_ADD && g_input_fd != -1)
+    {
+        epoll_ctl(g_epoll_fd, EPOLL_CTL_DEL, g_input_fd, NULL); // Only one input is read at a time
+        g_input_fd = -1;
+    }
+    if (epoll_ctl(g_epoll_fd, op, fd, &event) == -1)
+    {
+        return; // e.g. EPERM for a regular file, which is always readable anyway
+    }
+    g_input_fd = fd;
+
+    g_input_ready = 0;
+    while (!g_input_ready)
+    {
+        run_events(-1);
+    }
+}
+
+// Streaming line reader, pulls the input in big `read` chunks and hands out lines straight from its buffer
+// - unlike `fgets` into a fixed buffer there is no line length limit, the buffer just grows for a longer line
+// - a returned line is NUL terminated in place and only valid until the next call
+#define READER_BUFFER_SIZE 65536
+
+typedef struct
+{
+    int fd;          // -1 for a reader over a fixed string (`-c`)
+    char *buffer;
+    size_t capacity;
+    size_t start;    // First byte not handed out yet
+    size_t end;      // End of the valid data
+    size_t scanned;  // Bytes after `start` already known not to contain a newline
+    int eof;
+} line_reader;
+
+line_reader g_input = {-1, NULL, 0, 0, 0, 0, 1};
+
+void reader_init(line_reader *reader, int fd)
+{
+    reader->fd = fd;
+    reader->capacity = READER_BUFFER_SIZE;
+    reader->buffer = malloc(reader->capacity);
+    if (reader->buffer == NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+        exit(EXIT_FAILURE);
+    }
+    reader->start = reader->end = reader->scanned = 0;
+    reader->eof = 0;
+}
+
+// A reader over an in-memory string, used for `imcsh -c "cmd"`
+void reader_init_string(line_reader *reader, const char *str)
+{
+    reader->fd = -1;
+    reader->end = strlen(str);
+    reader->capacity = reader->end + 1;
+    reader->buffer = strdup(str);
+    if (reader->buffer == NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+        exit(EXIT_FAILURE);
+    }
+    reader->start = reader->scanned = 0;
+    reader->eof = 1;
+}
+
+void reader_destroy(line_reader *reader)
+{
+    if (reader->fd > STDIN_FILENO)
+    {
+        close(reader->fd);
+    }
+    free(reader->buffer);
+    reader->buffer = NULL;
+}
+
+// Returns the next line without its newline, or NULL once the input is exhausted
+char *reader_next_line(line_reader *reader)
+{
+    while (1)
+    {
+        // Look for the end of the line in what is already buffered
+        char *newline = memchr(reader->buffer + reader->start + reader->scanned, '\n', reader->end - reader->start - reader->scanned);
+        if (newline != NULL)
+        {
+            *newline = '\0';
+            char *line = reader->buffer + reader->start;
+            reader->start = newline + 1 - reader->buffer;
+            reader->scanned = 0;
+            return line;
+        }
+        reader->scanned = reader->end - reader->start;
+
+        if (reader->eof)
+        {
+            if (reader->start == reader->end)
+            {
+                return NULL;
+            }
+            // Last line without a trailing newline, there is always a spare byte for the terminator
+            reader->buffer[reader->end] = '\0';
+            char *line = reader->buffer + reader->start;
+            reader->start = reader->end;
+            reader->scanned = 0;
+            return line;
+        }
+
+        // Make room - move the unfinished line to the front, or grow the buffer if the line fills all of it
+        if (reader->start > 0)
+        {
+            memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        if (reader->end + 1 >= reader->capacity)
+        {
+            reader->capacity *= 2;
+            reader->buffer = realloc(reader->buffer, reader->capacity);
+            if (reader->buffer == NULL)
+            {
+                fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        wait_for_input(reader->fd);
+        ssize_t bytes = read(reader->fd, reader->buffer + reader->end, reader->capacity - 1 - reader->end);
+        if (bytes > 0)
+        {
+            reader->end += bytes;
+        }
+        else if (bytes == 0)
+        {
+            reader->eof = 1;
+        }
+        else if (errno != EINTR)
+        {
+            perror("imcsh: read");
+            reader->eof = 1;
+        }
+    }
+}
+
+// -------------------
+// |   Environment   |
+// -------------------
+// The variables programs get live in a hash table (open addressing, linear probing), seeded from `environ` at startup
+// - `export NAME=value` and `unset NAME` change it, `$NAME` and `${NAME}` in a command expand to a value
+// - programs get it as an `envp` array, which is only rebuilt when a variable changed since the last spawn, so a batch
+//   of thousands of commands keeps handing out the same array
+#define INITIAL_ENV_CAPACITY 128
+
+typedef struct
+{
+    char *name;  // NULL marks an empty slot
+    char *entry; // `NAME=value`, the way it goes into the `envp` array
+} env_var;
+
+env_var *g_env = NULL;
+size_t g_env_capacity = 0; // Always a power of 2
+size_t g_env_count = 0;
+char **g_envp = NULL;      // NULL terminated, points at the entries of the table
+int g_envp_dirty = 1;      // A variable changed since `g_envp` was built
+
+// FNV-1a, simple and good enough for short command names
+// Source: http://www.isthe.com/chongo/tech/comp/fnv/index.html
+unsigned long hash_string(const char *str)
+{
+    unsigned long hash = 14695981039346656037UL;
+    while (*str)
+    {
+        hash ^= (unsigned char)*str++;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+// Finds the slot of `name`, or the empty slot where it would be inserted
+env_var *env_slot(env_var *table, size_t capacity, const char *name)
+{
+    size_t i = hash_string(name) & (capacity - 1);
+    while (table[i].name != NULL && strcmp(table[i].name, name) != 0)
+    {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &table[i];
+}
+
+// Returns the value of a variable, or NULL if it is not set
+const char *env_get(const char *name)
+{
+    if (g_env_count == 0)
+    {
+        return NULL;
+    }
+    env_var *slot = env_slot(g_env, g_env_capacity, name);
+    return (slot->name != NULL) ? slot->entry + strlen(slot->name) + 1 : NULL;
+}
+
+void env_set(const char *name, const char *value)
+{
+    // Keep the load factor under 3/4, doubling the table when needed
+    if ((g_env_count + 1) * 4 > g_env_capacity * 3)
+    {
+        size_t new_capacity = g_env_capacity ? g_env_capacity * 2 : INITIAL_ENV_CAPACITY;
+        env_var *new_table = calloc(new_capacity, sizeof(env_var));
+        if (new_table == NULL)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < g_env_capacity; i++)
+        {
+            if (g_env[i].name != NULL)
+            {
+                *env_slot(new_table, new_capacity, g_env[i].name) = g_env[i];
+            }
+        }
+        free(g_env);
+        g_env = new_table;
+        g_env_capacity = new_capacity;
+    }
+
+    env_var *slot = env_slot(g_env, g_env_capacity, name);
+    size_t name_length = strlen(name);
+    size_t value_length = strlen(value);
+    char *entry = malloc(name_length + value_length + 2);
+    if (entry == NULL || (slot->name == NULL && (slot->name = strdup(name)) == NULL))
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(entry, name, name_length);
+    entry[name_length] = '=';
+    memcpy(entry + name_length + 1, value, value_length + 1);
+    if (slot->entry != NULL)
+    {
+        free(slot->entry); // The name stays, only the value changed
+    }
+    else
+    {
+        g_env_count++;
+    }
+    slot->entry = entry;
+    g_envp_dirty = 1;
+}
+
+void env_unset(const char *name)
+{
+    if (g_env_count == 0)
+    {
+        return;
+    }
+    env_var *slot = env_slot(g_env, g_env_capacity, name);
+    if (slot->name == NULL)
+    {
+        return;
+    }
+    free(slot->name);
+    free(slot->entry);
+    slot->name = NULL;
+    slot->entry = NULL;
+    g_env_count--;
+    g_envp_dirty = 1;
+
+    // Move the entries after it back into the gap where they belong, so lookups don't stop early
+    size_t i = ((size_t)(slot - g_env) + 1) & (g_env_capacity - 1);
+    while (g_env[i].name != NULL)
+    {
+        env_var moved = g_env[i];
+        g_env[i].name = NULL;
+        g_env[i].entry = NULL;
+        *env_slot(g_env, g_env_capacity, moved.name) = moved;
+        i = (i + 1) & (g_env_capacity - 1);
+    }
+}
+
+// Seeds the table with the environment the shell was started with
+void env_init()
+{
+    extern char **environ;
+    for (char **var = environ; *var != NULL; var++)
+    {
+        char *equals = strchr(*var, '=');
+        if (equals == NULL || equals == *var)
+        {
+            continue;
+        }
+        // Names can be of any length, programs started by the shell still get the long ones
+        char *name = strndup(*var, equals - *var);
+        if (name == NULL)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+            exit(EXIT_FAILURE);
+        }
+        env_set(name, equals + 1);
+        free(name);
+    }
+}
+
+// The `envp` array for a spawn, rebuilt only if a variable changed since the last time
+char **env_array()
+{
+    if (g_envp_dirty)
+    {
+        free(g_envp);
+        g_envp = malloc((g_env_count + 1) * sizeof(char *));
+        if (g_envp == NULL)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+            exit(EXIT_FAILURE);
+        }
+        size_t n = 0;
+        for (size_t i = 0; i < g_env_capacity; i++)
+        {
+            if (g_env[i].name != NULL)
+            {
+                g_envp[n++] = g_env[i].entry;
+            }
+        }
+        g_envp[n] = NULL;
+        g_envp_dirty = 0;
+    }
+    return g_envp;
+}
+
+// 1 if `name` can be a variable name - a letter or `_`, followed by letters, digits and `_`
+int env_valid_name(const char *name, size_t length)
+{
+    if (length == 0 || !(isalpha((unsigned char)name[0]) || name[0] == '_'))
+    {
+        return 0;
+    }
+    for (size_t i = 1; i < length; i++)
+    {
+        if (!(isalnum((unsigned char)name[i]) || name[i] == '_'))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// -------------------------
+// |   PATH lookup cache   |
+// -------------------------
+// `posix_spawnp` resolves the program name by trying `execve` in every directory of PATH, one failed syscall each
+// Instead the absolute paths get remembered in a hash table (open addressing, linear probing), like `hash` in bash
+// - the table is dropped when PATH itself changes
+// - inotify watches the PATH directories, so adding / removing a binary only drops the names it affects
+// Docs: https://man7.org/linux/man-pages/man7/inotify.7.html
+#define INITIAL_HASH_CAPACITY 64
+
+typedef struct
+{
+    char *name; // NULL marks an empty slot
+    char *path;
+    unsigned long hits;
+} path_cache_entry;
+
+path_cache_entry *g_path_cache = NULL;
+size_t g_path_cache_capacity = 0; // Always a power of 2
+size_t g_path_cache_count = 0;
+char *g_path_cache_env = NULL; // The PATH the cached entries were resolved against
+int g_path_inotify_fd = -1;
+
+// Finds the slot of `name`, or the empty slot where it would be inserted
+path_cache_entry *path_cache_slot(path_cache_entry *table, size_t capacity, const char *name)
+{
+    size_t i = hash_string(name) & (capacity - 1);
+    while (table[i].name != NULL && strcmp(table[i].name, name) != 0)
+    {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &table[i];
+}
+
+void path_cache_clear()
+{
+    for (size_t i = 0; i < g_path_cache_capacity; i++)
+    {
+        if (g_path_cache[i].name != NULL)
+        {
+            free(g_path_cache[i].name);
+            free(g_path_cache[i].path);
+            g_path_cache[i].name = NULL;
+        }
+    }
+    g_path_cache_count = 0;
+}
+
+// Removes a single name, re-inserting the rest of its probe cluster so lookups don't stop early at the new hole
+void path_cache_remove(const char *name)
+{
+    if (g_path_cache_count == 0)
+    {
+        return;
+    }
+    path_cache_entry *slot = path_cache_slot(g_path_cache, g_path_cache_capacity, name);
+    if (slot->name == NULL)
+    {
+        return;
+    }
+    free(slot->name);
+    free(slot->path);
+    slot->name = NULL;
+    g_path_cache_count--;
+
+    size_t i = ((size_t)(slot - g_path_cache) + 1) & (g_path_cache_capacity - 1);
+    while (g_path_cache[i].name != NULL)
+    {
+        path_cache_entry moved = g_path_cache[i];
+        g_path_cache[i].name = NULL;
+        *path_cache_slot(g_path_cache, g_path_cache_capacity, moved.name) = moved;
+        i = (i + 1) & (g_path_cache_capacity - 1);
+    }
+}
+
+path_cache_entry *path_cache_insert(const char *name, const char *path)
+{
+    // Keep the load factor under 3/4, doubling the table when needed
+    if ((g_path_cache_count + 1) * 4 > g_path_cache_capacity * 3)
+    {
+        size_t new_capacity = g_path_cache_capacity ? g_path_cache_capacity * 2 : INITIAL_HASH_CAPACITY;
+        path_cache_entry *new_table = calloc(new_capacity, sizeof(path_cache_entry));
+        if (new_table == NULL)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < g_path_cache_capacity; i++)
+        {
+            if (g_path_cache[i].name != NULL)
+            {
+                *path_cache_slot(new_table, new_capacity, g_path_cache[i].name) = g_path_cache[i];
+            }
+        }
+        free(g_path_cache);
+        g_path_cache = new_table;
+        g_path_cache_capacity = new_capacity;
+    }
+
+    path_cache_entry *slot = path_cache_slot(g_path_cache, g_path_cache_capacity, name);
+    slot->name = strdup(name);
+    slot->path = strdup(path);
+    slot->hits = 0;
+    if (slot->name == NULL || slot->path == NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+        exit(EXIT_FAILURE);
+    }
+    g_path_cache_count++;
+    return slot;
+}
+
+// (Re)creates the inotify watches for the directories of the current PATH
+void path_cache_watch(const char *path_env)
+{
+    if (g_path_inotify_fd != -1)
+    {
+        close(g_path_inotify_fd); // Closing the instance drops all of its watches at once
+    }
+    g_path_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (g_path_inotify_fd == -1)
+    {
+        return; // Not fatal, stale entries are still caught when spawning fails with ENOENT
+    }
+
+    char *dirs = strdup(path_env);
+    if (dirs == NULL)
+    {
+        return;
+    }
+    char *saveptr;
+    for (char *dir = strtok_r(dirs, ":", &saveptr); dir != NULL; dir = strtok_r(NULL, ":", &saveptr))
+    {
+        // A failing watch (e.g. the directory doesn't exist) is simply skipped
+        inotify_add_watch(g_path_inotify_fd, dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    }
+    free(dirs);
+}
+
+// Looks `name` up in every directory of the cached PATH, an empty entry means the current directory
+// - returns 1 and the full path in `candidate` (PATH_MAX bytes) if an executable was found
+int path_search(const char *name, char *candidate)
+{
+    size_t name_len = strlen(name);
+    const char *dir = g_path_cache_env;
+    while (1)
+    {
+        const char *end = strchrnul(dir, ':');
+        size_t dir_len = end - dir;
+        if (dir_len + name_len + 2 <= PATH_MAX)
+        {
+            if (dir_len == 0)
+            {
+                memcpy(candidate, name, name_len + 1);
+            }
+            else
+            {
+                memcpy(candidate, dir, dir_len);
+                candidate[dir_len] = '/';
+                memcpy(candidate + dir_len + 1, name, name_len + 1);
+            }
+
+            struct stat st;
+            if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0)
+            {
+                return 1;
+            }
+        }
+        if (*end == '\0')
+        {
+            return 0;
+        }
+        dir = end + 1;
+    }
+}
+
+// Sorted index of every program name on PATH, for completing them at the prompt
+// - built on the first completion, then kept up to date by the same inotify events that keep the cache in sync
+// - looking up a prefix is a binary search plus a scan over the matches, so it stays instant with tens of thousands
+//   of programs on PATH
+char **g_path_index = NULL;
+size_t g_path_index_count = 0;
+size_t g_path_index_capacity = 0;
+int g_path_index_valid = 0; // 0 until built, and again after PATH changed
+
+int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Position of the first name that is not smaller than `name`
+size_t path_index_lower_bound(const char *name)
+{
+    size_t low = 0, high = g_path_index_count;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (strcmp(g_path_index[mid], name) < 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+void path_index_clear()
+{
+    for (size_t i = 0; i < g_path_index_count; i++)
+    {
+        free(g_path_index[i]);
+    }
+    g_path_index_count = 0;
+    g_path_index_valid = 0;
+}
+
+void path_index_append(const char *name)
+{
+    if (g_path_index_count == g_path_index_capacity)
+    {
+        g_path_index_capacity = (g_path_index_capacity == 0) ? 1024 : g_path_index_capacity * 2;
+        g_path_index = realloc(g_path_index, g_path_index_capacity * sizeof(char *));
+        if (g_path_index == NULL)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+            exit(EXIT_FAILURE);
+        }
+    }
+    g_path_index[g_path_index_count] = strdup(name);
+    if (g_path_index[g_path_index_count] == NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+        exit(EXIT_FAILURE);
+    }
+    g_path_index_count++;
+}
+
+// A program was added to or removed from one of the PATH directories, it stays listed while any directory has it
+void path_index_update(const char *name)
+{
+    if (!g_path_index_valid)
+    {
+        return;
+    }
+    char candidate[PATH_MAX];
+    int found = path_search(name, candidate);
+    size_t pos = path_index_lower_bound(name);
+    int listed = (pos < g_path_index_count && strcmp(g_path_index[pos], name) == 0);
+    if (found && !listed)
+    {
+        path_index_append(name); // Grows the array, the new name is then moved into place
+        char *added = g_path_index[g_path_index_count - 1];
+        memmove(g_path_index + pos + 1, g_path_index + pos, (g_path_index_count - 1 - pos) * sizeof(char *));
+        g_path_index[pos] = added;
+    }
+    else if (!found && listed)
+    {
+        free(g_path_index[pos]);
+        memmove(g_path_index + pos, g_path_index + pos + 1, (g_path_index_count - pos - 1) * sizeof(char *));
+        g_path_index_count--;
+    }
+}
+
+// Brings the cache in sync with PATH and the pending inotify events
+void path_cache_refresh()
+{
+    const char *path_env = env_get("PATH");
+    if (path_env == NULL)
+    {
+        path_env = "/usr/local/bin:/usr/bin:/bin"; // Same fallback `execvp` uses
+    }
+
+    if (g_path_cache_env == NULL || strcmp(g_path_cache_env, path_env) != 0)
+    {
+        path_cache_clear();
+        path_index_clear();
+        free(g_path_cache_env);
+        g_path_cache_env = strdup(path_env);
+        path_cache_watch(path_env);
+        return;
+    }
+
+    if (g_path_inotify_fd == -1)
+    {
+        return;
+    }
+
+    // Drain the queued events, the buffer is aligned as the man page suggests
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(g_path_inotify_fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (char *ptr = buffer; ptr < buffer + len;)
+        {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_Q_OVERFLOW | IN_IGNORED))
+            {
+                // A whole directory changed (or events were lost), start over
+                path_cache_clear();
+                free(g_path_cache_env);
+                g_path_cache_env = NULL;
+                path_cache_refresh();
+                return;
+            }
+            if (event->len > 0)
+            {
+                path_cache_remove(event->name); // A new binary may shadow the cached one, a removed one is gone
+                path_index_update(event->name);
+            }
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+// Resolves a program name to the absolute path `posix_spawn` needs, walking PATH only on a cache miss
+// - names containing a `/` are used as they are, just like `execvp` does
+// - returns NULL if the program was not found
+const char *resolve_command(const char *name)
+{
+    if (strchr(name, '/') != NULL)
+    {
+        return name;
+    }
+
+    path_cache_refresh();
+    if (g_path_cache_count > 0)
+    {
+        path_cache_entry *slot = path_cache_slot(g_path_cache, g_path_cache_capacity, name);
+        if (slot->name != NULL)
+        {
+            slot->hits++;
+            return slot->path;
+        }
+    }
+
+    // Cache miss - walk the PATH
+    char candidate[PATH_MAX];
+    if (!path_search(name, candidate))
+    {
+        return NULL;
+    }
+    path_cache_entry *slot = path_cache_insert(name, candidate);
+    slot->hits++;
+    return slot->path;
+}
+
+// Lists the executables of every PATH directory, sorted and without duplicates
+void path_index_build()
+{
+    path_cache_refresh(); // Applies pending events, and drops an index that was built for another PATH
+    if (g_path_index_valid)
+    {
+        return;
+    }
+
+    const char *dir = g_path_cache_env;
+    while (1)
+    {
+        const char *end = strchrnul(dir, ':');
+        char dir_path[PATH_MAX];
+        snprintf(dir_path, sizeof(dir_path), "%.*s", (int)(end - dir), dir);
+        if (end == dir)
+        {
+            strcpy(dir_path, "."); // An empty entry means the current directory
+        }
+        DIR *d = opendir(dir_path);
+        if (d != NULL)
+        {
+            struct dirent *entry;
+            while ((entry = readdir(d)) != NULL)
+            {
+                if (entry->d_name[0] == '.' || entry->d_type == DT_DIR)
+                {
+                    continue;
+                }
+                // Symlinks and unknown types still need a look at what they are
+                struct stat st;
+                if (entry->d_type != DT_REG &&
+                    (fstatat(dirfd(d), entry->d_name, &st, 0) == -1 || !S_ISREG(st.st_mode)))
+                {
+                    continue;
+                }
+                if (faccessat(dirfd(d), entry->d_name, X_OK, 0) == 0)
+                {
+                    path_index_append(entry->d_name);
+                }
+            }
+            closedir(d);
+        }
+        if (*end == '\0')
+        {
+            break;
+        }
+        dir = end + 1;
+    }
+
+    qsort(g_path_index, g_path_index_count, sizeof(char *), compare_strings);
+    size_t kept = 0;
+    for (size_t i = 0; i < g_path_index_count; i++)
+    {
+        if (kept > 0 && strcmp(g_path_index[kept - 1], g_path_index[i]) == 0)
+        {
+            free(g_path_index[i]); // The same program in several directories
+        }
+        else
+        {
+            g_path_index[kept++] = g_path_index[i];
+        }
+    }
+    g_path_index_count = kept;
+    g_path_index_valid = 1;
+}
+
+// ---------------
+// |   History   |
+// ---------------
+// Every interactive command is appended to a history file (`~/.imcsh_history`, or the file in $IMCSH_HISTORY), one per line
+// - at startup the file is memory-mapped instead of being read, its lines only get indexed once `history` needs them
+// - the commands of this session are kept in an arena of their own, next to the mapped ones
+// - a command equal to the previous one is not recorded again
+// - once the file holds a quarter more than `historysize` lines, a thread rewrites it in the background with only the
+//   newest `historysize` distinct commands, so the prompt never waits for it
+// Docs: https://man7.org/linux/man-pages/man2/mmap.2.html
+#define DEFAULT_HISTORY_SIZE 100000
+#define HISTORY_LIST_DEFAULT 20
+
+typedef struct
+{
+    const char *text; // Not terminated, points into the mapped file or into the session's arena
+    size_t length;
+} history_line;
+
+typedef struct
+{
+    int opened;
+    char *path;
+    int fd;          // Opened with O_APPEND, so shells sharing the file never overwrite each other's lines
+    char *map;       // The file as it was at startup
+    size_t map_size;
+    int indexed;     // 1 once the mapped lines are in `lines`
+    history_line *lines;
+    size_t count;
+    size_t capacity;
+    arena text;        // The commands of this session
+    size_t file_lines; // Lines in the file, decides when it is compacted
+
+    // Background compaction, the thread only touches these (and reads `path`) until it is joined
+    pthread_t thread;
+    int compacting;
+    int compact_disabled; // Writing the compacted file failed once, don't keep trying
+    long compact_limit;
+    off_t compact_size;   // Size of the file the thread looked at, what was appended after that is copied over
+    size_t compact_lines; // Lines of the compacted file (or of the file, when it was small enough)
+    int compact_written;  // The compacted file is waiting at `path`.compact
+    int compact_failed;
+} history_state;
+
+history_state g_history = {0};
+long g_history_size = DEFAULT_HISTORY_SIZE;
+
+// FNV-1a like `hash_string`, for text that is not terminated
+unsigned long hash_bytes(const char *bytes, size_t length)
+{
+    unsigned long hash = 14695981039346656037UL;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)bytes[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+// Set of lines (open addressing, linear probing), to drop repeated commands
+typedef struct
+{
+    history_line *slots; // Zeroed, a NULL text marks an empty slot
+    size_t mask;         // Capacity - 1, the capacity is a power of 2
+} line_set;
+
+// Capacity of a set that stays at most half full with `count` lines
+size_t line_set_capacity(size_t count)
+{
+    size_t capacity = 16;
+    while (capacity < count * 2)
+    {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+// Adds the line, returns 0 if it was in the set already
+int line_set_add(line_set *set, const char *text, size_t length)
+{
+    size_t i = hash_bytes(text, length) & set->mask;
+    while (set->slots[i].text != NULL)
+    {
+        if (set->slots[i].length == length && memcmp(set->slots[i].text, text, length) == 0)
+        {
+            return 0;
+        }
+        i = (i + 1) & set->mask;
+    }
+    set->slots[i].text = text;
+    set->slots[i].length = length;
+    return 1;
+}
+
+// Counts the lines of a block of text, a last line without a newline included
+size_t count_lines(const char *text, size_t size)
+{
+    size_t lines = 0;
+    const char *end = text + size;
+    const char *newline;
+    while (text < end && (newline = memchr(text, '\n', end - text)) != NULL)
+    {
+        lines++;
+        text = newline + 1;
+    }
+    return lines + (text < end);
+}
+
+// Makes room for `needed` lines
+void history_reserve(size_t needed)
+{
+    if (needed <= g_history.capacity)
+    {
+        return;
+    }
+    size_t capacity = (g_history.capacity == 0) ? 256 : g_history.capacity;
+    while (capacity < needed)
+    {
+        capacity *= 2;
+    }
+    history_line *lines = realloc(g_history.lines, capacity * sizeof(history_line));
+    if (lines == NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+        exit(EXIT_FAILURE);
+    }
+    g_history.lines = lines;
+    g_history.capacity = capacity;
+}
+
+void history_push(const char *text, size_t length)
+{
+    history_reserve(g_history.count + 1);
+    g_history.lines[g_history.count].text = text;
+    g_history.lines[g_history.count].length = length;
+    g_history.count++;
+}
+
+// The compaction thread: maps the file on its own and writes the newest distinct lines, oldest first, to `path`.compact
+// - the file is only rewritten if it grew past the limit, otherwise its lines are just counted
+void *history_compact(void *arg)
+{
+    history_state *h = arg;
+    h->compact_size = 0;
+    h->compact_lines = 0;
+    h->compact_written = 0;
+    h->compact_failed = 0;
+
+    int fd = open(h->path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return NULL; // Finishing counts the whole file as the part that was appended
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+    size_t size = st.st_size;
+    h->compact_size = st.st_size;
+    h->compact_lines = count_lines(map, size);
+
+    size_t limit = h->compact_limit;
+    if (h->compact_lines <= limit + limit / 4)
+    {
+        munmap(map, size);
+        return NULL;
+    }
+
+    // Walk from the newest line back, keeping every command the first time it shows up
+    history_line *kept = malloc(limit * sizeof(history_line));
+    line_set seen = {calloc(line_set_capacity(limit), sizeof(history_line)), line_set_capacity(limit) - 1};
+    size_t num_kept = 0;
+    if (kept == NULL || seen.slots == NULL)
+    {
+        h->compact_failed = 1;
+    }
+    size_t end = (map[size - 1] == '\n') ? size - 1 : size;
+    while (!h->compact_failed && num_kept < limit)
+    {
+        char *newline = memrchr(map, '\n', end);
+        size_t start = (newline != NULL) ? (size_t)(newline - map) + 1 : 0;
+        if (end > start && line_set_add(&seen, map + start, end - start))
+        {
+            kept[num_kept].text = map + start;
+            kept[num_kept].length = end - start;
+            num_kept++;
+        }
+        if (start == 0)
+        {
+            break;
+        }
+        end = start - 1;
+    }
+
+    char compact_path[PATH_MAX];
+    snprintf(compact_path, sizeof(compact_path), "%s.compact", h->path);
+    int compact_fd = h->compact_failed ? -1 : open(compact_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    FILE *file = (compact_fd != -1) ? fdopen(compact_fd, "w") : NULL;
+    if (file != NULL)
+    {
+        for (size_t i = num_kept; i-- > 0;)
+        {
+            fwrite(kept[i].text, 1, kept[i].length, file);
+            fputc('\n', file);
+        }
+        // Only a complete file may replace the history
+        int failed = (fflush(file) != 0 || fsync(fileno(file)) != 0);
+        failed |= (fclose(file) != 0);
+        if (failed)
+        {
+            unlink(compact_path);
+        }
+        else
+        {
+            h->compact_written = 1;
+            h->compact_lines = num_kept;
+        }
+        h->compact_failed = failed;
+    }
+    else
+    {
+        if (compact_fd != -1)
+        {
+            close(compact_fd);
+            unlink(compact_path);
+        }
+        h->compact_failed = 1;
+    }
+
+    free(kept);
+    free(seen.slots);
+    munmap(map, size);
+    return NULL;
+}
+
+void history_start_compaction()
+{
+    if (g_history.compacting || g_history.compact_disabled || g_history.path == NULL)
+    {
+        return;
+    }
+    g_history.compact_limit = g_history_size;
+    if (pthread_create(&g_history.thread, NULL, history_compact, &g_history) == 0)
+    {
+        g_history.compacting = 1;
+    }
+}
+
+// Takes over the result of a finished compaction (or waits for it, with `wait`)
+// - whatever was appended to the file while the thread worked is copied to the end of the compacted file, which then
+//   replaces the history file
+void history_poll(int wait)
+{
+    if (!g_history.compacting)
+    {
+        return;
+    }
+    if (wait)
+    {
+        pthread_join(g_history.thread, NULL);
+    }
+    else if (pthread_tryjoin_np(g_history.thread, NULL) != 0)
+    {
+        return; // Still working
+    }
+    g_history.compacting = 0;
+
+    char compact_path[PATH_MAX];
+    snprintf(compact_path, sizeof(compact_path), "%s.compact", g_history.path);
+    int compact_fd = g_history.compact_written ? open(compact_path, O_WRONLY | O_APPEND | O_CLOEXEC) : -1;
+    int fd = open(g_history.path, O_RDONLY | O_CLOEXEC);
+    size_t appended_lines = 0;
+    int failed = g_history.compact_failed || (g_history.compact_written && compact_fd == -1);
+    if (fd != -1)
+    {
+        char buffer[65536];
+        off_t offset = g_history.compact_size;
+        ssize_t n;
+        while ((n = pread(fd, buffer, sizeof(buffer), offset)) > 0)
+        {
+            appended_lines += count_lines(buffer, n) - (buffer[n - 1] != '\n'); // A line split between reads counts once
+            if (compact_fd != -1 && write(compact_fd, buffer, n) != n)
+            {
+                failed = 1;
+            }
+            offset += n;
+        }
+        close(fd);
+    }
+
+    if (compact_fd != -1)
+    {
+        close(compact_fd);
+        if (failed || rename(compact_path, g_history.path) == -1)
+        {
+            failed = 1;
+            unlink(compact_path);
+        }
+        else
+        {
+            // The old file is gone, new commands go to the compacted one
+            int history_fd = open(g_history.path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+            if (history_fd != -1)
+            {
+                close(g_history.fd);
+                g_history.fd = history_fd;
+            }
+        }
+    }
+    if (failed)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: history: could not compact %s\n" ANSI_COLOR_RESET, g_history.path);
+        g_history.compact_disabled = 1;
+    }
+    g_history.file_lines = g_history.compact_lines + appended_lines;
+}
+
+// Opens and maps the history file, the first time history is needed
+void history_open()
+{
+    if (g_history.opened)
+    {
+        return;
+    }
+    g_history.opened = 1;
+    g_history.fd = -1;
+
+    const char *path = env_get("IMCSH_HISTORY");
+    char default_path[PATH_MAX];
+    if (path == NULL || *path == '\0')
+    {
+        const char *home = env_get("HOME");
+        if (home == NULL)
+        {
+            struct passwd *pw = getpwuid(getuid());
+            home = (pw != NULL) ? pw->pw_dir : NULL;
+        }
+        if (home == NULL)
+        {
+            return; // Nowhere to keep it, the history of this session still works
+        }
+        snprintf(default_path, sizeof(default_path), "%s/.imcsh_history", home);
+        path = default_path;
+    }
+
+    g_history.fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (g_history.fd == -1)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: history: cannot open %s: %s\n" ANSI_COLOR_RESET, path, strerror(errno));
+        return;
+    }
+    g_history.path = strdup(path);
+    if (g_history.path == NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+        exit(EXIT_FAILURE);
+    }
+
+    struct stat st;
+    if (fstat(g_history.fd, &st) == 0 && st.st_size > 0)
+    {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, g_history.fd, 0);
+        if (map != MAP_FAILED)
+        {
+            g_history.map = map;
+            g_history.map_size = st.st_size;
+        }
+    }
+
+    // The thread counts the lines, so the file is only compacted when it is actually too long
+    history_start_compaction();
+}
+
+// Puts the lines of the mapped file in front of the ones of this session
+void history_index()
+{
+    if (g_history.indexed)
+    {
+        return;
+    }
+    g_history.indexed = 1;
+
+    size_t num_session = g_history.count;
+    size_t num_mapped = count_lines(g_history.map, g_history.map_size);
+    history_reserve(num_mapped + num_session);
+    if (num_session > 0)
+    {
+        memmove(g_history.lines + num_mapped, g_history.lines, num_session * sizeof(history_line));
+    }
+
+    g_history.count = 0;
+    const char *text = g_history.map;
+    const char *end = g_history.map + g_history.map_size;
+    while (text < end)
+    {
+        const char *newline = memchr(text, '\n', end - text);
+        const char *line_end = (newline != NULL) ? newline : end;
+        g_history.lines[g_history.count].text = text;
+        g_history.lines[g_history.count].length = line_end - text;
+        g_history.count++;
+        text = line_end + 1;
+    }
+    g_history.count += num_session;
+
+    // Empty lines are not commands
+    size_t kept = 0;
+    for (size_t i = 0; i < g_history.count; i++)
+    {
+        if (g_history.lines[i].length > 0)
+        {
+            g_history.lines[kept++] = g_history.lines[i];
+        }
+    }
+    g_history.count = kept;
+}
+
+// The most recent command, without having to index the file for it
+int history_last(const char **text, size_t *length)
+{
+    if (g_history.count > 0)
+    {
+        *text = g_history.lines[g_history.count - 1].text;
+        *length = g_history.lines[g_history.count - 1].length;
+        return 1;
+    }
+    size_t end = g_history.map_size;
+    while (end > 0 && g_history.map[end - 1] == '\n')
+    {
+        end--;
+    }
+    if (end == 0)
+    {
+        return 0;
+    }
+    char *newline = memrchr(g_history.map, '\n', end);
+    size_t start = (newline != NULL) ? (size_t)(newline - g_history.map) + 1 : 0;
+    *text = g_history.map + start;
+    *length = end - start;
+    return 1;
+}
+
+// Records an interactive command, before it is parsed (parsing unquotes the line in place)
+void history_add(const char *line)
+{
+    history_open();
+    history_poll(0);
+
+    size_t length = strlen(line);
+    if (strspn(line, " \t\r") == length)
+    {
+        return;
+    }
+    const char *last;
+    size_t last_length;
+    if (history_last(&last, &last_length) && last_length == length && memcmp(last, line, length) == 0)
+    {
+        return;
+    }
+
+    char *text = arena_alloc(&g_history.text, length);
+    memcpy(text, line, length);
+    history_push(text, length);
+
+    if (g_history.fd != -1)
+    {
+        // One write per command, O_APPEND keeps it in one piece when several shells share the file
+        struct iovec parts[2] = {{text, length}, {"\n", 1}};
+        if (writev(g_history.fd, parts, 2) == (ssize_t)length + 1)
+        {
+            g_history.file_lines++;
+        }
+    }
+    if (g_history.file_lines > (size_t)(g_history_size + g_history_size / 4))
+    {
+        history_start_compaction();
+    }
+}
+
+// Lets a running compaction finish, at exit
+void history_close()
+{
+    history_poll(1);
+}
+
+// -------------------
+// |   Redirections   |
+// -------------------
+// Supported forms, where `n` is an optional file descriptor number written right before the operator:
+// - `n< file`  read the file (n defaults to 0)
+// - `n> file`  write the file, truncating it (n defaults to 1), refused for an existing file with `set noclobber=on`
+// - `n>| file` like `>`, but ignores noclobber
+// - `n>> file` append to the file
+// - `n>&m`     make n a copy of m, e.g. `2>&1`
+#define MAX_REDIRECTIONS 16
+
+typedef enum
+{
+    REDIRECT_READ,
+    REDIRECT_TRUNCATE,
+    REDIRECT_CLOBBER,
+    REDIRECT_APPEND,
+    REDIRECT_DUP,
+} redirection_kind;
+
+typedef struct
+{
+    int fd;
+    redirection_kind kind;
+    char *target;  // The word after the operator, points into the command line
+    int target_fd; // For REDIRECT_DUP
+} redirection;
+
+typedef struct
+{
+    redirection items[MAX_REDIRECTIONS];
+    int count;
+} redirection_list;
+
+int g_noclobber = 0;
+
+// ---------------------------
+// |   Command line parser   |
+// ---------------------------
+// A single pass over the line splits it into the words of every pipeline stage and their redirections
+// - the words are unquoted in place, so every token points into the line itself and nothing gets copied
+// - `'...'` keeps everything literally, inside `"..."` a backslash only escapes `"`, `\`, `$` and `` ` ``, outside of quotes it escapes any character
+// - unquoted `|`, `&`, `<` and `>` are operators even without spaces around them, `#` at the start of a word begins a comment
+typedef struct
+{
+    char **argv; // NULL terminated, points into `words`
+    redirection_list redirections;
+} command_stage;
+
+typedef struct
+{
+    command_stage stages[MAX_PIPELINE_STAGES];
+    int num_stages; // 0 for an empty line
+    int background; // Ended with `&`
+    char **words;   // The argv lists of all the stages after each other (in the command arena)
+} command_line;
+
+// Expands the `$NAME`, `${NAME}`, `$?` (status of the last command) or `$$` (pid of the shell) at `*read`
+// - returns 0 if it is just a `$`, otherwise writes the value at `*write` and moves `*read` behind the expression
+// - a value is written in place if it fits into the space the expression took up, otherwise the word is moved to the
+//   command arena (`*start`, `*limit`), with room for the value and the rest of the line
+int lex_expand(char **read, char **start, char **write, char **limit)
+{
+    char *name = *read + 1;
+    char *end;
+    char *after;
+    char number[32];
+    const char *value;
+    if (*name == '?' || *name == '$')
+    {
+        snprintf(number, sizeof(number), "%d", (*name == '?') ? g_last_status : (int)getpid());
+        value = number;
+        after = name + 1;
+    }
+    else
+    {
+        int braced = (*name == '{');
+        name += braced;
+        end = name;
+        while (isalnum((unsigned char)*end) || *end == '_')
+        {
+            end++;
+        }
+        if (!env_valid_name(name, end - name) || (braced && *end != '}'))
+        {
+            return 0;
+        }
+        after = end + braced;
+
+        // Terminate the name for the lookup, the character is put back right after
+        char saved = *end;
+        *end = '\0';
+        value = env_get(name);
+        *end = saved;
+        if (value == NULL)
+        {
+            value = ""; // Unset variables expand to nothing
+        }
+    }
+
+    size_t value_length = strlen(value);
+    if ((*limit == NULL && *write + value_length > after) || (*limit != NULL && *write + value_length + strlen(after) + 1 > *limit))
+    {
+        size_t length = *write - *start;
+        size_t capacity = 2 * (length + value_length + strlen(after) + 1);
+        char *moved = arena_alloc(&g_arena, capacity);
+        memcpy(moved, *start, length);
+        *start = moved;
+        *write = moved + length;
+        *limit = moved + capacity;
+    }
+    memcpy(*write, value, value_length);
+    *write += value_length;
+    *read = after;
+    return 1;
+}
+
+// Reads the word starting at `*cursor`, removing its quotes and escapes in place, and returns the start of it
+// - `*cursor` is left at the character that ended the word, which is also stored in `*delimiter`, since the terminating
+//   `\0` of the word may have been written over it (in `a|b` the `|` becomes the end of `a`)
+// - variables are expanded outside of quotes and inside `"..."` (see `lex_expand`), the result is always one word
+// - returns NULL for an unterminated quote
+char *lex_word(char **cursor, char *delimiter)
+{
+    char *start = *cursor;
+    char *read = start;
+    char *write = start; // In place it is never ahead of `read`, the unquoted word is never longer than the quoted one
+    char *limit = NULL;  // End of the word's copy in the arena, once a value did not fit in place
+    while (*read != '\0' && *read != ' ' && *read != '\t' && *read != '|' && *read != '&' && *read != '<' && *read != '>')
+    {
+        if (*read == '$' && lex_expand(&read, &start, &write, &limit))
+        {
+            continue;
+        }
+        char ch = *read++;
+        if (ch == '\\')
+        {
+            if (*read != '\0')
+            {
+                *write++ = *read++;
+            }
+        }
+        else if (ch == '\'' || ch == '"')
+        {
+            while (*read != ch)
+            {
+                if (*read == '\0')
+                {
+                    return NULL;
+                }
+                if (ch == '"' && *read == '$' && lex_expand(&read, &start, &write, &limit))
+                {
+                    continue;
+                }
+                if (ch == '"' && *read == '\\' && strchr("\"\\$`", read[1]) != NULL && read[1] != '\0')
+                {
+                    read++;
+                }
+                *write++ = *read++;
+            }
+            read++; // The closing quote
+        }
+        else
+        {
+            *write++ = ch;
+        }
+    }
+    *delimiter = *read;
+    *write = '\0';
+    *cursor = read;
+    return start;
+}
+
+// Parses the file descriptor number at `str` up to `*end`, returns -1 if it doesn't fit in an int
+// - `atoi` would wrap `4294967297` around to 1 and quietly redirect stdout instead
+int parse_fd(const char *str, char **end)
+{
+    errno = 0;
+    long fd = strtol(str, end, 10);
+    return (errno != 0 || *end == str || fd < 0 || fd > INT_MAX) ? -1 : (int)fd;
+}
+
+// Parses `line` (modifying it) into `command`, returns -1 after printing an error for a syntax error
+// - the word lists are allocated from the command arena, they are valid until it is reset
+int parse_command_line(char *line, command_line *command)
+{
+    // Every word takes at least one character and a separator or operator, so this many entries fit all words of all
+    // stages together with the NULL ending each stage
+    command->words = arena_alloc(&g_arena, (strlen(line) + 2) * sizeof(char *));
+    command->num_stages = 0;
+    command->background = 0;
+
+    const char *error = NULL;
+    size_t num_words = 0;
+    command_stage *stage = NULL;
+    char *read = line;
+    char c = *read; // The current character, it is not always in the line anymore (see `lex_word`)
+    while (error == NULL)
+    {
+        while (c == ' ' || c == '\t')
+            c = *++read;
+        if (c == '\0' || c == '#')
+        {
+            break; // The rest is a comment
+        }
+        if (command->background)
+        {
+            error = "'&' is only supported at the end of a command";
+            break;
+        }
+
+        // Every non-empty line has a first stage, `|` starts the next one
+        if (stage == NULL || c == '|')
+        {
+            if (stage != NULL && stage->argv == command->words + num_words)
+            {
+                error = "empty command in pipeline";
+                break;
+            }
+            if (stage != NULL)
+            {
+                command->words[num_words++] = NULL;
+                c = *++read;
+            }
+            if (command->num_stages >= MAX_PIPELINE_STAGES)
+            {
+                error = "pipeline has too many stages";
+                break;
+            }
+            stage = &command->stages[command->num_stages++];
+            stage->argv = command->words + num_words;
+            stage->redirections.count = 0;
+            continue;
+        }
+        if (c == '&')
+        {
+            command->background = 1;
+            c = *++read;
+            continue;
+        }
+
+        // A redirection, with an optional fd number in front - like the word, the number itself is never cut off
+        char *op = read;
+        if (c >= '0' && c <= '9')
+        {
+            while (*op >= '0' && *op <= '9')
+                op++;
+        }
+        char op_char = (op == read) ? c : *op;
+        if (op_char != '<' && op_char != '>')
+        {
+            char *word = lex_word(&read, &c);
+            if (word == NULL)
+            {
+                error = "unterminated quote";
+                break;
+            }
+            command->words[num_words++] = word;
+            continue;
+        }
+
+        redirection_list *list = &stage->redirections;
+        if (list->count >= MAX_REDIRECTIONS)
+        {
+            error = "too many redirections";
+            break;
+        }
+        redirection *r = &list->items[list->count++];
+        char *end;
+        r->fd = (op > read) ? parse_fd(read, &end) : (op_char == '<' ? STDIN_FILENO : STDOUT_FILENO);
+        if (r->fd == -1)
+        {
+            error = "file descriptor number out of range";
+            break;
+        }
+        r->target = NULL;
+        r->target_fd = -1;
+        op++; // `op[1]` is still intact, only the character at `read` could have been overwritten
+        if (op_char == '<')
+        {
+            r->kind = REDIRECT_READ;
+        }
+        else if (*op == '>')
+        {
+            r->kind = REDIRECT_APPEND;
+            op++;
+        }
+        else if (*op == '|')
+        {
+            r->kind = REDIRECT_CLOBBER;
+            op++;
+        }
+        else if (*op == '&')
+        {
+            r->kind = REDIRECT_DUP;
+            op++;
+        }
+        else
+        {
+            r->kind = REDIRECT_TRUNCATE;
+        }
+
+        // The target is the next word
+        read = op;
+        c = *read;
+        while (c == ' ' || c == '\t')
+            c = *++read;
+        if (c == '\0' || c == '|' || c == '&' || c == '<' || c == '>' || c == '#')
+        {
+            error = (r->kind == REDIRECT_DUP) ? "No file descriptor specified after '>&'"
+                                              : (r->kind == REDIRECT_READ ? "No input file specified after '<'" : "No output file specified after '>'");
+            break;
+        }
+        r->target = lex_word(&read, &c);
+        if (r->target == NULL)
+        {
+            error = "unterminated quote";
+            break;
+        }
+        if (r->kind == REDIRECT_DUP)
+        {
+            r->target_fd = parse_fd(r->target, &end);
+            if (*r->target < '0' || *r->target > '9' || *end != '\0')
+            {
+                error = "'>&' expects a file descriptor number";
+                break;
+            }
+            if (r->target_fd == -1)
+            {
+                error = "file descriptor number out of range";
+                break;
+            }
+        }
+    }
+
+    if (error == NULL && stage != NULL && stage->argv == command->words + num_words)
+    {
+        error = (command->num_stages > 1) ? "empty command in pipeline" : "missing command before the redirection";
+    }
+    if (error != NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: %s\n" ANSI_COLOR_RESET, error);
+        return -1;
+    }
+    command->words[num_words] = NULL;
+    return 0;
+}
+
+// A line is a list of pipelines joined by `;`, `&&`, `||` and `&`, with `( ... )` grouping, parsed into a small tree
+// - `a && b` runs b only if a succeeded, `a || b` only if it failed, both bind tighter than `;` and `&`, to the left
+// - `&` puts the whole `&&` / `||` chain (or group) in front of it into the background
+// - the pipelines are kept as text, and only parsed by `parse_command_line` right before they run, so their variables
+//   (e.g. `$?`) see what the ones before did
+typedef enum
+{
+    NODE_PIPELINE,
+    NODE_AND,
+    NODE_OR,
+    NODE_GROUP,
+} node_type;
+
+typedef struct command_node
+{
+    node_type type;
+    char *text;                 // NODE_PIPELINE: the pipeline, terminated in place once the whole line was parsed
+    struct command_node *left;  // NODE_AND / NODE_OR: the operands, NODE_GROUP: the first item of the list inside
+    struct command_node *right;
+    struct command_node *next;  // The next item of the list this one is in
+    int background;             // The item ended with `&`
+    char *source;               // A background item as it was written, the name of its job
+} command_node;
+
+typedef enum
+{
+    TOKEN_END, // End of the line, or a comment
+    TOKEN_WORD,
+    TOKEN_SEMICOLON,
+    TOKEN_AND,
+    TOKEN_OR,
+    TOKEN_AMPERSAND,
+    TOKEN_OPEN,
+    TOKEN_CLOSE,
+} list_token;
+
+typedef struct
+{
+    char *read;
+    command_node **pipelines; // Every pipeline of the line, in order
+    char **ends;              // Where each of them ends, only written over with `\0` once the sources were copied
+    int num_pipelines;
+    const char *error;
+    int unexpected;           // The token that caused the syntax error, -1 for `error`
+} list_parser;
+
+const char *g_token_names[] = {"end of line", "word", ";", "&&", "||", "&", "(", ")"};
+
+void list_unexpected(list_parser *p, list_token token)
+{
+    p->error = NULL;
+    p->unexpected = token;
+}
+
+// Skips the blanks and tells what comes next, without consuming it
+list_token list_peek(list_parser *p)
+{
+    while (*p->read == ' ' || *p->read == '\t')
+    {
+        p->read++;
+    }
+    switch (*p->read)
+    {
+    case '\0':
+    case '#':
+        return TOKEN_END;
+    case ';':
+        return TOKEN_SEMICOLON;
+    case '&':
+        return (p->read[1] == '&') ? TOKEN_AND : TOKEN_AMPERSAND;
+    case '|':
+        return (p->read[1] == '|') ? TOKEN_OR : TOKEN_WORD; // A lone `|` can only be an empty pipeline stage
+    case '(':
+        return TOKEN_OPEN;
+    case ')':
+        return TOKEN_CLOSE;
+    default:
+        return TOKEN_WORD;
+    }
+}
+
+command_node *list_node(node_type type)
+{
+    command_node *node = arena_alloc(&g_arena, sizeof(command_node));
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+    return node;
+}
+
+// Finds the end of the pipeline at `p->read`, skipping the quotes and escapes, which `parse_command_line` handles later
+command_node *list_pipeline(list_parser *p)
+{
+    command_node *node = list_node(NODE_PIPELINE);
+    node->text = p->read;
+    char *read = p->read;
+    while (1)
+    {
+        char c = *read;
+        if (c == '\0' || c == ';' || c == '(' || c == ')' || (c == '&' && read[-1] != '>') || (c == '|' && read[1] == '|') ||
+            (c == '#' && (read == node->text || read[-1] == ' ' || read[-1] == '\t')))
+        {
+            break;
+        }
+        read++;
+        if (c == '\\' && *read != '\0')
+        {
+            read++;
+        }
+        else if (c == '\'' || c == '"')
+        {
+            while (*read != c)
+            {
+                if (*read == '\0')
+                {
+                    p->error = "unterminated quote";
+                    return NULL;
+                }
+                read += (c == '"' && *read == '\\' && read[1] != '\0') ? 2 : 1;
+            }
+            read++;
+        }
+    }
+    if (*read == '(')
+    {
+        p->error = "'(' can only start a command"; // No subshells inside a pipeline, e.g. `a | (b; c)`
+        return NULL;
+    }
+    p->read = read;
+    p->pipelines[p->num_pipelines] = node;
+    p->ends[p->num_pipelines++] = read;
+    return node;
+}
+
+command_node *list_parse(list_parser *p, int depth);
+
+// A pipeline or a group
+command_node *list_command(list_parser *p, int depth)
+{
+    list_token token = list_peek(p);
+    if (token == TOKEN_WORD)
+    {
+        return list_pipeline(p);
+    }
+    if (token != TOKEN_OPEN)
+    {
+        list_unexpected(p, token);
+        return NULL;
+    }
+    p->read++;
+    command_node *node = list_node(NODE_GROUP);
+    node->left = list_parse(p, depth + 1);
+    if (node->left == NULL)
+    {
+        return NULL;
+    }
+    if (list_peek(p) != TOKEN_CLOSE)
+    {
+        p->error = "missing ')'";
+        return NULL;
+    }
+    p->read++;
+    if (list_peek(p) == TOKEN_WORD)
+    {
+        // Redirecting a whole group, or piping it into something else, is not supported
+        p->error = (*p->read == '|') ? "a group can't be part of a pipeline" : "only '&&', '||', ';' or '&' can follow ')'";
+        return NULL;
+    }
+    return node;
+}
+
+// A list of `&&` / `||` chains, up to the end of the line, or the `)` of the group it is in
+command_node *list_parse(list_parser *p, int depth)
+{
+    command_node *first = NULL;
+    command_node **link = &first;
+    while (1)
+    {
+        list_peek(p);
+        char *start = p->read;
+        command_node *item = list_command(p, depth);
+        list_token token;
+        while (item != NULL && ((token = list_peek(p)) == TOKEN_AND || token == TOKEN_OR))
+        {
+            p->read += 2;
+            command_node *chain = list_node(token == TOKEN_AND ? NODE_AND : NODE_OR);
+            chain->left = item;
+            chain->right = list_command(p, depth);
+            item = (chain->right != NULL) ? chain : NULL;
+        }
+        if (item == NULL)
+        {
+            return NULL;
+        }
+        *link = item;
+        link = &item->next;
+
+        token = list_peek(p);
+        if (token == TOKEN_AMPERSAND)
+        {
+            item->background = 1;
+            if (item->type != NODE_PIPELINE)
+            {
+                size_t length = p->read - start;
+                while (length > 0 && (start[length - 1] == ' ' || start[length - 1] == '\t'))
+                {
+                    length--;
+                }
+                item->source = arena_alloc(&g_arena, length + 1);
+                memcpy(item->source, start, length);
+                item->source[length] = '\0';
+            }
+        }
+        int separated = (token == TOKEN_SEMICOLON || token == TOKEN_AMPERSAND);
+        if (separated)
+        {
+            p->read++;
+            token = list_peek(p);
+        }
+        if (token == TOKEN_END || (token == TOKEN_CLOSE && depth > 0))
+        {
+            return first;
+        }
+        if (!separated || (token != TOKEN_WORD && token != TOKEN_OPEN))
+        {
+            list_unexpected(p, token);
+            return NULL;
+        }
+    }
+}
+
+// Parses `line` (modifying it) into `*list`, NULL for an empty line, returns -1 after printing an error for a syntax error
+// - the pipelines of a list with more than one are checked right away, so a syntax error in the last one doesn't
+//   only come up after the first ones already ran
+int parse_command_list(char *line, command_node **list)
+{
+    // Every pipeline takes at least one character and an operator after it
+    size_t max_pipelines = strlen(line) / 2 + 1;
+    list_parser p = {line, arena_alloc(&g_arena, max_pipelines * sizeof(command_node *)),
+                     arena_alloc(&g_arena, max_pipelines * sizeof(char *)), 0, NULL, -1};
+    *list = NULL;
+    if (list_peek(&p) == TOKEN_END)
+    {
+        return 0;
+    }
+    *list = list_parse(&p, 0);
+    if (*list == NULL)
+    {
+        if (p.error != NULL)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: %s\n" ANSI_COLOR_RESET, p.error);
+        }
+        else if (p.unexpected == TOKEN_END)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: syntax error, unexpected end of line\n" ANSI_COLOR_RESET);
+        }
+        else
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: syntax error near '%s'\n" ANSI_COLOR_RESET, g_token_names[p.unexpected]);
+        }
+        return -1;
+    }
+
+    for (int i = 0; i < p.num_pipelines; i++)
+    {
+        *p.ends[i] = '\0';
+    }
+    if (p.num_pipelines > 1)
+    {
+        arena_mark mark = arena_save(&g_arena);
+        command_line scratch;
+        for (int i = 0; i < p.num_pipelines; i++)
+        {
+            char *copy = arena_alloc(&g_arena, strlen(p.pipelines[i]->text) + 1);
+            strcpy(copy, p.pipelines[i]->text);
+            if (parse_command_line(copy, &scratch) == -1)
+            {
+                return -1;
+            }
+        }
+        arena_restore(&g_arena, mark);
+    }
+    return 0;
+}
+
+// Opens the file of a redirection, returns the (close-on-exec) fd or -1 after printing an error
+// - `append_only` opens writes in O_APPEND mode even for `>`, used for the builtin writers
+int open_redirection(const redirection *r, int append_only)
+{
+    int flags = O_CLOEXEC;
+    switch (r->kind)
+    {
+    case REDIRECT_READ:
+        flags |= O_RDONLY;
+        break;
+    case REDIRECT_APPEND:
+        flags |= O_WRONLY | O_CREAT | O_APPEND;
+        break;
+    case REDIRECT_TRUNCATE:
+    case REDIRECT_CLOBBER:
+        flags |= O_WRONLY | O_CREAT | O_TRUNC | (append_only ? O_APPEND : 0);
+        break;
+    case REDIRECT_DUP:
+        return -1;
+    }
+
+    // With noclobber a plain `>` may not overwrite an existing regular file, devices like /dev/null are fine
+    struct stat st;
+    if (r->kind == REDIRECT_TRUNCATE && g_noclobber && stat(r->target, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: %s: cannot overwrite existing file (noclobber is on, use '>|')\n" ANSI_COLOR_RESET, r->target);
+        return -1;
+    }
+
+    int fd = open(r->target, flags, 0644);
+    if (fd == -1)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: Failed to open file '%s' for %s: %s\n" ANSI_COLOR_RESET, r->target,
+                r->kind == REDIRECT_READ ? "reading" : "writing", strerror(errno));
+    }
+    return fd;
+}
+
+void close_stage_redirections(redirection_list *list)
+{
+    for (int i = 0; i < list->count; i++)
+    {
+        if (list->items[i].kind != REDIRECT_DUP && list->items[i].target_fd != -1)
+        {
+            close(list->items[i].target_fd);
+            list->items[i].target_fd = -1;
+        }
+    }
+}
+
+// Opens the files of a stage's redirections, their fds are kept in `target_fd` until the stage is spawned
+// - returns -1 if one of them can't be opened, the already opened ones are closed again
+int open_stage_redirections(redirection_list *list)
+{
+    // With a redirection onto a higher fd (`3> file`), the opened files must stay clear of it, or a `dup2` could overwrite one
+    int min_fd = 0;
+    for (int i = 0; i < list->count; i++)
+    {
+        if (list->items[i].fd > 2 && list->items[i].fd + 1 > min_fd)
+        {
+            min_fd = list->items[i].fd + 1;
+        }
+    }
+
+    for (int i = 0; i < list->count; i++)
+    {
+        redirection *r = &list->items[i];
+        if (r->kind == REDIRECT_DUP)
+        {
+            continue;
+        }
+        r->target_fd = open_redirection(r, 0);
+        if (r->target_fd != -1 && r->target_fd < min_fd)
+        {
+            int moved = fcntl(r->target_fd, F_DUPFD_CLOEXEC, min_fd);
+            if (moved == -1)
+            {
+                perror("imcsh: fcntl");
+            }
+            close(r->target_fd);
+            r->target_fd = moved;
+        }
+        if (r->target_fd == -1)
+        {
+            close_stage_redirections(list); // The ones after this were not opened yet, their fds are still -1
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Buffered writers for the output of builtins
+// - the file stays open between commands, so 1000 `echo ... >> log` lines don't pay 1000 `open` / `close` calls
+// - `>` on an already open writer just truncates it, the stream itself is always in append mode
+// - they are flushed before a program is spawned (it may read the file), and closed once the shell goes idle at the prompt
+// - a program that ran in between may have replaced the file, so then the inode is checked again before reusing it
+#define MAX_BUILTIN_WRITERS 8
+
+typedef struct
+{
+    char *path; // NULL for an unused writer
+    FILE *file;
+    dev_t dev;
+    ino_t ino;
+    unsigned long spawn_count; // `g_spawn_count` when the inode was last checked
+    unsigned long last_used;
+} builtin_writer;
+
+builtin_writer g_writers[MAX_BUILTIN_WRITERS];
+unsigned long g_writer_clock = 0;
+unsigned long g_spawn_count = 0; // Programs spawned so far
+
+void writer_close(builtin_writer *writer)
+{
+    fclose(writer->file);
+    free(writer->path);
+    writer->path = NULL;
+    writer->file = NULL;
+}
+
+void writers_flush()
+{
+    for (int i = 0; i < MAX_BUILTIN_WRITERS; i++)
+    {
+        if (g_writers[i].path != NULL)
+        {
+            fflush(g_writers[i].file);
+        }
+    }
+}
+
+void writers_close_all()
+{
+    for (int i = 0; i < MAX_BUILTIN_WRITERS; i++)
+    {
+        if (g_writers[i].path != NULL)
+        {
+            writer_close(&g_writers[i]);
+        }
+    }
+}
+
+// Returns the stream a builtin should write its output to, for a `>`, `>|` or `>>` redirection
+// - NULL if the file can't be opened (the error was printed)
+FILE *writer_open(const redirection *r)
+{
+    g_writer_clock++;
+    builtin_writer *writer = NULL;
+    builtin_writer *victim = &g_writers[0];
+    for (int i = 0; i < MAX_BUILTIN_WRITERS; i++)
+    {
+        if (g_writers[i].path != NULL && strcmp(g_writers[i].path, r->target) == 0)
+        {
+            writer = &g_writers[i];
+            break;
+        }
+        // Remember an unused writer, or else the least recently used one, in case it's not found
+        if (victim->path != NULL && (g_writers[i].path == NULL || g_writers[i].last_used < victim->last_used))
+        {
+            victim = &g_writers[i];
+        }
+    }
+
+    struct stat st;
+    if (writer != NULL && writer->spawn_count != g_spawn_count)
+    {
+        // A program ran since the last use, make sure the path still leads to the same file
+        if (stat(r->target, &st) == -1 || st.st_dev != writer->dev || st.st_ino != writer->ino)
+        {
+            writer_close(writer);
+            victim = writer;
+            writer = NULL;
+        }
+        else
+        {
+            writer->spawn_count = g_spawn_count;
+        }
+    }
+
+    if (writer != NULL)
+    {
+        if (r->kind != REDIRECT_APPEND)
+        {
+            if (r->kind == REDIRECT_TRUNCATE && g_noclobber)
+            {
+                fprintf(stderr, ANSI_COLOR_RED "imcsh: %s: cannot overwrite existing file (noclobber is on, use '>|')\n" ANSI_COLOR_RESET, r->target);
+                return NULL;
+            }
+            fflush(writer->file);
+            ftruncate(fileno(writer->file), 0); // Append mode, so the next write lands at the new end
+        }
+        writer->last_used = g_writer_clock;
+        return writer->file;
+    }
+
+    int fd = open_redirection(r, 1);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    if (victim->path != NULL)
+    {
+        writer_close(victim);
+    }
+    victim->file = fdopen(fd, "a");
+    victim->path = strdup(r->target);
+    if (victim->file == NULL || victim->path == NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+        exit(EXIT_FAILURE);
+    }
+    fstat(fd, &st);
+    victim->dev = st.st_dev;
+    victim->ino = st.st_ino;
+    victim->spawn_count = g_spawn_count;
+    victim->last_used = g_writer_clock;
+    return victim->file;
+}
+
+// ----------------------
+// |   Spawn backends   |
+// ----------------------
+// How a child process gets created, selectable with `--spawn=` at startup or `set spawn=` at runtime:
+// - `posix_spawn` - glibc's implementation, which itself clones with a shared address space and waits for the `exec`
+// - `vfork`       - the same idea done by hand: the child borrows the parent's memory until it calls `execve`
+// - `clone3`      - `CLONE_VFORK | CLONE_PIDFD`, the kernel hands back the pidfd of the child right away, so no `pidfd_open`
+//                   is needed, but the child gets a copy-on-write copy of the memory like after `fork`
+// Source: https://man7.org/linux/man-pages/man2/clone.2.html, https://man7.org/linux/man-pages/man2/vfork.2.html
+typedef enum
+{
+    SPAWN_POSIX_SPAWN,
+    SPAWN_VFORK,
+    SPAWN_CLONE3,
+    NUM_SPAWN_BACKENDS,
+} spawn_backend;
+
+const char *g_spawn_backend_names[NUM_SPAWN_BACKENDS] = {"posix_spawn", "vfork", "clone3"};
+spawn_backend g_spawn_backend = SPAWN_POSIX_SPAWN;
+
+// Selects a backend by name, returns -1 for an unknown one
+int set_spawn_backend(const char *name)
+{
+    for (int i = 0; i < NUM_SPAWN_BACKENDS; i++)
+    {
+        if (strcmp(name, g_spawn_backend_names[i]) == 0)
+        {
+            g_spawn_backend = (spawn_backend)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// One `dup2` the child does before running the program, in order, a `from == to` pair just keeps the fd open across `exec`
+typedef struct
+{
+    int from;
+    int to;
+} spawn_dup;
+
+// Where and how a job's processes run, from `exec --cpus=4-7 --nice=10 --sched=batch ...` or the shell-wide `set` defaults
+// - everything is applied by the child itself before its `execve`, so the program never runs a single instruction unpinned
+// - `posix_spawn` can't do it: glibc's `posix_spawnattr_setschedpolicy` only accepts SCHED_OTHER, SCHED_FIFO and SCHED_RR,
+//   and there are no attributes for the niceness or the affinity, so a placed job is spawned with `vfork` there instead
+// Docs: https://man7.org/linux/man-pages/man7/sched.7.html
+typedef struct
+{
+    int has_cpus;
+    cpu_set_t cpus;
+    int has_nice;
+    int nice;
+    int sched; // SCHED_OTHER, SCHED_BATCH or SCHED_IDLE, -1 to keep the shell's
+} placement;
+
+placement g_placement = {.sched = -1}; // The shell-wide defaults, `set cpus=`, `set nice=` and `set sched=`
+
+const char *g_sched_names[] = {"other", "batch", "idle"};
+const int g_sched_policies[] = {SCHED_OTHER, SCHED_BATCH, SCHED_IDLE};
+#define NUM_SCHED_POLICIES 3
+
+int placement_active(const placement *place)
+{
+    return place->has_cpus || place->has_nice || place->sched != -1;
+}
+
+// Parses a CPU list like `4-7`, `0,2` or `0-3,8-11`, returns -1 if it is not valid
+int parse_cpu_list(const char *list, cpu_set_t *cpus)
+{
+    CPU_ZERO(cpus);
+    const char *p = list;
+    while (1)
+    {
+        if (!isdigit((unsigned char)*p))
+        {
+            return -1;
+        }
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (*end == '-')
+        {
+            if (!isdigit((unsigned char)end[1]))
+            {
+                return -1;
+            }
+            last = strtol(end + 1, &end, 10);
+        }
+        if (last < first || last >= CPU_SETSIZE)
+        {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            CPU_SET(cpu, cpus);
+        }
+        if (*end == '\0')
+        {
+            return 0;
+        }
+        if (*end != ',')
+        {
+            return -1;
+        }
+        p = end + 1;
+    }
+}
+
+// Writes a mask back as a CPU list, with ranges where possible
+void format_cpu_list(char *buffer, size_t size, const cpu_set_t *cpus)
+{
+    size_t length = 0;
+    buffer[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && length < size; cpu++)
+    {
+        if (!CPU_ISSET(cpu, cpus))
+        {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus))
+        {
+            last++;
+        }
+        length += snprintf(buffer + length, size - length, (last > cpu) ? "%s%d-%d" : "%s%d", length ? "," : "", cpu, last);
+        cpu = last;
+    }
+}
+
+// Parses one of the placement settings into `place`, `off` goes back to what the shell itself has
+// - returns 0 if `name` is not a placement setting, 1 if it was set, -1 after printing an error for an invalid value
+int parse_placement_option(const char *name, const char *value, placement *place)
+{
+    int is_cpus = strcmp(name, "cpus") == 0, is_nice = strcmp(name, "nice") == 0, is_sched = strcmp(name, "sched") == 0;
+    if ((!is_cpus && !is_nice && !is_sched) || value == NULL)
+    {
+        return 0;
+    }
+    int off = strcmp(value, "off") == 0;
+    if (is_cpus)
+    {
+        place->has_cpus = 0;
+        if (off)
+        {
+            return 1;
+        }
+        // Only CPUs the shell may use itself count, a mask without any of them would make every spawn fail
+        cpu_set_t allowed;
+        if (parse_cpu_list(value, &place->cpus) == -1)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: invalid CPU list '%s', expected e.g. '4-7' or '0,2'\n" ANSI_COLOR_RESET, value);
+            return -1;
+        }
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+        {
+            CPU_AND(&allowed, &allowed, &place->cpus);
+            if (CPU_COUNT(&allowed) == 0)
+            {
+                fprintf(stderr, ANSI_COLOR_RED "imcsh: none of the CPUs '%s' is available\n" ANSI_COLOR_RESET, value);
+                return -1;
+            }
+        }
+        place->has_cpus = 1;
+    }
+    else if (is_nice)
+    {
+        place->has_nice = 0;
+        if (off)
+        {
+            return 1;
+        }
+        char *end;
+        long nice = strtol(value, &end, 10);
+        if (*value == '\0' || *end != '\0' || nice < -20 || nice > 19)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: invalid nice value '%s', expected -20 to 19\n" ANSI_COLOR_RESET, value);
+            return -1;
+        }
+        place->has_nice = 1;
+        place->nice = (int)nice;
+    }
+    else
+    {
+        place->sched = -1;
+        if (off)
+        {
+            return 1;
+        }
+        for (int i = 0; i < NUM_SCHED_POLICIES; i++)
+        {
+            if (strcmp(value, g_sched_names[i]) == 0)
+            {
+                place->sched = g_sched_policies[i];
+            }
+        }
+        if (place->sched == -1)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: unknown scheduling policy '%s' (other, batch or idle)\n" ANSI_COLOR_RESET, value);
+            return -1;
+        }
+    }
+    return 1;
+}
+
+// Prints the placement settings the way `set` takes them
+void print_placement(FILE *out, const placement *place)
+{
+    char cpus[256] = "off";
+    if (place->has_cpus)
+    {
+        format_cpu_list(cpus, sizeof(cpus), &place->cpus);
+    }
+    fprintf(out, "cpus=%s\n", cpus);
+    if (place->has_nice)
+    {
+        fprintf(out, "nice=%d\n", place->nice);
+    }
+    else
+    {
+        fprintf(out, "nice=off\n");
+    }
+    const char *sched = "off";
+    for (int i = 0; i < NUM_SCHED_POLICIES; i++)
+    {
+        if (place->sched == g_sched_policies[i])
+        {
+            sched = g_sched_names[i];
+        }
+    }
+    fprintf(out, "sched=%s\n", sched);
+}
+
+// Applies a placement to the calling process, the child does it right before its `execve`
+int apply_placement(const placement *place)
+{
+    if (place->has_cpus && sched_setaffinity(0, sizeof(place->cpus), &place->cpus) == -1)
+    {
+        return -1;
+    }
+    if (place->has_nice && setpriority(PRIO_PROCESS, 0, place->nice) == -1)
+    {
+        return -1; // e.g. EACCES for a negative value without the privilege to raise the priority
+    }
+    if (place->sched != -1)
+    {
+        struct sched_param param = {0}; // The priority has to be 0 outside of the real-time policies
+        if (sched_setscheduler(0, place->sched, &param) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// The limits a job can be given, in the order of `job_limits`
+// - the child sets them on itself before its `execve`, like the placement, `posix_spawn` has no attribute for them either
+// - a limit is never raised over the hard limit the shell already has, that one is stricter anyway
+// Docs: https://man7.org/linux/man-pages/man2/getrlimit.2.html
+typedef struct
+{
+    const char *name; // In `limit` and as an `exec` option
+    int resource;
+    char unit;        // 'b' for bytes, 's' for seconds, 'n' for a plain count
+    const char *what;
+} limit_kind;
+
+enum
+{
+    LIMIT_MEM,
+    LIMIT_CPUTIME,
+    LIMIT_FILES,
+    LIMIT_PROCS,
+    LIMIT_FILESIZE,
+};
+
+const limit_kind g_limit_kinds[NUM_LIMITS] = {
+    {"mem", RLIMIT_AS, 'b', "address space"},
+    {"cputime", RLIMIT_CPU, 's', "CPU time, SIGXCPU and a second later SIGKILL"},
+    {"files", RLIMIT_NOFILE, 'n', "open file descriptors"},
+    {"procs", RLIMIT_NPROC, 'n', "processes of the user, counting every one the user has"},
+    {"filesize", RLIMIT_FSIZE, 'b', "size of a written file, SIGXFSZ beyond it"},
+};
+
+int limits_active(const job_limits *limits)
+{
+    for (int i = 0; i < NUM_LIMITS; i++)
+    {
+        if (limits->values[i] != RLIM_INFINITY)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Writes a limit the way `limit` takes it, e.g. `1G`, `30s`, `256` or `off`
+void format_limit(char *buffer, size_t size, int kind, rlim_t value)
+{
+    if (value == RLIM_INFINITY)
+    {
+        snprintf(buffer, size, "off");
+    }
+    else if (g_limit_kinds[kind].unit == 's')
+    {
+        snprintf(buffer, size, "%llus", (unsigned long long)value);
+    }
+    else if (g_limit_kinds[kind].unit == 'b' && value % (1024 * 1024 * 1024) == 0)
+    {
+        snprintf(buffer, size, "%lluG", (unsigned long long)(value / (1024 * 1024 * 1024)));
+    }
+    else if (g_limit_kinds[kind].unit == 'b' && value % (1024 * 1024) == 0)
+    {
+        snprintf(buffer, size, "%lluM", (unsigned long long)(value / (1024 * 1024)));
+    }
+    else if (g_limit_kinds[kind].unit == 'b' && value % 1024 == 0)
+    {
+        snprintf(buffer, size, "%lluK", (unsigned long long)(value / 1024));
+    }
+    else
+    {
+        snprintf(buffer, size, "%llu", (unsigned long long)value);
+    }
+}
+
+// Sets the limits on the calling process, the child does it right before its `execve`
+int apply_limits(const job_limits *limits)
+{
+    for (int i = 0; i < NUM_LIMITS; i++)
+    {
+        rlim_t value = limits->values[i];
+        struct rlimit current;
+        if (value == RLIM_INFINITY || getrlimit(g_limit_kinds[i].resource, &current) == -1)
+        {
+            continue;
+        }
+        // For the CPU time the hard limit is a second later, so the program gets a SIGXCPU it could still react to first
+        struct rlimit limit;
+        limit.rlim_max = (i == LIMIT_CPUTIME) ? value + 1 : value;
+        if (current.rlim_max < limit.rlim_max)
+        {
+            limit.rlim_max = current.rlim_max;
+        }
+        limit.rlim_cur = (value < limit.rlim_max) ? value : limit.rlim_max;
+        if (setrlimit(g_limit_kinds[i].resource, &limit) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Tells which limit a process that was killed by a signal ran into, returns 0 if none of them
+// - the CPU time and the file size are certain, the kernel itself sends the signal
+// - running out of address space only makes allocations fail, a crash afterwards is most likely because of it, but not surely
+int limit_note(char *buffer, size_t size, const job_limits *limits, int status, const struct rusage *usage)
+{
+    if (!WIFSIGNALED(status))
+    {
+        return 0;
+    }
+    int sig = WTERMSIG(status);
+    double cpu = timeval_seconds(&usage->ru_utime) + timeval_seconds(&usage->ru_stime);
+    char value[32];
+    rlim_t cputime = limits->values[LIMIT_CPUTIME];
+    if (cputime != RLIM_INFINITY && (sig == SIGXCPU || (sig == SIGKILL && cpu >= (double)cputime)))
+    {
+        format_limit(value, sizeof(value), LIMIT_CPUTIME, cputime);
+        snprintf(buffer, size, "it exceeded its cputime limit of %s", value);
+        return 1;
+    }
+    if (limits->values[LIMIT_FILESIZE] != RLIM_INFINITY && sig == SIGXFSZ)
+    {
+        format_limit(value, sizeof(value), LIMIT_FILESIZE, limits->values[LIMIT_FILESIZE]);
+        snprintf(buffer, size, "it exceeded its filesize limit of %s", value);
+        return 1;
+    }
+    if (limits->values[LIMIT_MEM] != RLIM_INFINITY && (sig == SIGSEGV || sig == SIGABRT || sig == SIGBUS))
+    {
+        format_limit(value, sizeof(value), LIMIT_MEM, limits->values[LIMIT_MEM]);
+        snprintf(buffer, size, "most likely out of memory under its mem limit of %s", value);
+        return 1;
+    }
+    return 0;
+}
+
+// What a child is set up with besides its fds, the same for every stage of a job
+typedef struct
+{
+    pid_t pgid;                 // Process group to join, 0 to lead a new one, -1 to stay in the shell's
+    int take_terminal;          // Make its group the foreground one before the program runs
+    const placement *placement; // CPUs, niceness and scheduling policy, NULL to inherit the shell's
+    const job_limits *limits;   // Resource limits, NULL for none
+} spawn_attributes;
+
+// The child of `vfork` and `clone3` stores the `errno` of a failed `execve` here, as the return value of the spawn
+// - a shared mapping, so even the `clone3` child, which has its own copy of the memory, writes into the parent's
+int *g_spawn_error = NULL;
+
+// Runs in the child: sets up the fds and runs the program, never returns
+void spawn_child(const char *path, char **argv, char **envp, const spawn_dup *dups, int num_dups, const sigset_t *mask,
+                 const spawn_attributes *attributes)
+{
+    signal(SIGCHLD, SIG_DFL); // The shell's handler would write into the shell's self-pipe
+    if ((attributes->placement != NULL && apply_placement(attributes->placement) == -1) ||
+        (attributes->limits != NULL && apply_limits(attributes->limits) == -1))
+    {
+        *g_spawn_error = errno;
+        _exit(127);
+    }
+    if (attributes->pgid != -1)
+    {
+        // Still with every signal blocked, so taking the terminal from a background group can't stop the child
+        setpgid(0, attributes->pgid);
+        if (attributes->take_terminal)
+        {
+            tcsetpgrp(STDIN_FILENO, getpgrp());
+        }
+        for (int sig = 1; sig < NSIG; sig++)
+        {
+            if (sigismember(&g_job_signals, sig) == 1)
+            {
+                signal(sig, SIG_DFL);
+            }
+        }
+    }
+    sigprocmask(SIG_SETMASK, mask, NULL);
+    for (int i = 0; i < num_dups; i++)
+    {
+        if (dups[i].from == dups[i].to ? fcntl(dups[i].from, F_SETFD, 0) == -1 : dup2(dups[i].from, dups[i].to) == -1)
+        {
+            *g_spawn_error = errno;
+            _exit(127);
+        }
+    }
+    execve(path, argv, envp);
+    *g_spawn_error = errno;
+    _exit(127);
+}
+
+// Starts `path` with `argv` using the selected backend, returns 0 or an `errno` value, like `posix_spawn` does
+// - `*pidfd` is set to the child's pidfd if the backend made one, -1 otherwise
+// - a placed or limited job always gets a child of its own to set itself up in, even with `posix_spawn` selected
+int spawn_process(pid_t *pid, int *pidfd, const char *path, char **argv, const spawn_dup *dups, int num_dups,
+                  const spawn_attributes *attributes)
+{
+    *pidfd = -1;
+    char **envp = env_array();
+    pid_t pgid = attributes->pgid;
+    if (g_spawn_backend == SPAWN_POSIX_SPAWN && attributes->placement == NULL && attributes->limits == NULL)
+    {
+        // Initialize file actions - these behind the scenes use the usual `open()`, `close()`, `dup2()` functions
+        posix_spawn_file_actions_t file_actions;
+        posix_spawn_file_actions_init(&file_actions);
+        posix_spawnattr_t attr;
+        posix_spawnattr_t *attrp = NULL;
+        if (pgid != -1)
+        {
+            posix_spawnattr_init(&attr);
+            posix_spawnattr_setpgroup(&attr, pgid);
+            posix_spawnattr_setsigdefault(&attr, &g_job_signals);
+            posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF);
+            attrp = &attr;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 35)
+            if (attributes->take_terminal)
+            {
+                // Before the `dup2`s, fd 0 may be redirected away from the terminal by them
+                posix_spawn_file_actions_addtcsetpgrp_np(&file_actions, STDIN_FILENO);
+            }
+#endif
+        }
+        for (int i = 0; i < num_dups; i++)
+        {
+            posix_spawn_file_actions_adddup2(&file_actions, dups[i].from, dups[i].to);
+        }
+        int status = posix_spawn(pid, path, &file_actions, attrp, argv, envp);
+        posix_spawn_file_actions_destroy(&file_actions);
+        if (attrp != NULL)
+        {
+            posix_spawnattr_destroy(attrp);
+        }
+        return status;
+    }
+
+    if (g_spawn_error == NULL)
+    {
+        g_spawn_error = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (g_spawn_error == MAP_FAILED)
+        {
+            g_spawn_error = NULL;
+            return errno;
+        }
+    }
+    *g_spawn_error = 0;
+
+    // No signal handler may run in the child before it has reset them, the mask is restored on both sides right after
+    sigset_t all, old;
+    sigfillset(&all);
+    sigprocmask(SIG_BLOCK, &all, &old);
+
+    pid_t child;
+    if (g_spawn_backend == SPAWN_CLONE3)
+    {
+        struct clone_args args;
+        memset(&args, 0, sizeof(args));
+        args.flags = CLONE_VFORK | CLONE_PIDFD;
+        args.pidfd = (uint64_t)(uintptr_t)pidfd;
+        args.exit_signal = SIGCHLD;
+        child = (pid_t)syscall(SYS_clone3, &args, CLONE_ARGS_SIZE_VER0);
+    }
+    else
+    {
+        child = vfork();
+    }
+    if (child == 0)
+    {
+        spawn_child(path, argv, envp, dups, num_dups, &old, attributes);
+    }
+    int error = (child == -1) ? errno : *g_spawn_error;
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    if (child == -1)
+    {
+        if (error == ENOSYS && g_spawn_backend == SPAWN_CLONE3)
+        {
+            // Kernels before 5.3 have no `clone3`, stay with the default from now on
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: clone3 is not supported by this kernel, using posix_spawn\n" ANSI_COLOR_RESET);
+            g_spawn_backend = SPAWN_POSIX_SPAWN;
+            return spawn_process(pid, pidfd, path, argv, dups, num_dups, attributes);
+        }
+        return error;
+    }
+    if (error != 0)
+    {
+        // The `exec` failed, the child is already gone - reap it right away, it never became part of a job
+        waitpid(child, NULL, 0);
+        if (*pidfd != -1)
+        {
+            close(*pidfd);
+            *pidfd = -1;
+        }
+        return error;
+    }
+    *pid = child;
+    return 0;
+}
+
+// ------------------------------------------------------
+// |   Define possible functions for the shell to use   |
+// ------------------------------------------------------
+void help(char **args, int background, FILE *out, command_line *command)
+{
+    (void)command;
+    (void)args;
+    (void)background;
+
+    fprintf(out, "Available commands:\n");
+    fprintf(out, "  globalusage - Display basic information about the shell\n");
+    fprintf(out, "  help        - Show this help message\n");
+    fprintf(out, "  echo        - Echos the user's input\n");
+    fprintf(out, "  quit        - Quit the shell\n");
+    fprintf(out, "  exec        - Execute a program like a regular shell would do, stages can be piped with '|'\n");
+    fprintf(out, "  set         - Show or change shell settings, e.g. 'set pipesize=1M'\n");
+    fprintf(out, "  limit       - Show or change the resource limits of jobs: 'limit mem=1G cputime=30s files=256 procs=100 filesize=10M'\n");
+    fprintf(out, "  hash        - List the remembered program locations, 'hash name' adds one, 'hash -r' forgets all\n");
+    fprintf(out, "  parallel    - Run the command lines of a file (or stdin) with at most N at a time: 'parallel -j N [--cpus=LIST] [file]'\n");
+    fprintf(out, "  jobs        - List the running and stopped jobs with their CPU time and memory, the busiest first\n");
+    fprintf(out, "  fg          - Continue a job in the foreground: 'fg [job]', Ctrl+Z stops the foreground job again\n");
+    fprintf(out, "  bg          - Continue a stopped job in the background: 'bg [job]'\n");
+    fprintf(out, "  kill        - Send a signal to jobs or processes: 'kill [-SIGNAL] %%job|pid ...', 'kill -l' lists them\n");
+    fprintf(out, "  wait        - Wait for background jobs to finish: 'wait [--timeout=SECS] [job ...]'\n");
+    fprintf(out, "  time        - Run a command and report its run time and resource usage, e.g. 'time exec make'\n");
+    fprintf(out, "  cache       - Replay the output of a program that ran before: 'cache [--input=FILE] [--env=NAME] [--content] exec ...',\n");
+    fprintf(out, "                'cache stats' shows the hits and misses, 'cache clear' empties it\n");
+    fprintf(out, "  on-change   - Rerun a command when files change: 'on-change [--debounce=0.2s] [--restart] [--initial] PATH... -- exec make'\n");
+    fprintf(out, "  watch       - Run a command every few seconds: 'watch [-n SECS] [--restart] exec df -h', stop it like a job\n");
+    fprintf(out, "  output      - Print the captured output of a background job: 'output <job>'\n");
+    fprintf(out, "  tail        - Print the last lines of a background job's captured output: 'tail <job> [lines]'\n");
+    fprintf(out, "  export      - Set variables for the programs started from now on: 'export NAME=value'\n");
+    fprintf(out, "  unset       - Remove variables: 'unset NAME'\n");
+    fprintf(out, "  env         - List the variables programs get\n");
+    fprintf(out, "  history     - List the newest commands, 'history ls' those starting with ls, 'history -s text' those containing it\n");
+    fprintf(out, "  stats       - Show the counters and latencies of the shell, 'stats --prometheus' in the Prometheus text format\n");
+    fprintf(out, "  trace       - Record what the shell spends its time on: 'trace on FILE', 'trace off' writes it for chrome://tracing\n");
+    fprintf(out, "Exec options: '--timeout=SECS', '--capture', '--cpus=4-7', '--nice=10', '--sched=batch|idle|other' (defaults with 'set'),\n");
+    fprintf(out, "              '--mem=1G', '--cputime=30s', '--files=256', '--procs=100', '--filesize=10M' (defaults with 'limit')\n");
+    fprintf(out, "Redirections: '> file', '>> file', '>| file', '< file', '2> file', '2>&1'\n");
+    fprintf(out, "Lists: 'a; b', 'a && b' (b if a succeeded), 'a || b' (b if a failed), '(a; b)' groups, '&' after any of them runs it in the background\n");
+    fprintf(out, "Variables: $NAME and ${NAME} expand to the value of a variable, $? to the status of the last command\n");
+    fprintf(out, "Quoting: '...' keeps everything literally, \"...\" too except for \\ escapes and $NAME, \\ escapes the next character\n");
+}
+
+void globalusage(char **args, int background, FILE *out, command_line *command)
+{
+    (void)command;
+    (void)args;
+    (void)background;
+
+    fprintf(out, "IMCSH Version 1.1 created by David Fodor\n");
+}
+
+void echo(char **args, int background, FILE *out, command_line *command)
+{
+    (void)command;
+    (void)background;
+
+    // The words are printed with a single space between them, like other shells do - quote them to keep more
+    for (char **arg = args; *arg != NULL; arg++)
+    {
+        fputs(*arg, out);
+        fputc(arg[1] != NULL ? ' ' : '\n', out);
+    }
+}
+
+void quit_shell(char **args, int background, FILE *out, command_line *command)
+{
+    (void)command;
+    (void)args;
+    (void)background;
+    (void)out;
+
+    if (g_num_active_jobs > 0)
+    {
+        printf("The following processes are running:\n");
+        for (int slot = g_active_head; slot != -1; slot = g_jobs[slot].next)
+        {
+            for (int i = 0; i < g_jobs[slot].num_procs; ++i)
+            {
+                printf("    -> pid: %d\n", g_jobs[slot].pids[i]);
+            }
+        }
+    }
+
+    char answer = 'y'; // Without a terminal there is nobody to ask, `quit` in a script simply quits
+    int valid = !g_interactive; // Interesting how C didn't have bool in it's original form
+
+    while (!valid)
+    {
+        printf("Are you sure you want to quit? [Y/n]: ");
+        fflush(stdout);
+
+        // Read the answer through the same reader as the commands, so no typed-ahead input gets lost in between
+        char *line = reader_next_line(&g_input);
+        if (line == NULL)
+        {
+            answer = 'y'; // EOF (Ctrl+D) while asking counts as a yes
+            break;
+        }
+
+        // Skip any leading whitespace, then expect exactly one character
+        while (*line == ' ' || *line == '\t')
+            line++;
+        answer = line[0];
+
+        if ((answer == 'y' || answer == 'Y' || answer == 'n' || answer == 'N') && line[1] == '\0')
+        {
+            valid = 1; // Valid input received
+        }
+        else
+        {
+            printf("Invalid input. Please enter 'Y' or 'n'.\n\n");
+        }
+    }
+
+    if (answer == 'n' || answer == 'N')
+    {
+        return;
+    }
+    else
+    {
+        // Loop through all the remaining children, terminating them to not get orphan processes
+        // - SIGTERM first, so long-running workers get the chance to flush their state, SIGKILL only for what is still
+        //   around after the grace period
+        // Source: https://stackoverflow.com/questions/6501522/how-to-kill-a-child-process-by-the-parent-process
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline = timespec_add(deadline, TIMEOUT_KILL_GRACE);
+        for (int slot = g_active_head; slot != -1; slot = g_jobs[slot].next)
+        {
+            for (int i = 0; i < g_jobs[slot].num_procs; ++i)
+            {
+                printf("Terminating process with pid: %d...\n", g_jobs[slot].pids[i]);
+            }
+            job_signal(slot, SIGTERM);
+            job_continue(slot); // A stopped one couldn't act on it
+        }
+        fflush(stdout);
+        while (g_num_active_jobs > 0)
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double left = elapsed_seconds(&now, &deadline);
+            if (left <= 0)
+            {
+                break;
+            }
+            run_events((int)(left * 1000) + 1);
+        }
+        for (int slot = g_active_head; slot != -1; slot = g_jobs[slot].next)
+        {
+            for (int i = 0; i < g_jobs[slot].num_procs; ++i)
+            {
+                printf("Killing process with pid: %d...\n", g_jobs[slot].pids[i]);
+            }
+            job_signal(slot, SIGKILL); // Already reaped stages are skipped, zombies just ignore it
+        }
+        flush_reports();
+    }
+
+    metrics_export(); // The final numbers, it would only be rewritten every few seconds otherwise
+    trace_stop();
+    history_close();
+    job_control_exit();
+    printf("Quitting shell...\n");
+    exit(0);
+}
+
+// Parses a size like `1048576`, `512K`, `1M` or `2G` into bytes, returns -1 if it is not a valid size
+long parse_size(const char *str)
+{
+    char *end;
+    errno = 0;
+    long value = strtol(str, &end, 10);
+    if (errno != 0 || end == str || value < 0)
+    {
+        return -1;
+    }
+
+    long multiplier = 1;
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        multiplier = 1024;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        multiplier = 1024 * 1024;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        multiplier = 1024L * 1024 * 1024;
+        end++;
+        break;
+    }
+    // A size that doesn't fit would wrap around into a much smaller one, `1G` is no typo for that
+    if (*end != '\0' || value > LONG_MAX / multiplier)
+    {
+        return -1;
+    }
+    return value * multiplier;
+}
+
+// Parses a duration like `30`, `1.5s`, `500ms`, `2m` or `1h` into seconds, returns -1 if it is not valid
+double parse_duration(const char *str)
+{
+    char *end;
+    errno = 0;
+    double value = strtod(str, &end);
+    if (errno != 0 || end == str || value < 0)
+    {
+        return -1;
+    }
+    if (strcmp(end, "ms") == 0)
+    {
+        return value / 1000;
+    }
+    if (*end == '\0' || strcmp(end, "s") == 0)
+    {
+        return value;
+    }
+    if (strcmp(end, "m") == 0)
+    {
+        return value * 60;
+    }
+    if (strcmp(end, "h") == 0)
+    {
+        return value * 3600;
+    }
+    return -1;
+}
+
+// Parses one of the resource limits into `limits`, `off` (or `unlimited`) removes it
+// - returns 0 if `name` is not a limit, 1 if it was set, -1 after printing an error for an invalid value
+int parse_limit_option(const char *name, const char *value, job_limits *limits)
+{
+    int kind = 0;
+    while (kind < NUM_LIMITS && strcmp(name, g_limit_kinds[kind].name) != 0)
+    {
+        kind++;
+    }
+    if (kind == NUM_LIMITS || value == NULL)
+    {
+        return 0;
+    }
+    if (strcmp(value, "off") == 0 || strcmp(value, "unlimited") == 0)
+    {
+        limits->values[kind] = RLIM_INFINITY;
+        return 1;
+    }
+
+    double number;
+    switch (g_limit_kinds[kind].unit)
+    {
+    case 'b':
+        number = parse_size(value);
+        break;
+    case 's':
+        number = parse_duration(value);
+        if (number > (long)number)
+        {
+            number = (long)number + 1; // The kernel counts whole seconds, so round up
+        }
+        break;
+    default:
+    {
+        char *end;
+        number = strtol(value, &end, 10);
+        if (*value == '\0' || *end != '\0')
+        {
+            number = -1;
+        }
+    }
+    }
+    if (number < 1)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: invalid %s limit '%s'\n" ANSI_COLOR_RESET, name, value);
+        return -1;
+    }
+    limits->values[kind] = (rlim_t)number;
+    return 1;
+}
+
+// Per-command options of `exec`, written before the program, e.g. `exec --timeout=10s make &`
+typedef struct
+{
+    double timeout; // Seconds until the job gets terminated, 0 for no limit
+    int capture;    // Capture the output of a background job (`--capture`), even if `set capture` is off
+    int detached;   // A foreground job that doesn't get the terminal, for the workers of `parallel`
+    placement placement; // `--cpus=`, `--nice=` and `--sched=`, on top of the defaults
+    job_limits limits;   // `--mem=`, `--cputime=`, `--files=`, `--procs=` and `--filesize=`, on top of the defaults
+    int output_fd;       // Where the stdout of the last stage goes instead of the shell's, -1 if not, set by `cache`
+} exec_options;
+
+// The options of a command that has none of its own, the shell-wide placement and limits
+void exec_options_init(exec_options *options)
+{
+    memset(options, 0, sizeof(*options));
+    options->placement = g_placement;
+    options->limits = g_limits;
+    options->output_fd = -1;
+}
+
+// Parses a single `--name[=value]` option into `options`
+// - returns 0 if there is no such option, 1 if it was taken, -1 after printing an error for an invalid value
+int parse_exec_option(const char *option, const char *value, exec_options *options)
+{
+    int taken;
+    if (strcmp(option, "capture") == 0 && value == NULL)
+    {
+        options->capture = 1;
+    }
+    else if (strcmp(option, "timeout") == 0 && value != NULL)
+    {
+        options->timeout = parse_duration(value);
+        if (options->timeout <= 0)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: invalid timeout '%s'\n" ANSI_COLOR_RESET, value);
+            return -1;
+        }
+    }
+    else if ((taken = parse_placement_option(option, value, &options->placement)) != 0 ||
+             (taken = parse_limit_option(option, value, &options->limits)) != 0)
+    {
+        return taken;
+    }
+    else
+    {
+        return 0;
+    }
+    return 1;
+}
+
+// Parses the leading `--name=value` options and moves `*args` past them (a lone `--` ends the options)
+// - they start out as `defaults`, the ones `parallel` was given, or with NULL the shell-wide ones
+// - returns -1 after printing an error for an unknown or invalid option
+int parse_exec_options(char ***args, exec_options *options, const exec_options *defaults)
+{
+    if (defaults != NULL)
+    {
+        *options = *defaults;
+    }
+    else
+    {
+        exec_options_init(options);
+    }
+    char **arg = *args;
+    for (; *arg != NULL && strncmp(*arg, "--", 2) == 0; arg++)
+    {
+        char *option = *arg + 2;
+        if (*option == '\0')
+        {
+            arg++; // `--` itself
+            break;
+        }
+
+        char *value = strchr(option, '=');
+        if (value != NULL)
+        {
+            *value++ = '\0';
+        }
+        int taken = parse_exec_option(option, value, options);
+        if (taken == 0)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: unknown exec option '--%s'\n" ANSI_COLOR_RESET, option);
+        }
+        if (taken != 1)
+        {
+            return -1;
+        }
+    }
+    *args = arg;
+    return 0;
+}
+
+// Hands the read end of a capture pipe to a job, the event loop drains it into the job's ring buffer
+void job_capture(int slot, int fd)
+{
+    g_jobs[slot].capture_fd = fd;
+    g_jobs[slot].capture = ring_create(g_capture_size);
+    event_watch(fd, EVENT_CAPTURE, (unsigned int)slot);
+}
+
+// Spawns the stages of a parsed command line (a single program or a pipeline) and registers them as a job
+// - returns the job's slot, or -1 if nothing could be started (`g_last_status` holds the reason)
+// - a pipeline that only partially started is still returned, so its running stages get reaped, its `spawn_error` is set
+int spawn_pipeline(command_line *parsed, int background, const exec_options *options)
+{
+    // The builtins' buffered output must be in the files before a program could read (or truncate) them
+    writers_flush();
+    g_spawn_count++;
+
+    // The text of the job for listings, the words joined back together (`job_create` keeps a copy)
+    size_t command_length = 1;
+    for (int i = 0; i < parsed->num_stages; i++)
+    {
+        for (char **word = parsed->stages[i].argv; *word != NULL; word++)
+        {
+            command_length += strlen(*word) + 3;
+        }
+    }
+    char *command = arena_alloc(&g_arena, command_length);
+    char *end = command;
+    for (int i = 0; i < parsed->num_stages; i++)
+    {
+        for (char **word = parsed->stages[i].argv; *word != NULL; word++)
+        {
+            end += sprintf(end, "%s%s", (end == command) ? "" : (word == parsed->stages[i].argv ? " | " : " "), *word);
+        }
+    }
+    *end = '\0';
+
+    // ---------------
+    // SOLUTION 1:
+    // Fork a child process and run the function via execvp, that replaces the processes to be run
+    // Source: https://stackoverflow.com/questions/5460421/how-do-you-write-a-c-program-to-execute-another-program
+    // pid_t pid = fork();
+    // if (pid < 0)
     // {
     //     // Forking error
     //     perror("imcsh");
@@ -349,289 +4746,4645 @@ void execute_program(char *args, int background, const char *output_file)
     // ...
     // ---------------
 
-    // ---------------
-    // SOLUTION 2:
-    // While not as common, I have found the `posix_spawn()` function that works similarly to how Windows handles child processes
-    // - apparently this may be more memory efficient as well, as this does not copy the memory of the parent process
-    // - also a bit less complex, no need for two separate calls - PID checks and such
-    // - disadvantage is the loss of customizability, however this is not an issue for us as we are just executing
-    // Source: https://buffaloitservices.com/an-in-depth-look-at-child-process-creation-in-c
-    // Writing to file: https://unix.stackexchange.com/questions/252901/get-output-of-posix-spawn
-    // Docs: https://man7.org/linux/man-pages/man3/posix_spawn.3.html
+    // ---------------
+    // SOLUTION 2:
+    // While not as common, I have found the `posix_spawn()` function that works similarly to how Windows handles child processes
+    // - apparently this may be more memory efficient as well, as this does not copy the memory of the parent process
+    // - also a bit less complex, no need for two separate calls - PID checks and such
+    // - disadvantage is the loss of customizability, however this is not an issue for us as we are just executing
+    // Source: https://buffaloitservices.com/an-in-depth-look-at-child-process-creation-in-c
+    // Writing to file: https://unix.stackexchange.com/questions/252901/get-output-of-posix-spawn
+    // Docs: https://man7.org/linux/man-pages/man3/posix_spawn.3.html
+
+    // The files of the redirections are opened by the shell before anything is spawned, a missing input file stops the whole pipeline
+    int num_stages = parsed->num_stages;
+    int num_opened = 0;
+    while (num_opened < num_stages && open_stage_redirections(&parsed->stages[num_opened].redirections) == 0)
+    {
+        num_opened++;
+    }
+    if (num_opened < num_stages)
+    {
+        for (int i = 0; i < num_opened; i++)
+        {
+            close_stage_redirections(&parsed->stages[i].redirections);
+        }
+        g_last_status = 1;
+        return -1;
+    }
+
+    // Captured background jobs write their stdout and stderr into a pipe, which the event loop drains into a ring buffer
+    int capture_fds[2] = {-1, -1};
+    if (background && (g_capture || (options != NULL && options->capture)))
+    {
+        if (pipe2(capture_fds, O_CLOEXEC) == -1)
+        {
+            perror("imcsh: pipe");
+            capture_fds[0] = capture_fds[1] = -1; // Not fatal, the job just writes to the terminal
+        }
+        else
+        {
+            fcntl(capture_fds[0], F_SETFL, O_NONBLOCK);
+        }
+    }
+
+    fflush(stdout); // Anything the shell printed so far must come before the children's output
+
+    // The wall time of the job is measured from right before the first spawn until its last process gets reaped
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    // With job control the first stage leads the job's process group, the others join it
+    int take_terminal = g_job_control && !background && (options == NULL || !options->detached);
+    const placement *place = (options != NULL) ? &options->placement : &g_placement;
+    const job_limits *limits = (options != NULL) ? &options->limits : &g_limits;
+
+    // Spawn the stages left to right, wiring each one's stdout into the next one's stdin
+    // - the data flows directly between the children through the kernel pipe, the shell never copies any of it
+    // - pipes are created with O_CLOEXEC, so the only copies a child keeps are the ones `dup2`-d onto 0 and 1
+    pid_t pids[MAX_PIPELINE_STAGES];
+    int pidfds[MAX_PIPELINE_STAGES];
+    int num_spawned = 0;
+    int prev_read = -1; // Read end of the pipe coming from the previous stage
+    for (int i = 0; i < num_stages; i++)
+    {
+        int pipe_fds[2] = {-1, -1};
+        if (i < num_stages - 1)
+        {
+            if (pipe2(pipe_fds, O_CLOEXEC) == -1)
+            {
+                perror("imcsh: pipe");
+                break;
+            }
+            // Optional large-pipe mode, so a fast producer doesn't stall on the default 64 KiB buffer
+            // Docs: https://man7.org/linux/man-pages/man7/pipe.7.html (Pipe capacity)
+            if (g_pipe_size > 0 && fcntl(pipe_fds[1], F_SETPIPE_SZ, (int)g_pipe_size) == -1)
+            {
+                fprintf(stderr, ANSI_COLOR_RED "imcsh: could not resize pipe to %ld bytes: %s\n" ANSI_COLOR_RESET, g_pipe_size, strerror(errno));
+            }
+        }
+
+        // The fds of the child, applied in order by the spawn backend
+        spawn_dup dups[3 + MAX_REDIRECTIONS];
+        int num_dups = 0;
+        if (prev_read != -1)
+        {
+            dups[num_dups++] = (spawn_dup){prev_read, STDIN_FILENO};
+        }
+        if (pipe_fds[1] != -1)
+        {
+            dups[num_dups++] = (spawn_dup){pipe_fds[1], STDOUT_FILENO};
+        }
+        else if (capture_fds[1] != -1)
+        {
+            dups[num_dups++] = (spawn_dup){capture_fds[1], STDOUT_FILENO};
+        }
+        else if (options != NULL && options->output_fd != -1)
+        {
+            dups[num_dups++] = (spawn_dup){options->output_fd, STDOUT_FILENO};
+        }
+        if (capture_fds[1] != -1)
+        {
+            dups[num_dups++] = (spawn_dup){capture_fds[1], STDERR_FILENO}; // The errors of every stage
+        }
+        // The stage's own redirections come last and in the written order, so they win over the plumbing above
+        // - `2>&1` copies whatever fd 1 is at that point in the child, the pipe, the capture or a file
+        const redirection_list *redirections = &parsed->stages[i].redirections;
+        for (int r = 0; r < redirections->count; r++)
+        {
+            dups[num_dups++] = (spawn_dup){redirections->items[r].target_fd, redirections->items[r].fd};
+        }
+
+        // Spawn the new process
+        // - the program is looked up through the PATH cache, so there is no need for a `spawnp`-like search of PATH
+        pid_t pid;
+        int pidfd = -1;
+        char **stage_args = parsed->stages[i].argv;
+        int status = ENOENT;
+        const char *path = resolve_command(stage_args[0]);
+        spawn_attributes attributes;
+        attributes.pgid = !g_job_control ? -1 : (num_spawned == 0 ? 0 : pids[0]);
+        attributes.take_terminal = take_terminal && num_spawned == 0;
+        attributes.placement = placement_active(place) ? place : NULL;
+        attributes.limits = limits_active(limits) ? limits : NULL;
+        if (path != NULL)
+        {
+            struct timespec spawn_start, spawn_end;
+            clock_gettime(CLOCK_MONOTONIC, &spawn_start);
+            status = spawn_process(&pid, &pidfd, path, stage_args, dups, num_dups, &attributes);
+            if (status == ENOENT && path != stage_args[0])
+            {
+                // The cached binary vanished without us noticing (e.g. no inotify), look it up once more
+                path_cache_remove(stage_args[0]);
+                path = resolve_command(stage_args[0]);
+                status = (path != NULL) ? spawn_process(&pid, &pidfd, path, stage_args, dups, num_dups, &attributes) : ENOENT;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &spawn_end);
+            histogram_observe(&g_metrics.spawn_time, elapsed_seconds(&spawn_start, &spawn_end));
+            trace_span(TRACE_SPAWN, &spawn_start, &spawn_end, 0, (status == 0) ? pid : 0, status, stage_args[0]);
+        }
+        g_metrics.spawns++;
+
+        // The parent is done with the ends that now belong to the children
+        if (prev_read != -1)
+        {
+            close(prev_read);
+        }
+        if (pipe_fds[1] != -1)
+        {
+            close(pipe_fds[1]);
+        }
+        prev_read = pipe_fds[0];
+
+        if (path == NULL)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: %s: command not found\n" ANSI_COLOR_RESET, stage_args[0]);
+            g_metrics.spawn_failures++;
+            g_last_status = 127;
+            break;
+        }
+        if (status != 0)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: %s: %s\n" ANSI_COLOR_RESET, stage_args[0], strerror(status));
+            g_metrics.spawn_failures++;
+            g_last_status = 126;
+            break;
+        }
+        if (attributes.take_terminal)
+        {
+            tcsetpgrp(STDIN_FILENO, pid); // The child did it already where the backend could, this covers the rest
+        }
+        pidfds[num_spawned] = pidfd;
+        pids[num_spawned++] = pid;
+    }
+    if (prev_read != -1)
+    {
+        close(prev_read); // Only left open if a stage failed to spawn
+    }
+    for (int i = 0; i < num_stages; i++)
+    {
+        close_stage_redirections(&parsed->stages[i].redirections);
+    }
+    if (capture_fds[1] != -1)
+    {
+        close(capture_fds[1]); // Only the children write, so EOF arrives once all of them are gone
+    }
+
+    if (num_spawned == 0)
+    {
+        if (capture_fds[0] != -1)
+        {
+            close(capture_fds[0]);
+        }
+        if (take_terminal)
+        {
+            tcsetpgrp(STDIN_FILENO, g_shell_pgid); // A child whose `exec` failed may have taken it already
+        }
+        return -1;
+    }
+
+    // Register the job, the reaping code needs it even for a foreground job
+    int slot = job_create(pids, pidfds, num_spawned, background, command, &start_time);
+    g_jobs[slot].pgid = g_job_control ? pids[0] : 0;
+    g_jobs[slot].limits = *limits;
+    if (num_spawned < num_stages)
+    {
+        g_jobs[slot].spawn_error = g_last_status;
+    }
+    if (options != NULL && options->timeout > 0)
+    {
+        job_set_timeout(slot, options->timeout);
+    }
+    if (capture_fds[0] != -1)
+    {
+        job_capture(slot, capture_fds[0]);
+    }
+    return slot;
+}
+
+void execute_program(char **args, int background, FILE *out, command_line *command)
+{
+    (void)out; // Redirections are applied to the spawned processes, per stage
+
+    exec_options options;
+    if (parse_exec_options(&args, &options, NULL) == -1)
+    {
+        g_last_status = 1;
+        return;
+    }
+    if (*args == NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: 'exec' requires a program to run\n" ANSI_COLOR_RESET);
+        g_last_status = 1;
+        return;
+    }
+    if (options.capture && !background)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: '--capture' is only for background jobs\n" ANSI_COLOR_RESET);
+        g_last_status = 1;
+        return;
+    }
+
+    command->stages[0].argv = args; // The first stage is the program after `exec` and its options
+    int slot = spawn_pipeline(command, background, &options);
+    if (slot == -1)
+    {
+        return;
+    }
+
+    if (background)
+    {
+        // If background process just start
+        for (int i = 0; i < g_jobs[slot].num_procs; i++)
+        {
+            printf("Started process with PID %d\n", g_jobs[slot].pids[i]);
+        }
+    }
+    else
+    {
+        // Wait for every stage to finish, a pipeline is done once its last process exits
+        g_last_status = wait_for_job(slot);
+    }
+}
+
+// Runs the command lines of a file (or stdin) as `exec` commands, with at most N of them running at a time
+// - usage: `parallel [-j N] [--exec-option=value...] [file]`, every line is a program or pipeline with optional
+//   redirections, like after `exec` - the options of `exec` (e.g. `--cpus=4-7 --mem=1G`) apply to every line
+// - a slot is refilled as soon as SIGCHLD reports that one of the running jobs finished
+// - when everything is done a summary of the failed lines and their exit codes is printed
+#define MAX_REPORTED_FAILURES 20
+
+typedef struct
+{
+    int slot;       // Job slot, -1 when this runner is free
+    long line_no;
+} parallel_runner;
+
+void parallel_builtin(char **args, int background, FILE *out, command_line *command)
+{
+    (void)command;
+    (void)background;
+    (void)out;
+
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN); // Default to one job per online CPU
+    const char *input_file = NULL;
+    exec_options defaults; // The options of `exec` given to `parallel` apply to every line, which can still override them
+    exec_options_init(&defaults);
+
+    for (; *args != NULL; args++)
+    {
+        char *arg = *args;
+        if (strncmp(arg, "--", 2) == 0)
+        {
+            char *value = strchr(arg, '=');
+            if (value != NULL)
+            {
+                *value++ = '\0';
+            }
+            int taken = parse_exec_option(arg + 2, value, &defaults);
+            if (taken == 0)
+            {
+                fprintf(stderr, ANSI_COLOR_RED "imcsh: parallel: unknown option '%s'\n" ANSI_COLOR_RESET, arg);
+            }
+            if (taken != 1)
+            {
+                g_last_status = 1;
+                return;
+            }
+        }
+        else if (strncmp(arg, "-j", 2) == 0)
+        {
+            const char *value = (arg[2] != '\0') ? arg + 2 : *++args;
+            char *end;
+            max_jobs = (value != NULL) ? strtol(value, &end, 10) : 0;
+            if (value == NULL || *end != '\0' || max_jobs < 1)
+            {
+                fprintf(stderr, ANSI_COLOR_RED "imcsh: parallel: -j expects a positive number\n" ANSI_COLOR_RESET);
+                g_last_status = 1;
+                return;
+            }
+        }
+        else if (input_file == NULL)
+        {
+            input_file = arg;
+        }
+        else
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: usage: parallel [-j N] [--exec-option=value...] [file]\n" ANSI_COLOR_RESET);
+            g_last_status = 1;
+            return;
+        }
+    }
+    if (max_jobs < 1)
+    {
+        max_jobs = 1;
+    }
+
+    // Without a file the lines come from the shell's own input, so `parallel` can be fed by a script or a pipe
+    line_reader file_reader;
+    line_reader *reader = &g_input;
+    if (input_file != NULL)
+    {
+        int fd = open(input_file, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: parallel: cannot open '%s': %s\n" ANSI_COLOR_RESET, input_file, strerror(errno));
+            g_last_status = 1;
+            return;
+        }
+        reader_init(&file_reader, fd);
+        reader = &file_reader;
+    }
+
+    parallel_runner *runners = arena_alloc(&g_arena, max_jobs * sizeof(parallel_runner));
+    for (long i = 0; i < max_jobs; i++)
+    {
+        runners[i].slot = -1;
+    }
+
+    long line_no = 0, started = 0, failed = 0;
+    int running = 0;
+    int input_done = 0;
+    while (!input_done || running > 0)
+    {
+        // Fill the free runners with the next lines
+        for (long i = 0; i < max_jobs && !input_done; i++)
+        {
+            if (runners[i].slot != -1)
+            {
+                continue;
+            }
+
+            char *line;
+            do
+            {
+                line = reader_next_line(reader);
+                line_no++;
+                while (line != NULL && (*line == ' ' || *line == '\t'))
+                    line++;
+            } while (line != NULL && (*line == '\0' || *line == '#')); // Skip empty lines and comments
+            if (line == NULL)
+            {
+                input_done = 1;
+                break;
+            }
+
+            // Everything of the line comes from the command arena, and is given back once the job is started
+            // - parsing cuts the line up, so a copy of it is kept for the error message
+            arena_mark mark = arena_save(&g_arena);
+            size_t length = strlen(line) + 1;
+            char *text = memcpy(arena_alloc(&g_arena, length), line, length);
+
+            // Per-job redirections are handled by `spawn_pipeline`, with the same semantics as `exec`
+            started++;
+            command_line parsed;
+            int slot = -1;
+            if (parse_command_line(line, &parsed) == 0 && parsed.num_stages > 0)
+            {
+                char **words = parsed.stages[0].argv;
+                if (strcmp(words[0], "exec") == 0)
+                {
+                    words++; // The lines may be written as full `exec` commands as well
+                }
+                exec_options options;
+                if (parse_exec_options(&words, &options, &defaults) == 0 && *words != NULL)
+                {
+                    options.detached = 1; // The terminal stays with the shell, so Ctrl+C reaches `parallel` itself
+                    parsed.stages[0].argv = words;
+                    slot = spawn_pipeline(&parsed, 0, &options);
+                }
+            }
+            if (slot == -1 && failed++ < MAX_REPORTED_FAILURES)
+            {
+                // Counts as a failed job right away, the reason was already printed
+                fprintf(stderr, ANSI_COLOR_RED "imcsh: parallel: line %ld failed to start: %s\n" ANSI_COLOR_RESET, line_no, text);
+            }
+            arena_restore(&g_arena, mark);
+            if (slot == -1)
+            {
+                continue;
+            }
+            g_jobs[slot].quiet = 1;
+            runners[i].slot = slot;
+            runners[i].line_no = line_no;
+            running++;
+        }
+
+        if (running == 0)
+        {
+            continue;
+        }
+
+        // Sleep until children finish, then free the runners of the completed jobs
+        wait_for_children();
+        if (g_interrupted)
+        {
+            // Ctrl+C went to the shell, which has the terminal - pass it on to the running lines and start no more
+            g_interrupted = 0;
+            input_done = 1;
+            for (long i = 0; i < max_jobs; i++)
+            {
+                if (runners[i].slot != -1)
+                {
+                    job_signal(runners[i].slot, SIGINT);
+                    job_continue(runners[i].slot);
+                }
+            }
+        }
+        for (long i = 0; i < max_jobs; i++)
+        {
+            int slot = runners[i].slot;
+            if (slot == -1 || g_jobs[slot].num_alive > 0)
+            {
+                continue;
+            }
+            int code = job_exit_code(slot);
+            if (code != 0 && failed++ < MAX_REPORTED_FAILURES)
+            {
+                fprintf(stderr, ANSI_COLOR_RED "imcsh: parallel: line %ld exited with status %d: %s\n" ANSI_COLOR_RESET, runners[i].line_no, code, g_jobs[slot].command);
+            }
+            job_free(slot);
+            runners[i].slot = -1;
+            running--;
+        }
+    }
+
+    printf("parallel: %ld jobs run with up to %ld at a time, %ld succeeded, %ld failed\n", started, max_jobs, started - failed, failed);
+    if (failed > MAX_REPORTED_FAILURES)
+    {
+        printf("parallel: only the first %d failures were listed\n", MAX_REPORTED_FAILURES);
+    }
+    g_last_status = (failed > 0) ? 1 : 0;
+
+    if (reader == &file_reader)
+    {
+        reader_destroy(&file_reader);
+    }
+}
+
+// Live CPU time (seconds) and resident memory (KiB) of a running process, read from /proc/<pid>/stat
+// - returns -1 if the process is gone already
+// Docs: https://man7.org/linux/man-pages/man5/proc_pid_stat.5.html
+int read_process_usage(pid_t pid, double *cpu, long *rss_kib)
+{
+    char path[64], buffer[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    ssize_t len = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (len <= 0)
+    {
+        return -1;
+    }
+    buffer[len] = '\0';
+
+    // The command name in field 2 may contain spaces and parentheses, so start after the last ')'
+    char *fields = strrchr(buffer, ')');
+    if (fields == NULL)
+    {
+        return -1;
+    }
+    unsigned long utime, stime;
+    long rss_pages;
+    // Fields 3 to 24: state ... utime(14) stime(15) ... rss(24)
+    if (sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+               &utime, &stime, &rss_pages) != 3)
+    {
+        return -1;
+    }
+    long ticks = sysconf(_SC_CLK_TCK);
+    *cpu = (double)(utime + stime) / ticks;
+    *rss_kib = rss_pages * (sysconf(_SC_PAGESIZE) / 1024);
+    return 0;
+}
+
+typedef struct
+{
+    int slot;
+    double cpu;  // Reaped processes plus the live ones
+    long rss;    // KiB, live processes only
+    double wall;
+} job_listing;
+
+// Biggest CPU consumer first
+int compare_job_listing(const void *a, const void *b)
+{
+    double diff = ((const job_listing *)b)->cpu - ((const job_listing *)a)->cpu;
+    return (diff > 0) - (diff < 0);
+}
+
+// Lists the running jobs with the resources they use, the hungriest first
+// - followed by the finished jobs whose captured output is still kept
+void jobs_builtin(char **args, int background, FILE *out, command_line *command)
+{
+    (void)command;
+    (void)args;
+    (void)background;
+
+    job_listing *listings = arena_alloc(&g_arena, (g_num_active_jobs + 1) * sizeof(job_listing));
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int count = 0;
+    for (int slot = g_active_head; slot != -1; slot = g_jobs[slot].next)
+    {
+        job *j = &g_jobs[slot];
+        job_listing *listing = &listings[count++];
+        listing->slot = slot;
+        listing->cpu = timeval_seconds(&j->usage.ru_utime) + timeval_seconds(&j->usage.ru_stime);
+        listing->rss = 0;
+        listing->wall = elapsed_seconds(&j->start_time, &now);
+        for (int i = 0; i < j->num_procs; i++)
+        {
+            double cpu;
+            long rss;
+            if (read_process_usage(j->pids[i], &cpu, &rss) == 0)
+            {
+                listing->cpu += cpu; // A reaped pid can't be read anymore, so nothing is counted twice
+                listing->rss += rss;
+            }
+        }
+    }
+    qsort(listings, count, sizeof(job_listing), compare_job_listing);
+
+    if (count == 0 && g_num_finished_jobs == 0)
+    {
+        fprintf(out, "No running jobs\n");
+    }
+    else
+    {
+        fprintf(out, "%-5s %-8s %-8s %10s %10s %10s %10s  %s\n", "JOB", "PID", "STATE", "ELAPSED", "CPU", "RSS", "OUTPUT", "COMMAND");
+        for (int i = 0; i < count; i++)
+        {
+            job *j = &g_jobs[listings[i].slot];
+            char captured[32] = "-";
+            if (j->capture != NULL)
+            {
+                snprintf(captured, sizeof(captured), "%lluB", j->capture->total);
+            }
+            fprintf(out, "%-5d %-8d %-8s %9.1fs %9.2fs %9.1fM %10s  %s\n", listings[i].slot + 1, j->pids[0], j->stopped ? "stopped" : "running",
+                    listings[i].wall, listings[i].cpu, listings[i].rss / 1024.0, captured, j->command);
+        }
+
+        // The finished jobs that still hold captured output, oldest first
+        for (int i = 0; i < g_num_finished_jobs; i++)
+        {
+            int slot = g_finished_jobs[(g_finished_first + i) % MAX_FINISHED_JOBS];
+            job *j = &g_jobs[slot];
+            char state[16], captured[32];
+            snprintf(state, sizeof(state), "done(%d)", job_exit_code(slot));
+            snprintf(captured, sizeof(captured), "%lluB", j->capture->total);
+            fprintf(out, "%-5d %-8d %-8s %9.1fs %9.2fs %10s %10s  %s\n", slot + 1, j->pids[0], state,
+                    elapsed_seconds(&j->start_time, &j->end_time),
+                    timeval_seconds(&j->usage.ru_utime) + timeval_seconds(&j->usage.ru_stime), "-", captured, j->command);
+        }
+    }
+}
+
+// The slot of a job id given to a builtin, -1 if it is not a valid id (the slot may be free though)
+int parse_job_id(const char *id)
+{
+    char *end;
+    long job_id = strtol(id, &end, 10);
+    if (*id == '%')
+    {
+        job_id = strtol(id + 1, &end, 10); // `%3` works as well, like in other shells
+    }
+    return (*end != '\0' || job_id < 1 || job_id > g_jobs_used) ? -1 : (int)job_id - 1;
+}
+
+// Looks up a job by the id given to a builtin, returns its slot or -1 after printing an error
+int job_slot_by_id(const char *builtin, const char *id)
+{
+    int slot = parse_job_id(id);
+    if (slot == -1 || !g_jobs[slot].in_use)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: %s: no such job '%s'\n" ANSI_COLOR_RESET, builtin, id);
+        return -1;
+    }
+    return slot;
+}
+
+// Looks up a job by the id given to a builtin, only jobs with captured output qualify
+int captured_job_slot(const char *builtin, const char *id)
+{
+    int slot = job_slot_by_id(builtin, id);
+    if (slot != -1 && g_jobs[slot].capture == NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: %s: job %d has no captured output\n" ANSI_COLOR_RESET, builtin, slot + 1);
+        return -1;
+    }
+    return slot;
+}
+
+// The job `fg` or `bg` works on, the given one or the current one, only jobs that did not finish yet qualify
+int unfinished_job_slot(const char *builtin, char **args)
+{
+    if (args[0] != NULL && args[1] != NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: usage: %s [job]\n" ANSI_COLOR_RESET, builtin);
+        return -1;
+    }
+    int slot = (args[0] != NULL) ? job_slot_by_id(builtin, args[0]) : current_job();
+    if (slot == -1 && args[0] == NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: %s: no current job\n" ANSI_COLOR_RESET, builtin);
+    }
+    else if (slot != -1 && g_jobs[slot].finished)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: %s: job %d has finished\n" ANSI_COLOR_RESET, builtin, slot + 1);
+        return -1;
+    }
+    return slot;
+}
+
+// Brings a background job to the foreground and continues it if it was stopped: `fg [job]`
+void fg_builtin(char **args, int background, FILE *out, command_line *command)
+{
+    (void)command;
+    (void)background;
+    (void)out;
+
+    int slot = unfinished_job_slot("fg", args);
+    if (slot == -1)
+    {
+        g_last_status = 1;
+        return;
+    }
+    job *j = &g_jobs[slot];
+    printf("%s\n", j->command);
+    fflush(stdout);
+    j->background = 0;
+    g_num_background_jobs--;
+    // The terminal first, a job that continued without it would be stopped again by its first read
+    terminal_give(slot);
+    job_continue(slot);
+    g_last_status = wait_for_job(slot);
+}
+
+// Continues a stopped job in the background: `bg [job]`
+void bg_builtin(char **args, int background, FILE *out, command_line *command)
+{
+    (void)command;
+    (void)background;
+
+    int slot = unfinished_job_slot("bg", args);
+    if (slot == -1)
+    {
+        g_last_status = 1;
+        return;
+    }
+    g_last_status = 0;
+    if (!g_jobs[slot].stopped)
+    {
+        fprintf(stderr, "imcsh: bg: job %d is already running\n", slot + 1);
+        return;
+    }
+    job_continue(slot);
+    g_current_job = slot;
+    fprintf(out, "Job %d continued in the background: %s\n", slot + 1, g_jobs[slot].command);
+}
+
+// Parses a signal given as a number or a name, with or without `SIG`, e.g. `9`, `KILL` or `sigkill` - returns -1 if unknown
+int parse_signal(const char *name)
+{
+    char *end;
+    long number = strtol(name, &end, 10);
+    if (end != name && *end == '\0')
+    {
+        return (number >= 0 && number < NSIG) ? (int)number : -1; // 0 only checks that the target exists
+    }
+    if (strncasecmp(name, "SIG", 3) == 0)
+    {
+        name += 3;
+    }
+    for (int sig = 1; sig < NSIG; sig++)
+    {
+        const char *abbrev = sigabbrev_np(sig);
+        if (abbrev != NULL && strcasecmp(name, abbrev) == 0)
+        {
+            return sig;
+        }
+    }
+    return -1;
+}
+
+// Sends a signal to jobs or processes: `kill [-SIGNAL] %job|pid ...`, SIGTERM unless another one is given
+// - a job gets it through its process group, so all stages of a pipeline (and whatever they started) get it
+// - `kill -l` lists the signals
+void kill_builtin(char **args, int background, FILE *out, command_line *command)
+{
+    (void)command;
+    (void)background;
+
+    if (args[0] != NULL && strcmp(args[0], "-l") == 0)
+    {
+        for (int sig = 1; sig < NSIG; sig++)
+        {
+            if (sigabbrev_np(sig) != NULL)
+            {
+                fprintf(out, "%2d) SIG%s\n", sig, sigabbrev_np(sig));
+            }
+        }
+        g_last_status = 0;
+        return;
+    }
+
+    int sig = SIGTERM;
+    if (args[0] != NULL && args[0][0] == '-')
+    {
+        sig = parse_signal(args[0] + 1);
+        if (sig == -1)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: kill: unknown signal '%s'\n" ANSI_COLOR_RESET, args[0] + 1);
+            g_last_status = 1;
+            return;
+        }
+        args++;
+    }
+    if (args[0] == NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: usage: kill [-SIGNAL] %%job|pid ...\n" ANSI_COLOR_RESET);
+        g_last_status = 1;
+        return;
+    }
+
+    g_last_status = 0;
+    for (; *args != NULL; args++)
+    {
+        if (**args == '%')
+        {
+            int slot = job_slot_by_id("kill", *args);
+            if (slot != -1 && g_jobs[slot].finished)
+            {
+                fprintf(stderr, ANSI_COLOR_RED "imcsh: kill: job %d has finished\n" ANSI_COLOR_RESET, slot + 1);
+                slot = -1;
+            }
+            if (slot == -1)
+            {
+                g_last_status = 1;
+                continue;
+            }
+            job_signal(slot, sig);
+            // A stopped job would only act on the signal once it runs again, so it is continued as well
+            if (g_jobs[slot].stopped && sig != 0 && sig != SIGKILL && sig != SIGSTOP && sig != SIGTSTP && sig != SIGTTIN && sig != SIGTTOU)
+            {
+                job_continue(slot);
+            }
+            continue;
+        }
+
+        char *end;
+        long pid = strtol(*args, &end, 10);
+        if (*end != '\0' || end == *args)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: kill: '%s' is neither a job (%%N) nor a pid\n" ANSI_COLOR_RESET, *args);
+            g_last_status = 1;
+        }
+        else if (kill((pid_t)pid, sig) == -1)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: kill: (%ld) - %s\n" ANSI_COLOR_RESET, pid, strerror(errno));
+            g_last_status = 1;
+        }
+    }
+}
+
+// Waits for background jobs to finish: `wait [--timeout=SECS] [job ...]`, without a job for all of them
+// - the status is the exit code of the last job waited for, 124 when the timeout ran out first (like `timeout` has)
+//   and 130 when it was cancelled with Ctrl+C
+// - a stopped job would never finish, waiting for it returns right away, with 128 + the signal that stopped it
+#define WAIT_TIMED_OUT 124
+
+void wait_builtin(char **args, int background, FILE *out, command_line *command)
+{
+    (void)command;
+    (void)background;
+    (void)out;
+
+    int num_args = 0;
+    while (args[num_args] != NULL)
+    {
+        num_args++;
+    }
+    int *slots = arena_alloc(&g_arena, (num_args + 1) * sizeof(int));
+    int num_slots = 0;
+    double timeout = 0;
+    for (char **arg = args; *arg != NULL; arg++)
+    {
+        if (strncmp(*arg, "--timeout", 9) == 0 && ((*arg)[9] == '=' || ((*arg)[9] == '\0' && arg[1] != NULL)))
+        {
+            const char *value = ((*arg)[9] == '=') ? *arg + 10 : *++arg;
+            timeout = parse_duration(value);
+            if (timeout <= 0)
+            {
+                fprintf(stderr, ANSI_COLOR_RED "imcsh: wait: invalid timeout '%s'\n" ANSI_COLOR_RESET, value);
+                g_last_status = 1;
+                return;
+            }
+            continue;
+        }
+        // A job that already finished is fine too, its slot keeps the status until the next job takes it over
+        int slot = parse_job_id(*arg);
+        if (slot == -1)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: wait: no such job '%s'\n" ANSI_COLOR_RESET, *arg);
+            g_last_status = 1;
+            return;
+        }
+        slots[num_slots++] = slot;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline = timespec_add(deadline, timeout);
+
+    // Nothing is spawned while waiting, so the slots can't be taken over by another job in the meantime
+    int code = 0;
+    int next = 0;
+    while (1)
+    {
+        if (num_slots == 0)
+        {
+            if (g_num_background_jobs <= g_num_stopped_jobs)
+            {
+                break;
+            }
+        }
+        else
+        {
+            job *j = &g_jobs[slots[next]];
+            if (j->num_alive == 0 || j->stopped)
+            {
+                code = (j->num_alive == 0) ? job_exit_code(slots[next]) : 128 + j->stopped;
+                if (++next == num_slots)
+                {
+                    break;
+                }
+                continue;
+            }
+        }
+
+        if (g_interrupted)
+        {
+            g_interrupted = 0;
+            code = 130;
+            break;
+        }
+        int timeout_ms = -1;
+        if (timeout > 0)
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double left = elapsed_seconds(&now, &deadline);
+            if (left <= 0)
+            {
+                code = WAIT_TIMED_OUT;
+                break;
+            }
+            timeout_ms = (int)(left * 1000) + 1;
+        }
+        run_events(timeout_ms);
+    }
+    g_last_status = code;
+}
+
+// Prints the captured output of a background job kept so far: `output <id>` all of it, `tail <id> [lines]` only the end
+void print_captured(const char *builtin, char **args, FILE *out, int tail)
+{
+    char *id = args[0];
+    char *count = (id != NULL) ? args[1] : NULL;
+    int lines = 10;
+    if (id == NULL || (!tail && count != NULL) || (count != NULL && args[2] != NULL) ||
+        (count != NULL && (lines = atoi(count)) < 1))
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: usage: %s\n" ANSI_COLOR_RESET, tail ? "tail <job> [lines]" : "output <job>");
+        g_last_status = 1;
+        return;
+    }
+    int slot = captured_job_slot(builtin, id);
+    if (slot == -1)
+    {
+        g_last_status = 1;
+        return;
+    }
+
+    job *j = &g_jobs[slot];
+    if (j->capture_fd != -1)
+    {
+        drain_capture(slot); // Include what was written since the last event
+    }
+    if (!tail && j->capture->total > j->capture->length)
+    {
+        fprintf(stderr, "imcsh: %s: the first %llu bytes of job %d were dropped, raise 'set capturesize=' to keep more\n",
+                builtin, j->capture->total - j->capture->length, slot + 1);
+    }
+    ring_print(j->capture, tail ? ring_tail_offset(j->capture, lines) : 0, out);
+}
+
+void output_builtin(char **args, int background, FILE *out, command_line *command)
+{
+    (void)command;
+    (void)background;
+    print_captured("output", args, out, 0);
+}
+
+void tail_builtin(char **args, int background, FILE *out, command_line *command)
+{
+    (void)command;
+    (void)background;
+    print_captured("tail", args, out, 1);
+}
+
+// Defined below the function table, which itself needs `time_builtin` to exist first
+void run_function(command_line *command);
+
+// Runs a command and reports how long it took and what it used, e.g. `time exec make -j8`
+// - for programs the totals of every process of the job are shown, for builtins the shell's own usage
+// - the report goes to stderr, so it stays out of a `>` redirected output, like the `time` of other shells
+// - the redirections belong to the timed command, so they are left in `command` for it
+void time_builtin(char **args, int background, FILE *out, command_line *command)
+{
+    (void)background;
+    (void)out;
+
+    struct timespec start, end;
+    struct rusage self_start, self_end;
+    getrusage(RUSAGE_SELF, &self_start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    g_last_job_valid = 0;
+
+    command->stages[0].argv = args; // The timed command is the rest of the line
+    run_function(command);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &self_end);
+
+    char usage_text[160];
+    if (g_last_job_valid)
+    {
+        format_usage(usage_text, sizeof(usage_text), &g_last_job_usage, g_last_job_wall);
+    }
+    else
+    {
+        // No program was run, so the cost is what the shell spent itself
+        struct rusage usage = {0};
+        timersub(&self_end.ru_utime, &self_start.ru_utime, &usage.ru_utime);
+        timersub(&self_end.ru_stime, &self_start.ru_stime, &usage.ru_stime);
+        usage.ru_maxrss = self_end.ru_maxrss;
+        usage.ru_nvcsw = self_end.ru_nvcsw - self_start.ru_nvcsw;
+        usage.ru_nivcsw = self_end.ru_nivcsw - self_start.ru_nivcsw;
+        format_usage(usage_text, sizeof(usage_text), &usage, elapsed_seconds(&start, &end));
+    }
+    fflush(stdout); // Keep the report after the command's own output
+    fprintf(stderr, "time: %s\n", usage_text);
+}
+
+// ------------------
+// |   Exec cache   |
+// ------------------
+// `cache [--input=FILE...] [--env=NAME...] [--content] exec ...` remembers what a program printed and its exit status,
+// and replays them without running it again as long as nothing it depends on changed
+// - the key is a SHA-256 of the working directory, the words of every stage, the binaries they run, the files read
+//   with `<`, the `--input` files and the `--env` variables - files by their size, mtime and inode, or with `--content`
+//   by a hash of what they contain
+// - only stdout is stored (with `2>&1` also the errors), it is written into a file of the store while the program runs
+//   and copied to the terminal (or the `>` file) once it finished, so a miss shows its output at the end
+// - the store is a directory: `objects/` holds the outputs named by their own SHA-256, so the same output is kept
+//   only once, `entries/` one small file per key with the exit status and the object, `tmp/` what is being written
+// - everything is renamed into place, so shells (or workers of the server) sharing the directory never see half a file
+// - the entries are touched on every hit, once the objects grow past `cachesize` the least recently used go first
+// Docs: https://nvlpubs.nist.gov/nistpubs/FIPS/NIST.FIPS.180-4.pdf (SHA-256)
+#define CACHE_KEY_VERSION "imcsh-cache-1" // Part of every key, changing it invalidates the old entries
+#define MAX_CACHE_INPUTS 64
+
+typedef struct
+{
+    uint32_t state[8];
+    uint64_t length; // Bytes hashed so far
+    unsigned char block[64];
+    size_t used; // Bytes waiting in `block`
+} sha256_context;
+
+const uint32_t g_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_init(sha256_context *ctx)
+{
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+void sha256_block(sha256_context *ctx, const unsigned char *block)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + g_sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+    ctx->state[4] += e;
+    ctx->state[5] += f;
+    ctx->state[6] += g;
+    ctx->state[7] += h;
+}
+
+void sha256_update(sha256_context *ctx, const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+    ctx->length += size;
+    while (size > 0)
+    {
+        if (ctx->used == 0 && size >= 64)
+        {
+            sha256_block(ctx, bytes); // Whole blocks straight from the input, no copy
+            bytes += 64;
+            size -= 64;
+            continue;
+        }
+        size_t chunk = (size < 64 - ctx->used) ? size : 64 - ctx->used;
+        memcpy(ctx->block + ctx->used, bytes, chunk);
+        ctx->used += chunk;
+        bytes += chunk;
+        size -= chunk;
+        if (ctx->used == 64)
+        {
+            sha256_block(ctx, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+// Finishes the hash and writes it as 64 hex digits
+void sha256_final(sha256_context *ctx, char hex[65])
+{
+    uint64_t bits = ctx->length * 8;
+    unsigned char padding[72] = {0x80};
+    size_t pad = (ctx->used < 56) ? 56 - ctx->used : 120 - ctx->used;
+    for (int i = 0; i < 8; i++)
+    {
+        padding[pad + i] = (unsigned char)(bits >> (56 - i * 8));
+    }
+    sha256_update(ctx, padding, pad + 8);
+    for (int i = 0; i < 8; i++)
+    {
+        sprintf(hex + i * 8, "%08x", ctx->state[i]);
+    }
+}
+
+// Hashes a string including its terminator, so "ab" "c" and "a" "bc" don't end up the same
+void sha256_string(sha256_context *ctx, const char *str)
+{
+    sha256_update(ctx, str, strlen(str) + 1);
+}
+
+// Hashes what is left of a file from its current offset, returns -1 if it could not be read
+int sha256_fd(sha256_context *ctx, int fd)
+{
+    char buffer[65536];
+    ssize_t bytes;
+    while ((bytes = read(fd, buffer, sizeof(buffer))) != 0)
+    {
+        if (bytes == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        sha256_update(ctx, buffer, bytes);
+    }
+    return 0;
+}
+
+char *g_cache_dir = NULL;               // `set cachedir=`, NULL for the default in ~/.cache
+long g_cache_size = 256L * 1024 * 1024; // `set cachesize=`, what the objects may take up before the oldest are evicted
+
+typedef struct
+{
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stored;
+    unsigned long not_stored; // Misses whose result was not kept, killed by a signal or the program was not found
+    unsigned long evicted;    // Entries removed to stay below `cachesize`
+    unsigned long replayed;   // Bytes of output replayed from hits
+    long bytes;               // Size of the objects when last counted, plus what was stored since, -1 before that
+} cache_counters;
+
+cache_counters g_cache = {0, 0, 0, 0, 0, 0, -1};
+
+// Creates a directory and the missing ones leading to it, like `mkdir -p`
+int make_directories(const char *path)
+{
+    char buffer[PATH_MAX];
+    if (snprintf(buffer, sizeof(buffer), "%s", path) >= (int)sizeof(buffer))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    for (char *slash = strchr(buffer + 1, '/');; slash = strchr(slash + 1, '/'))
+    {
+        if (slash != NULL)
+        {
+            *slash = '\0';
+        }
+        if (mkdir(buffer, 0700) == -1 && errno != EEXIST)
+        {
+            return -1;
+        }
+        if (slash == NULL)
+        {
+            return 0;
+        }
+        *slash = '/';
+    }
+}
+
+// The directory of the store, created on first use, NULL after printing an error if there is none
+const char *cache_directory()
+{
+    static char default_dir[PATH_MAX - 16]; // Room for the subdirectories
+    const char *dir = g_cache_dir;
+    if (dir == NULL)
+    {
+        const char *base = env_get("XDG_CACHE_HOME");
+        const char *home = env_get("HOME");
+        if (base != NULL && *base == '/')
+        {
+            snprintf(default_dir, sizeof(default_dir), "%s/imcsh", base);
+        }
+        else if (home != NULL)
+        {
+            snprintf(default_dir, sizeof(default_dir), "%s/.cache/imcsh", home);
+        }
+        else
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: cache: no HOME, use 'set cachedir=PATH'\n" ANSI_COLOR_RESET);
+            return NULL;
+        }
+        dir = default_dir;
+    }
+
+    static const char *subdirs[] = {"objects", "entries", "tmp"};
+    char path[PATH_MAX];
+    for (size_t i = 0; i < sizeof(subdirs) / sizeof(subdirs[0]); i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", dir, subdirs[i]);
+        if (make_directories(path) == -1)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: cache: could not create '%s': %s\n" ANSI_COLOR_RESET, path, strerror(errno));
+            return NULL;
+        }
+    }
+    return dir;
+}
+
+// Adds what identifies a file to the key: its size, mtime and inode, or with `content` a hash of the file itself
+// - a file that doesn't exist is part of the key as well, creating it later makes a miss
+void cache_hash_file(sha256_context *ctx, const char *path, int content)
+{
+    char text[128];
+    struct stat st;
+    int fd = -1;
+    sha256_string(ctx, path);
+    if (content && (fd = open(path, O_RDONLY | O_CLOEXEC)) != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        sha256_context file;
+        sha256_init(&file);
+        if (sha256_fd(&file, fd) == 0)
+        {
+            sha256_final(&file, text);
+            sha256_string(ctx, text);
+            close(fd);
+            return;
+        }
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    if (stat(path, &st) == -1)
+    {
+        sha256_string(ctx, "missing");
+        return;
+    }
+    snprintf(text, sizeof(text), "%lld %lld.%09ld %llu", (long long)st.st_size, (long long)st.st_mtim.tv_sec,
+             st.st_mtim.tv_nsec, (unsigned long long)st.st_ino);
+    sha256_string(ctx, text);
+}
+
+// Computes the key of a command, see the top of this section for what goes into it
+void cache_key(command_line *command, char **inputs, int num_inputs, char **envs, int num_envs, int content, char key[65])
+{
+    sha256_context ctx;
+    sha256_init(&ctx);
+    sha256_string(&ctx, CACHE_KEY_VERSION);
+    char cwd[PATH_MAX];
+    sha256_string(&ctx, getcwd(cwd, sizeof(cwd)) != NULL ? cwd : "");
+
+    for (int i = 0; i < command->num_stages; i++)
+    {
+        sha256_string(&ctx, "|");
+        const char *path = resolve_command(command->stages[i].argv[0]);
+        cache_hash_file(&ctx, path != NULL ? path : command->stages[i].argv[0], 0); // A rebuilt tool makes a miss
+        for (char **word = command->stages[i].argv; *word != NULL; word++)
+        {
+            sha256_string(&ctx, *word);
+        }
+        const redirection_list *redirections = &command->stages[i].redirections;
+        for (int r = 0; r < redirections->count; r++)
+        {
+            const redirection *item = &redirections->items[r];
+            char text[64];
+            snprintf(text, sizeof(text), "%d %d %d", item->fd, (int)item->kind, item->target_fd);
+            sha256_string(&ctx, text);
+            if (item->kind == REDIRECT_READ)
+            {
+                cache_hash_file(&ctx, item->target, content); // What the program reads is an input as well
+            }
+            else if (item->kind != REDIRECT_DUP)
+            {
+                sha256_string(&ctx, item->target);
+            }
+        }
+    }
+
+    sha256_string(&ctx, "inputs");
+    for (int i = 0; i < num_inputs; i++)
+    {
+        cache_hash_file(&ctx, inputs[i], content);
+    }
+    sha256_string(&ctx, "env");
+    for (int i = 0; i < num_envs; i++)
+    {
+        const char *value = env_get(envs[i]);
+        sha256_string(&ctx, envs[i]);
+        sha256_string(&ctx, value != NULL ? "=" : "unset");
+        sha256_string(&ctx, value != NULL ? value : "");
+    }
+    sha256_final(&ctx, key);
+}
+
+// Copies a stored output (from its start) to where the command's stdout should go, returns the bytes copied or -1
+long cache_replay(int fd, FILE *out)
+{
+    fflush(out);
+    int out_fd = fileno(out);
+    off_t offset = 0;
+    long total = 0;
+    for (;;)
+    {
+        ssize_t bytes = sendfile(out_fd, fd, &offset, 1 << 20);
+        if (bytes == -1 && (errno == EINVAL || errno == ENOSYS))
+        {
+            // Not every output takes sendfile, e.g. one opened with O_APPEND on older kernels
+            char buffer[65536];
+            while ((bytes = pread(fd, buffer, sizeof(buffer), offset)) > 0)
+            {
+                if (fwrite(buffer, 1, bytes, out) != (size_t)bytes)
+                {
+                    return -1;
+                }
+                offset += bytes;
+                total += bytes;
+            }
+            fflush(out);
+            return (bytes == 0) ? total : -1;
+        }
+        if (bytes == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            return (bytes == 0) ? total : -1;
+        }
+        total += bytes;
+    }
+}
+
+typedef struct
+{
+    char name[65];
+    long size;
+    int refs; // Entries pointing at it
+} cache_object;
+
+typedef struct
+{
+    char name[65];
+    char object[65];
+    struct timespec used; // mtime of the entry, touched on every hit
+} cache_entry;
+
+int compare_cache_objects(const void *a, const void *b)
+{
+    return strcmp(((const cache_object *)a)->name, ((const cache_object *)b)->name);
+}
+
+int compare_cache_entries(const void *a, const void *b)
+{
+    const struct timespec *x = &((const cache_entry *)a)->used, *y = &((const cache_entry *)b)->used;
+    return (x->tv_sec != y->tv_sec) ? (x->tv_sec > y->tv_sec) - (x->tv_sec < y->tv_sec) : (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+// Reads an entry: `<exit status> <object>`, returns -1 if it is not there or broken
+int cache_read_entry(int entries_fd, const char *name, int *status, char object[65])
+{
+    int fd = openat(entries_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    char text[128];
+    ssize_t bytes = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if (bytes <= 0)
+    {
+        return -1;
+    }
+    text[bytes] = '\0';
+    return (sscanf(text, "%d %64[0-9a-f]", status, object) == 2 && strlen(object) == 64) ? 0 : -1;
+}
+
+// Counts the store, then removes the least recently used entries (and objects nothing points at anymore) until the
+// objects fit into `limit` bytes, returns the number of entries removed
+// - the directory is read again every time, other shells may have added or used entries in the meantime
+long cache_evict(const char *dir, long limit)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/objects", dir);
+    int objects_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    snprintf(path, sizeof(path), "%s/entries", dir);
+    int entries_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *objects_dir = (objects_fd != -1) ? fdopendir(dup(objects_fd)) : NULL;
+    DIR *entries_dir = (entries_fd != -1) ? fdopendir(dup(entries_fd)) : NULL;
+
+    cache_object *objects = NULL;
+    cache_entry *entries = NULL;
+    size_t num_objects = 0, num_entries = 0, capacity = 0;
+    struct dirent *item;
+    struct stat st;
+    long total = 0;
+    while (objects_dir != NULL && (item = readdir(objects_dir)) != NULL)
+    {
+        if (strlen(item->d_name) != 64 || fstatat(objects_fd, item->d_name, &st, 0) == -1)
+        {
+            continue;
+        }
+        if (num_objects == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            objects = realloc(objects, capacity * sizeof(cache_object));
+            if (objects == NULL)
+            {
+                fprintf(stderr, "imcsh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        strcpy(objects[num_objects].name, item->d_name);
+        objects[num_objects].size = st.st_size;
+        objects[num_objects++].refs = 0;
+        total += st.st_size;
+    }
+    qsort(objects, num_objects, sizeof(cache_object), compare_cache_objects);
+
+    capacity = 0;
+    while (entries_dir != NULL && (item = readdir(entries_dir)) != NULL)
+    {
+        int status;
+        cache_entry entry;
+        if (strlen(item->d_name) != 64 || fstatat(entries_fd, item->d_name, &st, 0) == -1 ||
+            cache_read_entry(entries_fd, item->d_name, &status, entry.object) == -1)
+        {
+            continue;
+        }
+        if (num_entries == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            entries = realloc(entries, capacity * sizeof(cache_entry));
+            if (entries == NULL)
+            {
+                fprintf(stderr, "imcsh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        strcpy(entry.name, item->d_name);
+        entry.used = st.st_mtim;
+        entries[num_entries++] = entry;
+        cache_object key;
+        strcpy(key.name, entry.object);
+        cache_object *object = bsearch(&key, objects, num_objects, sizeof(cache_object), compare_cache_objects);
+        if (object != NULL)
+        {
+            object->refs++;
+        }
+    }
+    qsort(entries, num_entries, sizeof(cache_entry), compare_cache_entries);
+
+    // Outputs left behind without an entry go first, then the entries oldest first, an object goes with its last one
+    for (size_t i = 0; i < num_objects && total > limit; i++)
+    {
+        if (objects[i].refs == 0)
+        {
+            unlinkat(objects_fd, objects[i].name, 0);
+            total -= objects[i].size;
+        }
+    }
+    long removed = 0;
+    for (size_t i = 0; i < num_entries && total > limit; i++)
+    {
+        unlinkat(entries_fd, entries[i].name, 0);
+        removed++;
+        cache_object key;
+        strcpy(key.name, entries[i].object);
+        cache_object *object = bsearch(&key, objects, num_objects, sizeof(cache_object), compare_cache_objects);
+        if (object != NULL && --object->refs == 0)
+        {
+            unlinkat(objects_fd, object->name, 0);
+            total -= object->size;
+        }
+    }
+
+    if (objects_dir != NULL)
+    {
+        closedir(objects_dir);
+    }
+    if (entries_dir != NULL)
+    {
+        closedir(entries_dir);
+    }
+    if (objects_fd != -1)
+    {
+        close(objects_fd);
+    }
+    if (entries_fd != -1)
+    {
+        close(entries_fd);
+    }
+    free(objects);
+    free(entries);
+    g_cache.bytes = total;
+    g_cache.evicted += removed;
+    return removed;
+}
+
+// Moves a finished output into the store and writes the entry pointing at it
+// - `temp_path` is the file in `tmp/` the program wrote into, it is renamed (or removed if the object exists already)
+void cache_store(const char *dir, const char *key, int status, int fd, const char *temp_path)
+{
+    sha256_context ctx;
+    sha256_init(&ctx);
+    char object[65];
+    struct stat st;
+    if (lseek(fd, 0, SEEK_SET) == -1 || sha256_fd(&ctx, fd) == -1 || fstat(fd, &st) == -1)
+    {
+        unlink(temp_path);
+        return;
+    }
+    sha256_final(&ctx, object);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/objects/%s", dir, object);
+    int is_new = (access(path, F_OK) == -1);
+    if (rename(temp_path, path) == -1)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: cache: could not store the output: %s\n" ANSI_COLOR_RESET, strerror(errno));
+        unlink(temp_path);
+        return;
+    }
+
+    char entry_temp[PATH_MAX];
+    snprintf(entry_temp, sizeof(entry_temp), "%s/tmp/entry.XXXXXX", dir);
+    int entry_fd = mkostemp(entry_temp, O_CLOEXEC);
+    if (entry_fd == -1)
+    {
+        return;
+    }
+    char text[128];
+    int length = snprintf(text, sizeof(text), "%d %s\n", status, object);
+    int written = (write(entry_fd, text, length) == length);
+    close(entry_fd);
+    snprintf(path, sizeof(path), "%s/entries/%s", dir, key);
+    if (!written || rename(entry_temp, path) == -1)
+    {
+        unlink(entry_temp);
+        return;
+    }
+    g_cache.stored++;
+
+    if (g_cache.bytes == -1)
+    {
+        cache_evict(dir, g_cache_size); // The first store of this shell counts what is already there
+    }
+    else if (is_new)
+    {
+        g_cache.bytes += st.st_size;
+    }
+    if (g_cache.bytes > g_cache_size)
+    {
+        cache_evict(dir, g_cache_size);
+    }
+}
+
+// Looks the key up and replays a hit, returns 1 for a hit, 0 for a miss
+int cache_lookup(const char *dir, const char *key, FILE *out)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/entries", dir);
+    int entries_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int status;
+    char object[65];
+    int found = (entries_fd != -1 && cache_read_entry(entries_fd, key, &status, object) == 0);
+    if (found)
+    {
+        utimensat(entries_fd, key, NULL, 0); // Recently used, the last to be evicted
+    }
+    if (entries_fd != -1)
+    {
+        close(entries_fd);
+    }
+    if (!found)
+    {
+        return 0;
+    }
+
+    // An entry whose object was evicted by another shell in between is just a miss
+    snprintf(path, sizeof(path), "%s/objects/%s", dir, object);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return 0;
+    }
+    long bytes = cache_replay(fd, out);
+    close(fd);
+    if (bytes == -1)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: cache: could not replay the output: %s\n" ANSI_COLOR_RESET, strerror(errno));
+        g_last_status = 1;
+        return 1;
+    }
+    g_cache.replayed += bytes;
+    g_last_status = status;
+    return 1;
+}
+
+// Takes the `>`, `>|` and `>>` of stdout out of a stage's redirections, the cached output is written there instead
+// - returns 1 and the one that wins (the last) in `output`, 0 if stdout is not redirected to a file
+int cache_take_output(redirection_list *list, redirection *output)
+{
+    int found = 0;
+    int kept = 0;
+    for (int r = 0; r < list->count; r++)
+    {
+        const redirection *item = &list->items[r];
+        if (item->fd == STDOUT_FILENO && item->kind != REDIRECT_READ && item->kind != REDIRECT_DUP)
+        {
+            *output = *item;
+            found = 1;
+        }
+        else
+        {
+            list->items[kept++] = *item;
+        }
+    }
+    list->count = kept;
+    return found;
+}
+
+// `cache stats`: what is in the store and how well it did in this shell
+void cache_print_stats(FILE *out)
+{
+    const char *dir = cache_directory();
+    if (dir == NULL)
+    {
+        g_last_status = 1;
+        return;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/entries", dir);
+    long num_entries = 0;
+    DIR *entries = opendir(path);
+    struct dirent *item;
+    while (entries != NULL && (item = readdir(entries)) != NULL)
+    {
+        num_entries += (strlen(item->d_name) == 64);
+    }
+    if (entries != NULL)
+    {
+        closedir(entries);
+    }
+    cache_evict(dir, LONG_MAX); // Only counts the objects with this limit
+
+    unsigned long lookups = g_cache.hits + g_cache.misses;
+    fprintf(out, "%-12s %s\n", "directory", dir);
+    fprintf(out, "%-12s %ld entries, %.1fM of %.1fM\n", "store", num_entries, g_cache.bytes / 1048576.0, g_cache_size / 1048576.0);
+    fprintf(out, "%-12s %lu hits, %lu misses (%.1f%% hit rate)\n", "lookups", g_cache.hits, g_cache.misses,
+            lookups ? 100.0 * g_cache.hits / lookups : 0.0);
+    fprintf(out, "%-12s %lu stored, %lu not cacheable, %lu evicted\n", "results", g_cache.stored, g_cache.not_stored, g_cache.evicted);
+    fprintf(out, "%-12s %.1fM\n", "replayed", g_cache.replayed / 1048576.0);
+}
+
+// Removes every entry and object, `cache clear`
+void cache_clear()
+{
+    const char *dir = cache_directory();
+    if (dir == NULL)
+    {
+        g_last_status = 1;
+        return;
+    }
+    long removed = cache_evict(dir, -1);
+    g_cache.evicted -= removed; // Not evicted for lack of space
+    printf("Removed %ld cached results\n", removed);
+}
+
+// Runs an `exec` command through the cache: `cache [--input=FILE...] [--env=NAME...] [--content] exec ...`,
+// `cache stats` shows the counters and `cache clear` empties the store
+void cache_builtin(char **args, int background, FILE *out, command_line *command)
+{
+    (void)background;
+    (void)out;
+
+    // The output of the cached program (or of `stats`) goes where the stdout redirection of the last stage points
+    redirection_list *last_redirections = &command->stages[command->num_stages - 1].redirections;
+    if (strcmp(args[0], "stats") == 0 || strcmp(args[0], "clear") == 0)
+    {
+        redirection output;
+        int redirected = cache_take_output(last_redirections, &output);
+        if (args[1] != NULL || command->num_stages > 1 || last_redirections->count > 0)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: usage: cache stats|clear [> file]\n" ANSI_COLOR_RESET);
+            g_last_status = 1;
+        }
+        else if (strcmp(args[0], "clear") == 0)
+        {
+            cache_clear();
+        }
+        else if ((out = redirected ? writer_open(&output) : stdout) != NULL)
+        {
+            cache_print_stats(out);
+        }
+        else
+        {
+            g_last_status = 1;
+        }
+        return;
+    }
+
+    char *inputs[MAX_CACHE_INPUTS];
+    char *envs[MAX_CACHE_INPUTS];
+    int num_inputs = 0, num_envs = 0, content = 0;
+    for (; *args != NULL && strncmp(*args, "--", 2) == 0; args++)
+    {
+        char *option = *args + 2;
+        char *value = strchr(option, '=');
+        if (value != NULL)
+        {
+            *value++ = '\0';
+        }
+        if (strcmp(option, "content") == 0 && value == NULL)
+        {
+            content = 1;
+        }
+        else if ((strcmp(option, "input") == 0 || strcmp(option, "env") == 0) && value != NULL && *value != '\0')
+        {
+            int is_input = (option[0] == 'i');
+            int *count = is_input ? &num_inputs : &num_envs;
+            if (*count == MAX_CACHE_INPUTS)
+            {
+                fprintf(stderr, ANSI_COLOR_RED "imcsh: cache: at most %d --%s options\n" ANSI_COLOR_RESET, MAX_CACHE_INPUTS, option);
+                g_last_status = 1;
+                return;
+            }
+            (is_input ? inputs : envs)[(*count)++] = value;
+        }
+        else
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: unknown cache option '--%s'\n" ANSI_COLOR_RESET, option);
+            g_last_status = 1;
+            return;
+        }
+    }
+    if (*args == NULL || strcmp(*args, "exec") != 0)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: usage: cache [--input=FILE...] [--env=NAME...] [--content] exec ...\n" ANSI_COLOR_RESET);
+        g_last_status = 1;
+        return;
+    }
+    args++;
+
+    exec_options options;
+    if (parse_exec_options(&args, &options, NULL) == -1)
+    {
+        g_last_status = 1;
+        return;
+    }
+    if (*args == NULL || options.capture)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: 'cache exec' requires a program to run, in the foreground\n" ANSI_COLOR_RESET);
+        g_last_status = 1;
+        return;
+    }
+    command->stages[0].argv = args;
+
+    // Without a store the command still runs, just every time
+    const char *dir = cache_directory();
+    if (dir == NULL)
+    {
+        int slot = spawn_pipeline(command, 0, &options);
+        if (slot != -1)
+        {
+            g_last_status = wait_for_job(slot);
+        }
+        return;
+    }
+
+    // Where the output goes is not part of the key, `cmd` and `cmd > file` share their result
+    redirection output;
+    out = cache_take_output(last_redirections, &output) ? writer_open(&output) : stdout;
+    if (out == NULL)
+    {
+        g_last_status = 1;
+        return;
+    }
+    char key[65];
+    cache_key(command, inputs, num_inputs, envs, num_envs, content, key);
+    if (cache_lookup(dir, key, out))
+    {
+        g_cache.hits++;
+        return;
+    }
+    g_cache.misses++;
+
+    // A miss runs the program with its stdout in a new file of the store
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s/tmp/output.XXXXXX", dir);
+    int fd = mkostemp(temp_path, O_CLOEXEC);
+    if (fd == -1)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: cache: could not create a file in '%s/tmp': %s\n" ANSI_COLOR_RESET, dir, strerror(errno));
+        g_last_status = 1;
+        return;
+    }
+    options.output_fd = fd;
+    int slot = spawn_pipeline(command, 0, &options);
+    int status = (slot != -1) ? wait_for_job(slot) : g_last_status;
+    if (cache_replay(fd, out) == -1)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: cache: could not replay the output: %s\n" ANSI_COLOR_RESET, strerror(errno));
+    }
+
+    // Only what the program decided is kept, not a kill, a Ctrl+C or a program that could not be started
+    if (slot != -1 && status < 126)
+    {
+        cache_store(dir, key, status, fd, temp_path);
+    }
+    else
+    {
+        g_cache.not_stored++;
+        unlink(temp_path);
+    }
+    close(fd);
+    g_last_status = status;
+}
+
+// ----------------
+// |   Watchers   |
+// ----------------
+// `on-change PATH... -- COMMAND` runs a command whenever one of the paths changed, `watch -n SECS COMMAND` every SECS
+// seconds, instead of a loop around `sleep` that wakes up for nothing and reacts late
+// - both run in a copy of the shell that is a job like any other: listed by `jobs`, stopped with `kill`, or with
+//   Ctrl+C / Ctrl+Z in the foreground, and `&` puts them in the background
+// - the copy sleeps in its event loop, on an inotify instance (`on-change`) and a timerfd, until there is a run to do
+// - a file is watched through its directory, so an editor that writes a new file and renames it over the old one is
+//   noticed as well, and so is a file that doesn't exist yet - a directory is watched for the entries directly in it
+// - changes are collected until none came for `--debounce=` (0.2s by default), so saving ten files runs it once
+// - `watch` gives the timerfd an absolute start and an interval, the kernel keeps the ticks on that grid, so a slow run
+//   doesn't push the later ones back
+// - a change or tick while the command runs queues one more run right after it, with `--restart` the running one is
+//   terminated and started over
+// Docs: https://man7.org/linux/man-pages/man7/inotify.7.html, https://man7.org/linux/man-pages/man2/timerfd_create.2.html
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ATTRIB)
+#define DEFAULT_DEBOUNCE 0.2
+
+typedef struct
+{
+    int wd;           // Of the file's directory, or of the directory itself
+    const char *name; // The file's name in its directory, NULL for a directory
+    const char *path; // As it was given
+} watched_path;
+
+typedef struct
+{
+    int inotify_fd; // -1 for `watch`
+    int timer_fd;
+    watched_path *paths;
+    int num_paths;
+    double debounce;
+    int restart;
+    int running;   // The command is running right now
+    int due;       // A run is waiting
+    int cancelled; // The running command was terminated by `--restart`
+    char changed[PATH_MAX]; // The first path that changed since the last run, for its header
+    int more_changed;       // Others changed as well
+} watcher;
+
+watcher g_watcher = {-1, -1, NULL, 0, DEFAULT_DEBOUNCE, 0, 0, 0, 0, "", 0};
+volatile sig_atomic_t g_watcher_stop = 0; // The signal that stops the watcher, 0 while it runs
+
+// Defined with the input handler, which runs lists in the background the same way
+pid_t subshell_fork(const char *text, int background, int *slot);
+
+// SIGINT and SIGTERM only wake the loop of the watcher, which then stops what it runs and itself
+void watcher_signal_handler(int sig)
+{
+    int saved_errno = errno;
+    g_watcher_stop = sig;
+    g_interrupted = 1;
+    write(g_sigchld_pipe[1], "x", 1);
+    errno = saved_errno;
+}
+
+// A run is due: right away when nothing runs, after the running one with a queue, or terminating it with `--restart`
+void watcher_due()
+{
+    uint64_t expirations;
+    read(g_watcher.timer_fd, &expirations, sizeof(expirations)); // Ticks missed during a slow run are only one run
+    g_watcher.due = 1;
+    if (g_watcher.running && g_watcher.restart && !g_watcher.cancelled)
+    {
+        g_watcher.cancelled = 1;
+        g_interrupted = 1; // The rest of a list doesn't run either
+        for (int slot = g_active_head; slot != -1; slot = g_jobs[slot].next)
+        {
+            job_signal(slot, SIGTERM);
+            job_continue(slot);
+        }
+    }
+}
+
+// Reads the inotify events, a change of a watched path (re)starts the debounce timer
+void watcher_changed()
+{
+    char buffer[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t bytes;
+    int matched = 0;
+    while ((bytes = read(g_watcher.inotify_fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (char *p = buffer; p < buffer + bytes;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+            for (int i = 0; i < g_watcher.num_paths; i++)
+            {
+                const watched_path *w = &g_watcher.paths[i];
+                if (w->wd != event->wd || (w->name != NULL && (event->len == 0 || strcmp(event->name, w->name) != 0)))
+                {
+                    continue;
+                }
+                char changed[PATH_MAX];
+                if (w->name == NULL && event->len > 0)
+                {
+                    snprintf(changed, sizeof(changed), "%s/%s", w->path, event->name);
+                }
+                else
+                {
+                    snprintf(changed, sizeof(changed), "%s", w->path);
+                }
+                if (g_watcher.changed[0] == '\0')
+                {
+                    strcpy(g_watcher.changed, changed);
+                }
+                else if (strcmp(g_watcher.changed, changed) != 0)
+                {
+                    g_watcher.more_changed = 1;
+                }
+                matched = 1;
+            }
+        }
+    }
+    if (!matched)
+    {
+        return;
+    }
+    if (g_watcher.debounce <= 0)
+    {
+        watcher_due();
+        return;
+    }
+    struct itimerspec timer = {0};
+    timer.it_value.tv_sec = (time_t)g_watcher.debounce;
+    timer.it_value.tv_nsec = (long)((g_watcher.debounce - (time_t)g_watcher.debounce) * 1e9);
+    timerfd_settime(g_watcher.timer_fd, 0, &timer, NULL);
+}
+
+// A copy of a parsed command with words of its own, it is run again and again, and e.g. `exec` cuts its options apart
+command_line command_copy(const command_line *command)
+{
+    command_line copy = *command;
+    for (int i = 0; i < command->num_stages; i++)
+    {
+        size_t count = 0;
+        while (command->stages[i].argv[count] != NULL)
+        {
+            count++;
+        }
+        char **argv = arena_alloc(&g_arena, (count + 1) * sizeof(char *));
+        for (size_t w = 0; w < count; w++)
+        {
+            size_t length = strlen(command->stages[i].argv[w]) + 1;
+            argv[w] = memcpy(arena_alloc(&g_arena, length), command->stages[i].argv[w], length);
+        }
+        argv[count] = NULL;
+        copy.stages[i].argv = argv;
+    }
+    copy.background = 0;
+    return copy;
+}
+
+// The loop of the copy of the shell that runs the watcher, it only ends when it gets stopped by a signal
+void watcher_loop(command_line *command, const char *name)
+{
+    struct sigaction sa;
+    sa.sa_handler = &watcher_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    g_interrupted = 0;
+    if ((g_watcher.inotify_fd != -1 && event_watch(g_watcher.inotify_fd, EVENT_WATCH_CHANGE, 0) == -1) ||
+        event_watch(g_watcher.timer_fd, EVENT_WATCH_TIMER, 0) == -1)
+    {
+        perror("imcsh: epoll_ctl");
+        _exit(1);
+    }
+
+    unsigned long runs = 0;
+    arena_mark mark = arena_save(&g_arena);
+    while (!g_watcher_stop)
+    {
+        if (!g_watcher.due)
+        {
+            run_events(-1);
+            continue;
+        }
+        g_watcher.due = 0;
+        runs++;
+        if (g_watcher.inotify_fd == -1)
+        {
+            time_t now = time(NULL);
+            char clock[16];
+            strftime(clock, sizeof(clock), "%H:%M:%S", localtime(&now));
+            printf("[%s] run %lu at %s\n", name, runs, clock);
+        }
+        else if (g_watcher.changed[0] != '\0')
+        {
+            printf("[%s] run %lu, %s%s changed\n", name, runs, g_watcher.changed, g_watcher.more_changed ? " and more" : "");
+        }
+        else
+        {
+            printf("[%s] run %lu\n", name, runs);
+        }
+        g_watcher.changed[0] = '\0';
+        g_watcher.more_changed = 0;
+
+        command_line copy = command_copy(command);
+        g_watcher.running = 1;
+        run_function(&copy);
+        g_watcher.running = 0;
+        writers_flush();
+        fflush(stdout);
+        arena_restore(&g_arena, mark);
+        if (g_watcher.cancelled)
+        {
+            g_watcher.cancelled = 0;
+            g_interrupted = (g_watcher_stop != 0);
+        }
+    }
+
+    // What still runs goes with it, then the watcher ends the way the signal would have ended it
+    for (int slot = g_active_head; slot != -1; slot = g_jobs[slot].next)
+    {
+        job_signal(slot, SIGTERM);
+        job_continue(slot);
+    }
+    writers_close_all();
+    fflush(stdout);
+    signal(g_watcher_stop, SIG_DFL);
+    raise(g_watcher_stop);
+    _exit(128 + g_watcher_stop);
+}
+
+// Forks the copy of the shell that runs the watcher, with its inotify instance and timer already set up in `g_watcher`
+// - `args` is the command to run, the watcher's own words come before it
+void watcher_start(const char *name, char **args, int background, command_line *command)
+{
+    // The text for `jobs`, the whole command line joined back together
+    size_t length = strlen(name) + 1;
+    for (char **word = command->stages[0].argv + 1; *word != NULL; word++)
+    {
+        length += strlen(*word) + 1;
+    }
+    for (int i = 1; i < command->num_stages; i++)
+    {
+        for (char **word = command->stages[i].argv; *word != NULL; word++)
+        {
+            length += strlen(*word) + 3;
+        }
+    }
+    char *text = arena_alloc(&g_arena, length);
+    char *end = text + sprintf(text, "%s", name);
+    for (int i = 0; i < command->num_stages; i++)
+    {
+        for (char **word = command->stages[i].argv + (i == 0); *word != NULL; word++)
+        {
+            end += sprintf(end, "%s%s", (i > 0 && word == command->stages[i].argv) ? " | " : " ", *word);
+        }
+    }
+
+    command->stages[0].argv = args;
+    int slot;
+    pid_t pid = subshell_fork(text, background, &slot);
+    if (pid == 0)
+    {
+        watcher_loop(command, name);
+    }
+
+    // The shell itself has no use for them, and the next watcher gets new ones
+    if (g_watcher.inotify_fd != -1)
+    {
+        close(g_watcher.inotify_fd);
+    }
+    close(g_watcher.timer_fd);
+    g_watcher = (watcher){-1, -1, NULL, 0, DEFAULT_DEBOUNCE, 0, 0, 0, 0, "", 0};
+    if (pid == -1)
+    {
+        return;
+    }
+    if (background)
+    {
+        printf("Started process with PID %d\n", pid);
+        g_last_status = 0;
+    }
+    else
+    {
+        g_last_status = wait_for_job(slot);
+    }
+}
+
+// Reruns a command when files change: `on-change [--debounce=DUR] [--restart] [--initial] PATH... -- COMMAND`
+// - e.g. `on-change src Makefile -- exec make -j8 &`, `--initial` also runs it once right away
+void on_change_builtin(char **args, int background, FILE *out, command_line *command)
+{
+    (void)out; // The redirections belong to the command
+
+    double debounce = DEFAULT_DEBOUNCE;
+    int restart = 0;
+    int initial = 0;
+    for (; *args != NULL && strncmp(*args, "--", 2) == 0 && (*args)[2] != '\0'; args++)
+    {
+        if (strncmp(*args, "--debounce=", 11) == 0 && (debounce = parse_duration(*args + 11)) >= 0)
+        {
+            continue;
+        }
+        if (strcmp(*args, "--restart") == 0 || strcmp(*args, "--initial") == 0)
+        {
+            *((*args)[2] == 'r' ? &restart : &initial) = 1;
+            continue;
+        }
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: invalid on-change option '%s'\n" ANSI_COLOR_RESET, *args);
+        g_last_status = 1;
+        return;
+    }
+    char **paths = args;
+    while (*args != NULL && strcmp(*args, "--") != 0)
+    {
+        args++;
+    }
+    int num_paths = args - paths;
+    if (num_paths == 0 || *args == NULL || args[1] == NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: usage: on-change [--debounce=DUR] [--restart] [--initial] PATH... -- COMMAND\n" ANSI_COLOR_RESET);
+        g_last_status = 1;
+        return;
+    }
+    args++;
+
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (inotify_fd == -1 || timer_fd == -1)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: on-change: %s\n" ANSI_COLOR_RESET, strerror(errno));
+        if (inotify_fd != -1)
+        {
+            close(inotify_fd);
+        }
+        if (timer_fd != -1)
+        {
+            close(timer_fd);
+        }
+        g_last_status = 1;
+        return;
+    }
+    watched_path *watched = arena_alloc(&g_arena, num_paths * sizeof(watched_path));
+    for (int i = 0; i < num_paths; i++)
+    {
+        // A directory is watched itself, anything else (even a file that is not there yet) through its directory
+        struct stat st;
+        watched[i].path = paths[i];
+        watched[i].name = NULL;
+        const char *dir = paths[i];
+        if (stat(paths[i], &st) == -1 || !S_ISDIR(st.st_mode))
+        {
+            char *copy = arena_alloc(&g_arena, strlen(paths[i]) + 1);
+            strcpy(copy, paths[i]);
+            char *slash = strrchr(copy, '/');
+            watched[i].name = (slash != NULL) ? slash + 1 : copy;
+            dir = (slash == NULL) ? "." : (slash == copy) ? "/" : copy;
+            if (slash != NULL && slash != copy)
+            {
+                *slash = '\0';
+            }
+        }
+        watched[i].wd = inotify_add_watch(inotify_fd, dir, WATCH_EVENTS | IN_ONLYDIR);
+        if (watched[i].wd == -1 || (watched[i].name != NULL && *watched[i].name == '\0'))
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: on-change: cannot watch '%s': %s\n" ANSI_COLOR_RESET, paths[i],
+                    watched[i].wd == -1 ? strerror(errno) : "not a file or directory");
+            close(inotify_fd);
+            close(timer_fd);
+            g_last_status = 1;
+            return;
+        }
+    }
+
+    g_watcher.inotify_fd = inotify_fd;
+    g_watcher.timer_fd = timer_fd;
+    g_watcher.paths = watched;
+    g_watcher.num_paths = num_paths;
+    g_watcher.debounce = debounce;
+    g_watcher.restart = restart;
+    g_watcher.due = initial;
+    watcher_start("on-change", args, background, command);
+}
+
+// Runs a command every few seconds: `watch [-n SECS] [--restart] COMMAND`, e.g. `watch -n 5 exec df -h &`
+// - the first run is right away, the next ones on a fixed grid from there (2 seconds by default)
+void watch_builtin(char **args, int background, FILE *out, command_line *command)
+{
+    (void)out; // The redirections belong to the command
+
+    double interval = 2;
+    int restart = 0;
+    for (; *args != NULL && (*args)[0] == '-'; args++)
+    {
+        if (strcmp(*args, "-n") == 0 && args[1] != NULL && (interval = parse_duration(args[1])) > 0)
+        {
+            args++;
+        }
+        else if (strcmp(*args, "--restart") == 0)
+        {
+            restart = 1;
+        }
+        else
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: invalid watch option '%s'\n" ANSI_COLOR_RESET, *args);
+            g_last_status = 1;
+            return;
+        }
+    }
+    if (*args == NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: usage: watch [-n SECS] [--restart] COMMAND\n" ANSI_COLOR_RESET);
+        g_last_status = 1;
+        return;
+    }
+
+    // The first expiration is now, every later one a multiple of the interval after it, no matter when a run ended
+    struct itimerspec timer;
+    clock_gettime(CLOCK_MONOTONIC, &timer.it_value);
+    timer.it_interval.tv_sec = (time_t)interval;
+    timer.it_interval.tv_nsec = (long)((interval - (time_t)interval) * 1e9);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1 || timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) == -1)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: watch: %s\n" ANSI_COLOR_RESET, strerror(errno));
+        if (timer_fd != -1)
+        {
+            close(timer_fd);
+        }
+        g_last_status = 1;
+        return;
+    }
+
+    g_watcher.timer_fd = timer_fd;
+    g_watcher.restart = restart;
+    watcher_start("watch", args, background, command);
+}
+
+// Changes a shell-wide setting, given in the form of `name=value`
+void set_option(char **args, int background, FILE *out, command_line *command)
+{
+    (void)command;
+    (void)background;
+    (void)out;
+
+    if (args[0] == NULL)
+    {
+        printf("pipesize=%ld\n", g_pipe_size);
+        printf("notify=%s\n", g_notify ? "on" : "off");
+        printf("capture=%s\n", g_capture ? "on" : "off");
+        printf("capturesize=%ld\n", g_capture_size);
+        printf("noclobber=%s\n", g_noclobber ? "on" : "off");
+        printf("spawn=%s\n", g_spawn_backend_names[g_spawn_backend]);
+        printf("historysize=%ld\n", g_history_size);
+        print_placement(stdout, &g_placement);
+        printf("metricsfile=%s\n", g_metrics_file ? g_metrics_file : "off");
+        printf("metricsinterval=%g\n", g_metrics_interval);
+        printf("cachedir=%s\n", g_cache_dir ? g_cache_dir : "default");
+        printf("cachesize=%ld\n", g_cache_size);
+        return;
+    }
+
+    char *name = args[0];
+    char *value = strchr(name, '=');
+    if (value == NULL || args[1] != NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: expected 'set name=value'\n" ANSI_COLOR_RESET);
+        g_last_status = 1;
+        return;
+    }
+    *value++ = '\0';
+
+    int placed;
+    if (strcmp(name, "pipesize") == 0)
+    {
+        long size = parse_size(value);
+        if (size < 0 || size > INT_MAX)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: invalid pipe size '%s'\n" ANSI_COLOR_RESET, value);
+            g_last_status = 1;
+            return;
+        }
+        g_pipe_size = size;
+    }
+    else if (strcmp(name, "notify") == 0 && (strcmp(value, "on") == 0 || strcmp(value, "off") == 0))
+    {
+        g_notify = (strcmp(value, "on") == 0);
+    }
+    else if (strcmp(name, "capture") == 0 && (strcmp(value, "on") == 0 || strcmp(value, "off") == 0))
+    {
+        g_capture = (strcmp(value, "on") == 0);
+    }
+    else if (strcmp(name, "noclobber") == 0 && (strcmp(value, "on") == 0 || strcmp(value, "off") == 0))
+    {
+        g_noclobber = (strcmp(value, "on") == 0);
+    }
+    else if (strcmp(name, "spawn") == 0)
+    {
+        if (set_spawn_backend(value) == -1)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: unknown spawn backend '%s' (posix_spawn, vfork or clone3)\n" ANSI_COLOR_RESET, value);
+            g_last_status = 1;
+        }
+    }
+    else if (strcmp(name, "historysize") == 0)
+    {
+        char *end;
+        long size = strtol(value, &end, 10);
+        if (*value == '\0' || *end != '\0' || size < 1)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: invalid history size '%s'\n" ANSI_COLOR_RESET, value);
+            g_last_status = 1;
+            return;
+        }
+        g_history_size = size; // The file is cut down to it once it grows a quarter past it
+    }
+    else if (strcmp(name, "capturesize") == 0)
+    {
+        long size = parse_size(value);
+        if (size < 1)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: invalid capture size '%s'\n" ANSI_COLOR_RESET, value);
+            g_last_status = 1;
+            return;
+        }
+        g_capture_size = size; // Applies to jobs started from now on
+    }
+    else if (strcmp(name, "metricsfile") == 0)
+    {
+        // Written right away, so a path that doesn't work is reported here and not only by the timer
+        free(g_metrics_file);
+        g_metrics_file = NULL;
+        if (strcmp(value, "off") != 0)
+        {
+            g_metrics_file = strdup(value);
+            if (g_metrics_file == NULL)
+            {
+                fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+                exit(EXIT_FAILURE);
+            }
+            metrics_export();
+            if (g_metrics_file == NULL)
+            {
+                g_last_status = 1;
+            }
+        }
+        metrics_arm();
+    }
+    else if (strcmp(name, "metricsinterval") == 0)
+    {
+        double interval = parse_duration(value);
+        if (interval < 0.1)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: invalid metrics interval '%s' (at least 0.1s)\n" ANSI_COLOR_RESET, value);
+            g_last_status = 1;
+            return;
+        }
+        g_metrics_interval = interval;
+        metrics_arm();
+    }
+    else if (strcmp(name, "cachedir") == 0)
+    {
+        free(g_cache_dir);
+        g_cache_dir = NULL;
+        if (strcmp(value, "default") != 0)
+        {
+            g_cache_dir = strdup(value);
+            if (g_cache_dir == NULL)
+            {
+                fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+                exit(EXIT_FAILURE);
+            }
+        }
+        g_cache.bytes = -1; // Another store, counted again on its first use
+    }
+    else if (strcmp(name, "cachesize") == 0)
+    {
+        long size = parse_size(value);
+        if (size < 0)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: invalid cache size '%s'\n" ANSI_COLOR_RESET, value);
+            g_last_status = 1;
+            return;
+        }
+        g_cache_size = size;
+        g_cache.bytes = -1; // Evicted down to it with the next store
+    }
+    else if ((placed = parse_placement_option(name, value, &g_placement)) != 0)
+    {
+        // The defaults of every job started from now on, also the lines of `parallel`
+        if (placed == -1)
+        {
+            g_last_status = 1;
+        }
+    }
+    else
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: unknown setting '%s'\n" ANSI_COLOR_RESET, name);
+        g_last_status = 1;
+    }
+}
+
+// Shows or changes the shell-wide resource limits of the jobs started from now on: `limit [name=value...]`
+// - e.g. `limit mem=2G cputime=10m files=1024 procs=500 filesize=1G`, `off` removes one
+// - a single command gets its own with the same names as `exec` options, `exec --mem=512M ...`
+void limit_builtin(char **args, int background, FILE *out, command_line *command)
+{
+    (void)command;
+    (void)background;
+
+    if (args[0] == NULL)
+    {
+        for (int i = 0; i < NUM_LIMITS; i++)
+        {
+            char value[32];
+            format_limit(value, sizeof(value), i, g_limits.values[i]);
+            fprintf(out, "%-8s %-10s %s\n", g_limit_kinds[i].name, value, g_limit_kinds[i].what);
+        }
+        g_last_status = 0;
+        return;
+    }
+
+    // All or nothing, so a typo doesn't leave half of the limits changed
+    job_limits limits = g_limits;
+    for (; *args != NULL; args++)
+    {
+        char *value = strchr(*args, '=');
+        if (value != NULL)
+        {
+            *value++ = '\0';
+        }
+        int taken = parse_limit_option(*args, value, &limits);
+        if (taken == 0)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: limit: expected name=value, with one of mem, cputime, files, procs or filesize\n" ANSI_COLOR_RESET);
+        }
+        if (taken != 1)
+        {
+            g_last_status = 1;
+            return;
+        }
+    }
+    g_limits = limits;
+    g_last_status = 0;
+}
+
+// Sets variables for the programs started from now on: `export NAME=value...`
+// - `export NAME` alone is accepted for scripts written for other shells, every variable is exported here anyway
+void export_builtin(char **args, int background, FILE *out, command_line *command)
+{
+    (void)command;
+    (void)background;
+    (void)out;
+
+    for (; *args != NULL; args++)
+    {
+        char *equals = strchr(*args, '=');
+        size_t name_length = (equals != NULL) ? (size_t)(equals - *args) : strlen(*args);
+        if (!env_valid_name(*args, name_length))
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: export: '%s' is not a valid variable name\n" ANSI_COLOR_RESET, *args);
+            g_last_status = 1;
+            continue;
+        }
+        if (equals != NULL)
+        {
+            *equals = '\0';
+            env_set(*args, equals + 1);
+        }
+    }
+}
+
+void unset_builtin(char **args, int background, FILE *out, command_line *command)
+{
+    (void)command;
+    (void)background;
+    (void)out;
+
+    for (; *args != NULL; args++)
+    {
+        env_unset(*args);
+    }
+}
+
+// Lists the variables programs get, sorted by name
+void env_builtin(char **args, int background, FILE *out, command_line *command)
+{
+    (void)command;
+    (void)args;
+    (void)background;
+
+    char **envp = env_array();
+    char **sorted = arena_alloc(&g_arena, (g_env_count + 1) * sizeof(char *));
+    memcpy(sorted, envp, g_env_count * sizeof(char *));
+    qsort(sorted, g_env_count, sizeof(char *), compare_strings);
+    for (size_t i = 0; i < g_env_count; i++)
+    {
+        fprintf(out, "%s\n", sorted[i]);
+    }
+}
+
+// Lists the remembered program locations, or with arguments: `-r` forgets all of them, names are looked up and remembered
+void hash_builtin(char **args, int background, FILE *out, command_line *command)
+{
+    (void)command;
+    (void)background;
+
+    if (args[0] == NULL)
+    {
+        path_cache_refresh();
+
+        if (g_path_cache_count == 0)
+        {
+            fprintf(out, "hash: hash table empty\n");
+        }
+        else
+        {
+            fprintf(out, "hits    command\n");
+            for (size_t i = 0; i < g_path_cache_capacity; i++)
+            {
+                if (g_path_cache[i].name != NULL)
+                {
+                    fprintf(out, "%6lu    %s\n", g_path_cache[i].hits, g_path_cache[i].path);
+                }
+            }
+        }
+        return;
+    }
+
+    for (; *args != NULL; args++)
+    {
+        const char *name = *args;
+        if (strcmp(name, "-r") == 0)
+        {
+            path_cache_clear();
+        }
+        else if (strchr(name, '/') == NULL)
+        {
+            path_cache_remove(name); // Priming looks the name up again, even if it was cached already
+            const char *path = resolve_command(name);
+            if (path == NULL)
+            {
+                fprintf(stderr, ANSI_COLOR_RED "imcsh: hash: %s: not found\n" ANSI_COLOR_RESET, name);
+                g_last_status = 1;
+            }
+            else
+            {
+                path_cache_slot(g_path_cache, g_path_cache_capacity, name)->hits = 0;
+            }
+        }
+    }
+}
+
+// Lists the newest commands, or the newest ones starting with (with `-s`: containing) the given text
+// - `history [-n COUNT] [-s] [TEXT...]`, every command is only listed once
+void history_builtin(char **args, int background, FILE *out, command_line *command)
+{
+    (void)command;
+    (void)background;
+
+    long limit = HISTORY_LIST_DEFAULT;
+    int substring = 0;
+    for (; *args != NULL; args++)
+    {
+        const char *arg = *args;
+        if (strcmp(arg, "-n") == 0)
+        {
+            const char *value = *++args;
+            char *end;
+            limit = (value != NULL) ? strtol(value, &end, 10) : 0;
+            if (value == NULL || *end != '\0' || limit < 1)
+            {
+                fprintf(stderr, ANSI_COLOR_RED "imcsh: history: -n expects a positive number\n" ANSI_COLOR_RESET);
+                g_last_status = 1;
+                return;
+            }
+        }
+        else if (strcmp(arg, "-s") == 0)
+        {
+            substring = 1;
+        }
+        else
+        {
+            break; // The rest is the text to search for
+        }
+    }
+
+    // The words of the text are joined by a single space, so `history exec make` needs no quotes
+    const char *needle = "";
+    if (*args != NULL)
+    {
+        size_t needle_size = 0;
+        for (char **word = args; *word != NULL; word++)
+        {
+            needle_size += strlen(*word) + 1;
+        }
+        char *joined = arena_alloc(&g_arena, needle_size);
+        char *end = joined;
+        for (char **word = args; *word != NULL; word++)
+        {
+            end = stpcpy(end, *word);
+            *end++ = ' ';
+        }
+        end[-1] = '\0';
+        needle = joined;
+    }
+
+    history_open();
+    history_poll(0);
+    history_index();
+    if ((size_t)limit > g_history.count)
+    {
+        limit = g_history.count;
+    }
+
+    // Search from the newest command back, a plain scan over the lines is fast enough even for a million of them
+    size_t needle_length = strlen(needle);
+    size_t *found = arena_alloc(&g_arena, (limit + 1) * sizeof(size_t));
+    size_t capacity = line_set_capacity(limit);
+    line_set seen = {arena_alloc(&g_arena, capacity * sizeof(history_line)), capacity - 1};
+    memset(seen.slots, 0, capacity * sizeof(history_line));
+    long num_found = 0;
+    for (size_t i = g_history.count; i-- > 0 && num_found < limit;)
+    {
+        const history_line *line = &g_history.lines[i];
+        int matches;
+        if (substring)
+        {
+            matches = memmem(line->text, line->length, needle, needle_length) != NULL;
+        }
+        else
+        {
+            matches = line->length >= needle_length && memcmp(line->text, needle, needle_length) == 0;
+        }
+        if (matches && line_set_add(&seen, line->text, line->length))
+        {
+            found[num_found++] = i;
+        }
+    }
+
+    // Oldest first, like a regular shell lists them
+    while (num_found-- > 0)
+    {
+        const history_line *line = &g_history.lines[found[num_found]];
+        fprintf(out, "%7zu  %.*s\n", found[num_found] + 1, (int)line->length, line->text);
+    }
+}
+
+// Create a lookup table of the possible functions
+// (It could have been made a hash map for efficiency, but looping should be fine for this few options)
+#define ARGS_OPTIONAL 2
+#define OUTPUT_OWN 2 // The function applies the redirections itself, they are left in its arguments
+typedef void (*function_ptr)(char **args, int background, FILE *out, command_line *command);
+void stats_builtin(char **args, int background, FILE *out, command_line *command); // Defined below, it lists the table
+void trace_builtin(char **args, int background, FILE *out, command_line *command);
+typedef struct
+{
+    const char *name;
+    function_ptr func;
+    int expects_args;        // 1 if the function expects arguments, 0 otherwise, ARGS_OPTIONAL if it works either way
+    int supports_background; // 1 if the function supports background execution, 0 otherwise
+    int supports_output;     // 1 if the function supports output redirection, 0 otherwise, OUTPUT_OWN if it handles them itself
+} function_entry;
+
+function_entry function_table[] = {
+    {"globalusage", globalusage, 0, 0, 1},
+    {"help", help, 0, 0, 1},
+    {"echo", echo, 1, 0, 1},
+    {"quit", quit_shell, 0, 0, 0},
+    {"exec", execute_program, 1, 1, OUTPUT_OWN},
+    {"set", set_option, ARGS_OPTIONAL, 0, 0},
+    {"limit", limit_builtin, ARGS_OPTIONAL, 0, 1},
+    {"hash", hash_builtin, ARGS_OPTIONAL, 0, 1},
+    {"history", history_builtin, ARGS_OPTIONAL, 0, 1},
+    {"export", export_builtin, 1, 0, 0},
+    {"unset", unset_builtin, 1, 0, 0},
+    {"env", env_builtin, 0, 0, 1},
+    {"parallel", parallel_builtin, ARGS_OPTIONAL, 0, 0},
+    {"jobs", jobs_builtin, 0, 0, 1},
+    {"fg", fg_builtin, ARGS_OPTIONAL, 0, 0},
+    {"bg", bg_builtin, ARGS_OPTIONAL, 0, 1},
+    {"kill", kill_builtin, 1, 0, 1},
+    {"wait", wait_builtin, ARGS_OPTIONAL, 0, 0},
+    {"time", time_builtin, 1, 0, OUTPUT_OWN},
+    {"cache", cache_builtin, 1, 0, OUTPUT_OWN},
+    {"on-change", on_change_builtin, 1, 1, OUTPUT_OWN},
+    {"watch", watch_builtin, 1, 1, OUTPUT_OWN},
+    {"output", output_builtin, 1, 0, 1},
+    {"tail", tail_builtin, 1, 0, 1},
+    {"stats", stats_builtin, ARGS_OPTIONAL, 0, 1},
+    {"trace", trace_builtin, ARGS_OPTIONAL, 0, 1},
+    {NULL, NULL, 0, 0, 0} // Sentinel value to mark the end of the table
+};
+
+// How many times each function was run, for `stats`
+unsigned long g_function_calls[sizeof(function_table) / sizeof(function_table[0])];
+
+// Looks up the function in `function_table`, validates the modifiers against what it supports, then calls it
+// - the function is the first word of the first stage, the rest of the words are its arguments
+void run_function(command_line *command)
+{
+    g_last_status = 1; // Every check below that bails out counts as a failed command
+    const char *function = command->stages[0].argv[0];
+    char **args = command->stages[0].argv + 1;
+
+    // Iterate through the function table to find a match
+    for (int i = 0; function_table[i].name != NULL; i++)
+    {
+        if (strcmp(function, function_table[i].name) == 0)
+        {
+            g_function_calls[i]++;
+            // CHECK: Only `exec` takes care of pipelines and of redirections other than the output of a builtin
+            const redirection *output = NULL;
+            if (function_table[i].supports_output != OUTPUT_OWN)
+            {
+                if (command->num_stages > 1)
+                {
+                    fprintf(stderr, ANSI_COLOR_RED "imcsh: '%s' can't be used in a pipeline, only programs run by 'exec' can\n" ANSI_COLOR_RESET, function_table[i].name);
+                    return;
+                }
+
+                // Only stdout can be redirected for builtins, errors always go to the shell's stderr, the last one wins like in other shells
+                const redirection_list *redirections = &command->stages[0].redirections;
+                for (int r = 0; r < redirections->count; r++)
+                {
+                    if (!function_table[i].supports_output)
+                    {
+                        fprintf(stderr, ANSI_COLOR_RED "imcsh: '%s' does not support output redirection\n" ANSI_COLOR_RESET, function_table[i].name);
+                        return;
+                    }
+                    if (redirections->items[r].fd != STDOUT_FILENO || redirections->items[r].kind == REDIRECT_READ ||
+                        redirections->items[r].kind == REDIRECT_DUP)
+                    {
+                        fprintf(stderr, ANSI_COLOR_RED "imcsh: '%s' only supports redirecting its output with '>', '>>' or '>|'\n" ANSI_COLOR_RESET, function_table[i].name);
+                        return;
+                    }
+                    output = &redirections->items[r];
+                }
+            }
+
+            // CHECK: There are arguments given to functions that require it
+            if (function_table[i].expects_args == 1)
+            {
+                if (args[0] == NULL)
+                {
+                    fprintf(stderr, ANSI_COLOR_RED "imcsh: '%s' requires arguments to run\n" ANSI_COLOR_RESET, function_table[i].name);
+                    return;
+                }
+            }
+            else if (function_table[i].expects_args == 0)
+            {
+                if (args[0] != NULL)
+                {
+                    fprintf(stderr, ANSI_COLOR_RED "imcsh: '%s' does not accept any arguments\n" ANSI_COLOR_RESET, function_table[i].name);
+                    return;
+                }
+            }
+
+            // CHECK: That function can be run in the background if needed
+            if (!function_table[i].supports_background && command->background)
+            {
+                fprintf(stderr, ANSI_COLOR_RED "imcsh: '%s' does not support background execution\n" ANSI_COLOR_RESET, function_table[i].name);
+                return;
+            }
+
+            // Call the function with the arguments and background flag, writing to the redirected file if there is one
+            FILE *out = stdout;
+            if (output != NULL && (out = writer_open(output)) == NULL)
+            {
+                return;
+            }
+            g_last_status = 0; // Functions only overwrite this when they fail or run a program
+            function_table[i].func(args, command->background, out, command);
+
+            if (output != NULL && g_last_status == 0)
+            {
+                printf("Output redirected to -> %s\n", output->target);
+            }
+            return;
+        }
+    }
+
+    // If not found in `function_table` print error
+    fprintf(stderr, ANSI_COLOR_RED "imcsh: invalid function '%s'\n" ANSI_COLOR_RESET, function);
+    g_metrics.unknown_commands++;
+    g_last_status = 127; // Same status a regular shell uses for an unknown command
+}
+
+// ----------------------
+// |   Metrics export   |
+// ----------------------
+// e.g. `312.4us`, `1.52ms`, `2.104s`
+void format_latency(char *buffer, size_t size, double seconds)
+{
+    if (seconds < 0.001)
+    {
+        snprintf(buffer, size, "%.1fus", seconds * 1e6);
+    }
+    else if (seconds < 1)
+    {
+        snprintf(buffer, size, "%.2fms", seconds * 1e3);
+    }
+    else
+    {
+        snprintf(buffer, size, "%.3fs", seconds);
+    }
+}
+
+void print_histogram(FILE *out, const char *name, const histogram *h)
+{
+    double values[4] = {h->count ? h->sum / h->count : 0, histogram_quantile(h, 0.5), histogram_quantile(h, 0.99), h->max};
+    fprintf(out, "%-20s %10lu", name, h->count);
+    for (int i = 0; i < 4; i++)
+    {
+        char text[32];
+        format_latency(text, sizeof(text), values[i]);
+        fprintf(out, " %10s", text);
+    }
+    fprintf(out, "\n");
+}
+
+// The counters and a summary of every histogram, the quantiles are estimated from the buckets
+void print_stats(FILE *out)
+{
+    fprintf(out, "%-20s %lu, %lu with a syntax error, %lu unknown\n", "commands",
+            g_metrics.commands, g_metrics.syntax_errors, g_metrics.unknown_commands);
+    for (int i = 0; function_table[i].name != NULL; i++)
+    {
+        if (g_function_calls[i] > 0)
+        {
+            fprintf(out, "  %-18s %lu\n", function_table[i].name, g_function_calls[i]);
+        }
+    }
+    fprintf(out, "%-20s %lu spawned, %lu failed to spawn, %lu reaped\n", "processes",
+            g_metrics.spawns, g_metrics.spawn_failures, g_metrics.reaped);
+    fprintf(out, "%-20s %d running, %d in the background, %d at most\n", "jobs",
+            g_num_active_jobs, g_num_background_jobs, g_metrics.peak_jobs);
+    fprintf(out, "\n%-20s %10s %10s %10s %10s %10s\n", "", "count", "mean", "p50", "p99", "max");
+    print_histogram(out, "command time", &g_metrics.command_time);
+    print_histogram(out, "spawn time", &g_metrics.spawn_time);
+    print_histogram(out, "foreground wait", &g_metrics.foreground_wait);
+    print_histogram(out, "background lifetime", &g_metrics.background_lifetime);
+}
+
+void print_prometheus_counter(FILE *out, const char *name, const char *help, unsigned long value)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", name, help, name, name, value);
+}
+
+void print_prometheus_gauge(FILE *out, const char *name, const char *help, long value)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %ld\n", name, help, name, name, value);
+}
+
+// A histogram has cumulative buckets in the text format, every one counts the observations up to its bound
+void print_prometheus_histogram(FILE *out, const char *name, const char *help, const histogram *h)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    unsigned long cumulative = 0;
+    for (int i = 0; i < NUM_LATENCY_BUCKETS; i++)
+    {
+        cumulative += h->buckets[i];
+        fprintf(out, "%s_bucket{le=\"%g\"} %lu\n", name, g_latency_bounds[i], cumulative);
+    }
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.9g\n%s_count %lu\n", name, h->count, name, h->sum, name, h->count);
+}
+
+void print_prometheus(FILE *out)
+{
+    fprintf(out, "# HELP imcsh_commands_total Commands run, by function.\n# TYPE imcsh_commands_total counter\n");
+    for (int i = 0; function_table[i].name != NULL; i++)
+    {
+        fprintf(out, "imcsh_commands_total{function=\"%s\"} %lu\n", function_table[i].name, g_function_calls[i]);
+    }
+    print_prometheus_counter(out, "imcsh_syntax_errors_total", "Command lines that could not be parsed.", g_metrics.syntax_errors);
+    print_prometheus_counter(out, "imcsh_unknown_commands_total", "Commands naming no function.", g_metrics.unknown_commands);
+    print_prometheus_counter(out, "imcsh_spawns_total", "Processes started.", g_metrics.spawns);
+    print_prometheus_counter(out, "imcsh_spawn_failures_total", "Processes that could not be started.", g_metrics.spawn_failures);
+    print_prometheus_counter(out, "imcsh_reaped_total", "Processes reaped.", g_metrics.reaped);
+    print_prometheus_counter(out, "imcsh_cache_hits_total", "Commands replayed from the exec cache.", g_cache.hits);
+    print_prometheus_counter(out, "imcsh_cache_misses_total", "Commands run because the exec cache had no result.", g_cache.misses);
+    print_prometheus_gauge(out, "imcsh_jobs", "Jobs running or stopped.", g_num_active_jobs);
+    print_prometheus_gauge(out, "imcsh_background_jobs", "Jobs in the background.", g_num_background_jobs);
+    print_prometheus_gauge(out, "imcsh_jobs_peak", "Most jobs running or stopped at the same time.", g_metrics.peak_jobs);
+    print_prometheus_histogram(out, "imcsh_command_duration_seconds", "Time to run a command line.", &g_metrics.command_time);
+    print_prometheus_histogram(out, "imcsh_spawn_duration_seconds", "Time to start a process.", &g_metrics.spawn_time);
+    print_prometheus_histogram(out, "imcsh_foreground_wait_seconds", "Time spent waiting for foreground jobs.", &g_metrics.foreground_wait);
+    print_prometheus_histogram(out, "imcsh_background_job_duration_seconds", "Lifetime of background jobs.", &g_metrics.background_lifetime);
+}
+
+// Writes the metrics file, into a temporary file first and renamed over it, so a scrape never sees half of it
+// - a file that can't be written turns the export off, instead of failing every few seconds
+void metrics_export()
+{
+    if (g_metrics_fd != -1)
+    {
+        uint64_t expirations;
+        read(g_metrics_fd, &expirations, sizeof(expirations));
+    }
+    if (g_metrics_file == NULL)
+    {
+        return;
+    }
+
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", g_metrics_file);
+    FILE *file = fopen(temp_path, "we");
+    int failed = (file == NULL);
+    if (file != NULL)
+    {
+        print_prometheus(file);
+        failed |= (fclose(file) != 0);
+        failed = failed || rename(temp_path, g_metrics_file) == -1;
+    }
+    if (failed)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: could not write the metrics to %s: %s, turning the export off\n" ANSI_COLOR_RESET,
+                g_metrics_file, strerror(errno));
+        unlink(temp_path);
+        free(g_metrics_file);
+        g_metrics_file = NULL;
+        metrics_arm();
+    }
+}
+
+// Shows what the shell did so far: `stats [--prometheus]`, the latter prints what the metrics file would contain
+void stats_builtin(char **args, int background, FILE *out, command_line *command)
+{
+    (void)command;
+    (void)background;
+
+    if (args[0] == NULL)
+    {
+        print_stats(out);
+    }
+    else if (strcmp(args[0], "--prometheus") == 0 && args[1] == NULL)
+    {
+        print_prometheus(out);
+    }
+    else
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: usage: stats [--prometheus]\n" ANSI_COLOR_RESET);
+        g_last_status = 1;
+    }
+}
+
+// -------------------
+// |   Trace export   |
+// -------------------
+// Writes a string for JSON, with the quotes, backslashes and control characters escaped
+void print_json_string(FILE *out, const char *text)
+{
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char *)text; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            fprintf(out, "\\%c", *c);
+        }
+        else if (*c < 0x20)
+        {
+            fprintf(out, "\\u%04x", *c);
+        }
+        else
+        {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// Writes the recorded events as a Chrome trace: complete ("X") events in microseconds since `trace on`
+// - the shell and every job are threads of one process, named by metadata ("M") events, the job's with its command
+// - returns -1 if the file could not be written
+int trace_write(const char *path)
+{
+    FILE *out = fopen(path, "we");
+    if (out == NULL)
+    {
+        return -1;
+    }
+    pid_t shell = getpid();
+    fprintf(out, "{\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"imcsh\"}},\n", shell);
+    fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"shell\"}},\n", shell, shell);
+    fprintf(out, "{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"sort_index\":-1}}", shell, shell);
+
+    size_t kept = (g_trace.count < g_trace.capacity) ? g_trace.count : g_trace.capacity;
+    for (size_t i = g_trace.count - kept; i < g_trace.count; i++)
+    {
+        const trace_event *event = &g_trace.events[i % g_trace.capacity];
+        pid_t tid = (event->track != 0) ? event->track : shell;
+        if (event->kind == TRACE_PROCESS && event->pid == event->track)
+        {
+            // The first process of a job names its track
+            fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", shell, tid);
+            char name[TRACE_TEXT + 16];
+            snprintf(name, sizeof(name), "job %d: %s", event->track, event->text);
+            print_json_string(out, name);
+            fprintf(out, "}}");
+        }
+        // Events from before `trace on` can't be, but a process may have started before it
+        double start = (event->start > g_trace.started) ? (event->start - g_trace.started) / 1000.0 : 0;
+        double end = (event->end > g_trace.started) ? (event->end - g_trace.started) / 1000.0 : 0;
+        fprintf(out, ",\n{\"name\":");
+        print_json_string(out, event->kind == TRACE_PROCESS || event->kind == TRACE_COMMAND ? event->text : g_trace_names[event->kind]);
+        fprintf(out, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{",
+                g_trace_names[event->kind], start, end - start, shell, tid);
+        if (event->pid != 0)
+        {
+            fprintf(out, "\"pid\":%d,", event->pid);
+        }
+        if (event->kind == TRACE_SPAWN)
+        {
+            fprintf(out, "\"error\":%d,", event->status); // The errno of the spawn backend
+        }
+        else if (event->kind == TRACE_COMMAND || event->kind == TRACE_REAP || event->kind == TRACE_PROCESS)
+        {
+            fprintf(out, "\"status\":%d,", event->status);
+        }
+        fprintf(out, "\"text\":");
+        print_json_string(out, event->text);
+        fprintf(out, "}}");
+    }
+    fprintf(out, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"recorded\":%zu,\"dropped\":%zu}}\n",
+            g_trace.count, g_trace.count - kept);
+    return (fclose(out) == 0) ? 0 : -1;
+}
+
+// Writes the trace out and stops tracing, also when the shell exits
+void trace_stop()
+{
+    if (g_trace.events == NULL)
+    {
+        return;
+    }
+    size_t kept = (g_trace.count < g_trace.capacity) ? g_trace.count : g_trace.capacity;
+    if (trace_write(g_trace.file) == -1)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: could not write the trace to '%s': %s\n" ANSI_COLOR_RESET, g_trace.file, strerror(errno));
+        g_last_status = 1;
+    }
+    else
+    {
+        printf("Wrote %zu trace events to %s", kept, g_trace.file);
+        if (g_trace.count > kept)
+        {
+            printf(", the oldest %zu were overwritten (trace on FILE --events=N keeps more)", g_trace.count - kept);
+        }
+        printf("\n");
+    }
+    free(g_trace.events);
+    free(g_trace.file);
+    g_trace = (tracer){NULL, 0, 0, NULL, 0};
+}
+
+// Records a trace of the shell: `trace on FILE [--events=N]`, `trace off` writes it, `trace` alone shows the state
+void trace_builtin(char **args, int background, FILE *out, command_line *command)
+{
+    (void)command;
+    (void)background;
+
+    if (args[0] == NULL)
+    {
+        if (g_trace.events == NULL)
+        {
+            fprintf(out, "tracing is off\n");
+        }
+        else
+        {
+            fprintf(out, "tracing to %s, %zu events recorded, the last %zu are kept\n", g_trace.file, g_trace.count, g_trace.capacity);
+        }
+        return;
+    }
+    if (strcmp(args[0], "off") == 0 && args[1] == NULL)
+    {
+        if (g_trace.events == NULL)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: tracing is not on\n" ANSI_COLOR_RESET);
+            g_last_status = 1;
+            return;
+        }
+        trace_stop();
+        return;
+    }
+
+    long capacity = DEFAULT_TRACE_EVENTS;
+    if (strcmp(args[0], "on") != 0 || args[1] == NULL ||
+        (args[2] != NULL && (strncmp(args[2], "--events=", 9) != 0 || args[3] != NULL || (capacity = parse_size(args[2] + 9)) < 1)))
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: usage: trace on FILE [--events=N] | trace off\n" ANSI_COLOR_RESET);
+        g_last_status = 1;
+        return;
+    }
+    if (g_trace.events != NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: already tracing to '%s', 'trace off' first\n" ANSI_COLOR_RESET, g_trace.file);
+        g_last_status = 1;
+        return;
+    }
+
+    // Touched right away, so the pages are there before the first event and recording never faults them in
+    g_trace.events = malloc(capacity * sizeof(trace_event));
+    g_trace.file = strdup(args[1]);
+    if (g_trace.events == NULL || g_trace.file == NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+        exit(EXIT_FAILURE);
+    }
+    memset(g_trace.events, 0, capacity * sizeof(trace_event));
+    g_trace.capacity = capacity;
+    g_trace.count = 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    g_trace.started = timespec_ns(&now);
+}
+
+// -------------------
+// |   Line editor   |
+// -------------------
+// At a terminal the prompt reads the line itself, with the terminal in raw mode, instead of the terminal's cooked mode
+// - the cursor can be moved and the line edited anywhere, Up / Down go through the history
+// - Tab completes builtins as the first word, programs on PATH after `exec` (and after `|`), file names everywhere else
+// - the terminal is only raw while a line is typed, commands run with the settings the shell was started with
+// Keys and escape sequences: https://vt100.net/docs/vt100-ug/chapter3.html
+// Raw mode: https://man7.org/linux/man-pages/man3/termios.3.html
+#define EDITOR_MAX_LISTED 100 // Candidates listed at most on a double Tab
+
+typedef struct
+{
+    int enabled;           // Standard input and output are a terminal
+    struct termios cooked; // The settings to restore
+    char *buffer;
+    size_t length;
+    size_t capacity;
+    size_t cursor;
+    char *saved;           // The line being typed while going through the history
+    size_t saved_length;
+    size_t saved_capacity;
+    size_t history_pos;    // Line of the history shown, SIZE_MAX for the line being typed
+    int last_was_tab;      // A second Tab in a row lists the candidates
+    unsigned char input[256]; // Read from the terminal, but not handled yet
+    size_t input_start;
+    size_t input_end;
+} line_editor;
+
+line_editor g_editor = {0};
+
+// A completion candidate, `is_dir` ones get a `/` instead of a space
+typedef struct
+{
+    const char *name;
+    int is_dir;
+} completion;
+
+void editor_init()
+{
+    const char *term = env_get("TERM");
+    if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO) || (term != NULL && strcmp(term, "dumb") == 0) ||
+        tcgetattr(STDIN_FILENO, &g_editor.cooked) == -1)
+    {
+        return; // Lines are read as they are, by the line reader
+    }
+    g_editor.enabled = 1;
+}
+
+void editor_raw()
+{
+    struct termios raw = g_editor.cooked;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_cflag |= CS8;
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG); // Ctrl+C arrives as a key, and only cancels the line
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw); // Output post-processing stays on, so `\n` still starts a new line
+}
+
+void editor_cooked()
+{
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &g_editor.cooked);
+}
+
+void editor_reserve(char **buffer, size_t *capacity, size_t needed)
+{
+    if (needed <= *capacity)
+    {
+        return;
+    }
+    size_t new_capacity = (*capacity == 0) ? 256 : *capacity;
+    while (new_capacity < needed)
+    {
+        new_capacity *= 2;
+    }
+    *buffer = realloc(*buffer, new_capacity);
+    if (*buffer == NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+        exit(EXIT_FAILURE);
+    }
+    *capacity = new_capacity;
+}
+
+// Columns taken up by UTF-8 text, counting every character as one (continuation bytes take no column)
+size_t display_width(const char *text, size_t length)
+{
+    size_t width = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        width += ((unsigned char)text[i] & 0xC0) != 0x80;
+    }
+    return width;
+}
+
+// Position of the character before / after the cursor, stepping over whole UTF-8 characters
+size_t editor_prev(size_t pos)
+{
+    while (pos > 0 && ((unsigned char)g_editor.buffer[--pos] & 0xC0) == 0x80)
+    {
+    }
+    return pos;
+}
+
+size_t editor_next(size_t pos)
+{
+    if (pos < g_editor.length)
+    {
+        pos++;
+    }
+    while (pos < g_editor.length && ((unsigned char)g_editor.buffer[pos] & 0xC0) == 0x80)
+    {
+        pos++;
+    }
+    return pos;
+}
+
+// Draws the prompt and the line again, scrolled sideways if it is wider than the terminal
+void editor_refresh()
+{
+    struct winsize ws;
+    size_t columns = (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) ? ws.ws_col : 80;
+    size_t prompt_width = strlen(g_username) + strlen(g_hostname) + 2;
+
+    // Keep the cursor on the screen, dropping characters from the left
+    size_t first = 0;
+    size_t cursor_width = display_width(g_editor.buffer, g_editor.cursor);
+    while (prompt_width + cursor_width >= columns)
+    {
+        first = editor_next(first);
+        cursor_width--;
+    }
+    size_t end = first;
+    for (size_t width = prompt_width; end < g_editor.length && width + 1 < columns; width++)
+    {
+        end = editor_next(end);
+    }
+
+    printf("\r" ANSI_COLOR_GREEN "%s@%s> " ANSI_COLOR_RESET, g_username, g_hostname);
+    fwrite(g_editor.buffer + first, 1, end - first, stdout);
+    printf("\x1b[K\r"); // Clear what is left of an earlier, longer line
+    size_t column = prompt_width + cursor_width;
+    if (column > 0)
+    {
+        printf("\x1b[%zuC", column);
+    }
+    fflush(stdout);
+}
+
+void editor_insert(const char *text, size_t length)
+{
+    editor_reserve(&g_editor.buffer, &g_editor.capacity, g_editor.length + length + 1);
+    memmove(g_editor.buffer + g_editor.cursor + length, g_editor.buffer + g_editor.cursor, g_editor.length - g_editor.cursor);
+    memcpy(g_editor.buffer + g_editor.cursor, text, length);
+    g_editor.length += length;
+    g_editor.cursor += length;
+}
+
+void editor_delete(size_t from, size_t to)
+{
+    memmove(g_editor.buffer + from, g_editor.buffer + to, g_editor.length - to);
+    g_editor.length -= to - from;
+    g_editor.cursor = from;
+}
+
+// Replaces the whole line, e.g. with one from the history
+void editor_set(const char *text, size_t length)
+{
+    g_editor.length = g_editor.cursor = 0;
+    editor_insert(text, length);
+}
+
+// Steps through the history, `direction` -1 for older and 1 for newer
+void editor_history(int direction)
+{
+    history_open();
+    history_index();
+    if (g_editor.history_pos == SIZE_MAX)
+    {
+        if (direction > 0 || g_history.count == 0)
+        {
+            return;
+        }
+        // Keep what was typed so far, going back down past the newest command brings it back
+        editor_reserve(&g_editor.saved, &g_editor.saved_capacity, g_editor.length + 1);
+        memcpy(g_editor.saved, g_editor.buffer, g_editor.length);
+        g_editor.saved_length = g_editor.length;
+        g_editor.history_pos = g_history.count;
+    }
+    if (direction < 0 && g_editor.history_pos > 0)
+    {
+        g_editor.history_pos--;
+    }
+    else if (direction > 0)
+    {
+        g_editor.history_pos++;
+    }
+    if (g_editor.history_pos >= g_history.count)
+    {
+        g_editor.history_pos = SIZE_MAX;
+        editor_set(g_editor.saved, g_editor.saved_length);
+    }
+    else
+    {
+        editor_set(g_history.lines[g_editor.history_pos].text, g_history.lines[g_editor.history_pos].length);
+    }
+}
+
+// Adds a candidate to the list in the arena, which grows by doubling
+void completion_add(completion **list, size_t *count, size_t *capacity, const char *name, int is_dir)
+{
+    if (*count == *capacity)
+    {
+        size_t new_capacity = (*capacity == 0) ? 64 : *capacity * 2;
+        completion *grown = arena_alloc(&g_arena, new_capacity * sizeof(completion));
+        if (*count > 0)
+        {
+            memcpy(grown, *list, *count * sizeof(completion));
+        }
+        *list = grown;
+        *capacity = new_capacity;
+    }
+    (*list)[*count].name = name;
+    (*list)[*count].is_dir = is_dir;
+    (*count)++;
+}
+
+// Collects the files of the directory part of `word` whose name starts with the rest of it
+// - the candidates are only the names, the directory part stays in the line
+void complete_files(const char *word, size_t length, completion **list, size_t *count, size_t *capacity)
+{
+    const char *slash = memrchr(word, '/', length);
+    const char *base = (slash != NULL) ? slash + 1 : word;
+    size_t base_length = word + length - base;
+    char dir_path[PATH_MAX];
+    if (slash == NULL)
+    {
+        strcpy(dir_path, ".");
+    }
+    else
+    {
+        snprintf(dir_path, sizeof(dir_path), "%.*s", (int)(slash - word + 1), word);
+    }
+
+    DIR *d = opendir(dir_path);
+    if (d == NULL)
+    {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || (name[0] == '.' && base[0] != '.') ||
+            strncmp(name, base, base_length) != 0)
+        {
+            continue; // Hidden files only when asked for with a leading dot
+        }
+        int is_dir = (entry->d_type == DT_DIR);
+        struct stat st;
+        if ((entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) && fstatat(dirfd(d), name, &st, 0) == 0)
+        {
+            is_dir = S_ISDIR(st.st_mode);
+        }
+        size_t name_length = strlen(name);
+        char *copy = arena_alloc(&g_arena, name_length + 1);
+        memcpy(copy, name, name_length + 1);
+        completion_add(list, count, capacity, copy, is_dir);
+    }
+    closedir(d);
+}
+
+int compare_completions(const void *a, const void *b)
+{
+    return strcmp(((const completion *)a)->name, ((const completion *)b)->name);
+}
+
+// What the word under the cursor is: 0 = a builtin, 1 = a program, 2 = a file
+// - the first word of a line is a builtin, after `exec` (and its options), `time` or `|` comes a program
+// - `cache` and its options are followed by `exec`, so by a builtin as well
+int completion_kind(size_t word_start)
+{
+    const char *line = g_editor.buffer;
+    size_t pos = word_start;
+    while (pos > 0 && (line[pos - 1] == ' ' || line[pos - 1] == '\t'))
+    {
+        pos--;
+    }
+    if (pos > 0 && (line[pos - 1] == '>' || line[pos - 1] == '<'))
+    {
+        return 2;
+    }
+
+    // The words of the pipeline stage before the cursor, a later stage of a pipeline starts with a program, the first
+    // one of a command (after `;`, `&&`, `||`, `&` or `(`) with a function - `>&` and `>|` are only redirections
+    size_t stage_start = word_start;
+    while (stage_start > 0 && (strchr("|;&(", line[stage_start - 1]) == NULL || (stage_start > 1 && line[stage_start - 2] == '>')))
+    {
+        stage_start--;
+    }
+    int in_pipeline = stage_start > 0 && line[stage_start - 1] == '|' && (stage_start == 1 || line[stage_start - 2] != '|');
+    int expect = in_pipeline ? 1 : 0;
+    size_t i = stage_start;
+    while (1)
+    {
+        while (i < word_start && (line[i] == ' ' || line[i] == '\t'))
+        {
+            i++;
+        }
+        if (i >= word_start)
+        {
+            return (expect == 3) ? 0 : expect;
+        }
+        size_t end = i;
+        while (end < word_start && line[end] != ' ' && line[end] != '\t')
+        {
+            end++;
+        }
+        if ((expect == 0 || expect == 3) && ((end - i == 4 && strncmp(line + i, "exec", 4) == 0) ||
+                                             (end - i == 4 && strncmp(line + i, "time", 4) == 0)))
+        {
+            expect = (line[i] == 'e') ? 1 : 0; // `time` is followed by another builtin
+        }
+        else if (expect == 0 && end - i == 5 && strncmp(line + i, "cache", 5) == 0)
+        {
+            expect = 3;
+        }
+        else if ((expect == 1 || expect == 3) && line[i] == '-' && !in_pipeline)
+        {
+            // An option of `exec` or `cache`, the program still comes after it
+        }
+        else
+        {
+            expect = 2; // Past the command, only arguments follow
+        }
+        i = end;
+    }
+}
+
+// Completes the word under the cursor as far as all candidates agree, with `list` (a second Tab) it lists them
+void editor_complete(int list_candidates)
+{
+    size_t start = g_editor.cursor;
+    while (start > 0 && strchr(" \t|<>&", g_editor.buffer[start - 1]) == NULL)
+    {
+        start--;
+    }
+    const char *word = g_editor.buffer + start;
+    size_t length = g_editor.cursor - start;
+    int kind = completion_kind(start);
+    if (kind == 1 && memchr(word, '/', length) != NULL)
+    {
+        kind = 2; // A path to a program, like `./run.sh`
+    }
+
+    // Copy the word, the candidates are collected before the line changes
+    char *prefix = arena_alloc(&g_arena, length + 1);
+    memcpy(prefix, word, length);
+    prefix[length] = '\0';
+
+    completion *list = NULL;
+    size_t count = 0, capacity = 0;
+    if (kind == 0)
+    {
+        for (int i = 0; function_table[i].name != NULL; i++)
+        {
+            if (strncmp(function_table[i].name, prefix, length) == 0)
+            {
+                completion_add(&list, &count, &capacity, function_table[i].name, 0);
+            }
+        }
+    }
+    else if (kind == 1)
+    {
+        path_index_build();
+        for (size_t i = path_index_lower_bound(prefix); i < g_path_index_count; i++)
+        {
+            if (strncmp(g_path_index[i], prefix, length) != 0)
+            {
+                break; // Sorted, so the matches are all in one run
+            }
+            completion_add(&list, &count, &capacity, g_path_index[i], 0);
+        }
+    }
+    else
+    {
+        complete_files(prefix, length, &list, &count, &capacity);
+    }
+
+    if (count == 0)
+    {
+        printf("\a"); // Nothing to complete
+        fflush(stdout);
+        return;
+    }
+
+    // How much of the name is typed already, for files only the part after the last `/`
+    const char *slash = (kind == 2) ? memrchr(prefix, '/', length) : NULL;
+    size_t typed = (slash != NULL) ? (size_t)(prefix + length - slash - 1) : length;
+
+    // The longest prefix all candidates share
+    size_t common = strlen(list[0].name);
+    for (size_t i = 1; i < count; i++)
+    {
+        size_t j = 0;
+        while (j < common && list[i].name[j] == list[0].name[j])
+        {
+            j++;
+        }
+        common = j;
+    }
+
+    if (common > typed || count == 1)
+    {
+        // Characters the lexer would split on get a backslash
+        for (size_t i = typed; i < common; i++)
+        {
+            char c = list[0].name[i];
+            if (strchr(" \t\\'\"|&<>#", c) != NULL)
+            {
+                editor_insert("\\", 1);
+            }
+            editor_insert(&c, 1);
+        }
+        if (count == 1)
+        {
+            editor_insert(list[0].is_dir ? "/" : " ", 1);
+        }
+        return;
+    }
+
+    if (!list_candidates)
+    {
+        printf("\a"); // Ambiguous, the next Tab lists the candidates
+        fflush(stdout);
+        return;
+    }
+
+    // List them below the line, in columns, then draw the prompt again
+    qsort(list, count, sizeof(completion), compare_completions);
+    struct winsize ws;
+    size_t columns = (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) ? ws.ws_col : 80;
+    size_t listed = (count > EDITOR_MAX_LISTED) ? EDITOR_MAX_LISTED : count;
+    size_t width = 0;
+    for (size_t i = 0; i < listed; i++)
+    {
+        size_t w = strlen(list[i].name) + list[i].is_dir;
+        width = (w > width) ? w : width;
+    }
+    width += 2;
+    size_t per_row = (columns / width > 0) ? columns / width : 1;
+    printf("\n");
+    for (size_t i = 0; i < listed; i++)
+    {
+        printf("%s%-*s", list[i].name, (int)(width - strlen(list[i].name)), list[i].is_dir ? "/" : "");
+        if ((i + 1) % per_row == 0 || i + 1 == listed)
+        {
+            printf("\n");
+        }
+    }
+    if (count > listed)
+    {
+        printf("... and %zu more\n", count - listed);
+    }
+}
+
+// Next key byte from the terminal, -1 at the end of the input
+// - waiting goes through the event loop, so jobs are reaped (and reported) while the user types
+int editor_read_byte()
+{
+    while (g_editor.input_start == g_editor.input_end)
+    {
+        wait_for_input(STDIN_FILENO);
+        ssize_t bytes = read(STDIN_FILENO, g_editor.input, sizeof(g_editor.input));
+        if (bytes > 0)
+        {
+            g_editor.input_start = 0;
+            g_editor.input_end = bytes;
+        }
+        else if (bytes == 0 || errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    return g_editor.input[g_editor.input_start++];
+}
+
+// Reads a line at the prompt, returns NULL at the end of the input (Ctrl+D on an empty line)
+// - the line is NUL terminated and only valid until the next call
+char *editor_read_line()
+{
+    g_editor.length = g_editor.cursor = 0;
+    g_editor.history_pos = SIZE_MAX;
+    g_editor.last_was_tab = 0;
+    editor_reserve(&g_editor.buffer, &g_editor.capacity, 1);
+
+    editor_raw();
+    g_editing = 1;
+    editor_refresh();
+    int done = 0;
+    while (!done)
+    {
+        int c = editor_read_byte();
+        int was_tab = g_editor.last_was_tab;
+        g_editor.last_was_tab = (c == '\t');
+        switch (c)
+        {
+        case -1:
+            done = -1;
+            break;
+        case 4: // Ctrl+D - end of the input on an empty line, otherwise deletes like Delete
+            if (g_editor.length == 0)
+            {
+                done = -1;
+            }
+            else if (g_editor.cursor < g_editor.length)
+            {
+                editor_delete(g_editor.cursor, editor_next(g_editor.cursor));
+            }
+            break;
+        case '\r':
+        case '\n':
+            done = 1;
+            break;
+        case 3: // Ctrl+C - drop the line and start over
+            printf("^C\n");
+            g_editor.length = g_editor.cursor = 0;
+            g_editor.history_pos = SIZE_MAX;
+            g_last_status = 130; // Like a shell whose command got SIGINT
+            break;
+        case '\t':
+            editor_complete(was_tab);
+            break;
+        case 127: // Backspace
+        case 8:   // Ctrl+H
+            if (g_editor.cursor > 0)
+            {
+                editor_delete(editor_prev(g_editor.cursor), g_editor.cursor);
+            }
+            break;
+        case 1: // Ctrl+A
+            g_editor.cursor = 0;
+            break;
+        case 5: // Ctrl+E
+            g_editor.cursor = g_editor.length;
+            break;
+        case 2: // Ctrl+B
+            g_editor.cursor = editor_prev(g_editor.cursor);
+            break;
+        case 6: // Ctrl+F
+            g_editor.cursor = editor_next(g_editor.cursor);
+            break;
+        case 11: // Ctrl+K - delete to the end of the line
+            g_editor.length = g_editor.cursor;
+            break;
+        case 21: // Ctrl+U - delete to the start of the line
+            editor_delete(0, g_editor.cursor);
+            break;
+        case 23: // Ctrl+W - delete the word before the cursor
+        {
+            size_t start = g_editor.cursor;
+            while (start > 0 && g_editor.buffer[start - 1] == ' ')
+            {
+                start--;
+            }
+            while (start > 0 && g_editor.buffer[start - 1] != ' ')
+            {
+                start--;
+            }
+            editor_delete(start, g_editor.cursor);
+            break;
+        }
+        case 12: // Ctrl+L - clear the screen
+            printf("\x1b[H\x1b[2J");
+            break;
+        case 16: // Ctrl+P
+            editor_history(-1);
+            break;
+        case 14: // Ctrl+N
+            editor_history(1);
+            break;
+        case 27: // Escape sequences of the arrow and editing keys, `ESC [ A` or `ESC O A`, `ESC [ 3 ~`
+        {
+            int kind = editor_read_byte();
+            int key = (kind == '[' || kind == 'O') ? editor_read_byte() : -1;
+            if (key >= '0' && key <= '9')
+            {
+                int tilde = editor_read_byte();
+                key = (tilde == '~') ? key : -1;
+            }
+            switch (key)
+            {
+            case 'A':
+                editor_history(-1);
+                break;
+            case 'B':
+                editor_history(1);
+                break;
+            case 'C':
+                g_editor.cursor = editor_next(g_editor.cursor);
+                break;
+            case 'D':
+                g_editor.cursor = editor_prev(g_editor.cursor);
+                break;
+            case 'H':
+            case '1':
+            case '7':
+                g_editor.cursor = 0;
+                break;
+            case 'F':
+            case '4':
+            case '8':
+                g_editor.cursor = g_editor.length;
+                break;
+            case '3': // Delete
+                if (g_editor.cursor < g_editor.length)
+                {
+                    editor_delete(g_editor.cursor, editor_next(g_editor.cursor));
+                }
+                break;
+            }
+            break;
+        }
+        default:
+            if (c >= 32) // Printable, including the bytes of UTF-8 characters
+            {
+                char byte = (char)c;
+                editor_insert(&byte, 1);
+            }
+            break;
+        }
+        if (!done && g_editor.input_start == g_editor.input_end)
+        {
+            editor_refresh(); // Pasted text is drawn once, not after every character
+        }
+    }
+
+    g_editor.cursor = g_editor.length;
+    editor_refresh(); // The cursor ends up behind the whole line, before moving on
+    g_editing = 0;
+    editor_cooked();
+    printf("\n");
+    if (done == -1)
+    {
+        return NULL;
+    }
+    g_editor.buffer[g_editor.length] = '\0';
+    return g_editor.buffer;
+}
+
+// ---------------------
+// |   Input handler   |
+// ---------------------
+void run_list(command_node *list);
+
+// Runs a single pipeline of a list, parsing it only now, so its variables see what ran before it
+void run_pipeline(char *text, int background)
+{
+    command_line command;
+    if (parse_command_line(text, &command) == -1)
+    {
+        g_last_status = 2; // Same status a regular shell uses for a syntax error
+        g_metrics.syntax_errors++;
+        return;
+    }
+    command.background |= background;
+    run_function(&command);
+}
+
+// Makes the copy of the shell that runs a list in the background forget about everything of the shell itself
+// - its own event loop, the jobs of the shell are not its children, and the terminal stays with the shell
+// - it is a script from now on, no prompt, no job control and reports in order on stdout
+void subshell_init(int capture_fd)
+{
+    if (g_job_control)
+    {
+        setpgid(0, 0); // Its own group like any other job, the programs it starts stay in it
+        for (int sig = 1; sig < NSIG; sig++)
+        {
+            if (sigismember(&g_job_signals, sig))
+            {
+                signal(sig, SIG_DFL);
+            }
+        }
+    }
+    if (capture_fd != -1)
+    {
+        dup2(capture_fd, STDOUT_FILENO);
+        dup2(capture_fd, STDERR_FILENO);
+        close(capture_fd);
+    }
+    g_job_control = 0;
+    g_interactive = 0;
+    g_editor.enabled = 0;
+    if (g_pending_reports != NULL)
+    {
+        fclose(g_pending_reports);
+        free(g_pending_buffer);
+        g_pending_reports = NULL;
+    }
+
+    for (int slot = g_active_head; slot != -1;)
+    {
+        job *j = &g_jobs[slot];
+        int next = j->next;
+        for (int i = 0; i < j->num_procs; i++)
+        {
+            if (j->pidfds[i] >= 0)
+            {
+                close(j->pidfds[i]);
+            }
+        }
+        job_free(slot);
+        slot = next;
+    }
+    if (g_pid_map != NULL)
+    {
+        memset(g_pid_map, 0, g_pid_map_capacity * sizeof(pid_map_entry));
+    }
+    g_pid_map_count = 0;
+    g_num_untracked = 0;
+
+    close(g_epoll_fd);
+    close(g_timer_fd);
+    close(g_sigchld_pipe[0]);
+    close(g_sigchld_pipe[1]);
+    if (g_metrics_fd != -1)
+    {
+        close(g_metrics_fd);
+        g_metrics_fd = -1;
+    }
+    free(g_metrics_file);
+    g_metrics_file = NULL;
+    free(g_trace.events); // Only the shell itself writes the trace
+    free(g_trace.file);
+    g_trace = (tracer){NULL, 0, 0, NULL, 0};
+    g_input_fd = -1;
+    events_init();
+
+    free(g_path_cache_env); // The inotify instance is shared too, the next lookup makes one of its own
+    g_path_cache_env = NULL;
+    g_history.compacting = 0; // The thread stayed with the shell
+    g_history.compact_disabled = 1;
+}
+
+// Forks a copy of the shell that runs something on its own, and registers it as a job like a program would be
+// - returns 0 in the copy, which `subshell_init` already set up, the pid in the shell with the job in `*slot`
+// - -1 if the fork failed (`g_last_status` is set)
+// - a foreground copy gets the terminal, so Ctrl+C and Ctrl+Z reach it and what it runs
+pid_t subshell_fork(const char *text, int background, int *slot)
+{
+    writers_flush(); // Neither of the two may write out what the other still has buffered
+    fflush(stdout);
+    fflush(stderr);
+    g_spawn_count++;
+    g_metrics.spawns++;
+
+    int capture_fds[2] = {-1, -1};
+    if (background && g_capture && pipe2(capture_fds, O_CLOEXEC) == -1)
+    {
+        perror("imcsh: pipe");
+        capture_fds[0] = capture_fds[1] = -1;
+    }
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("imcsh: fork");
+        g_metrics.spawn_failures++;
+        if (capture_fds[0] != -1)
+        {
+            close(capture_fds[0]);
+            close(capture_fds[1]);
+        }
+        g_last_status = 126;
+        return -1;
+    }
+    if (pid == 0)
+    {
+        if (capture_fds[0] != -1)
+        {
+            close(capture_fds[0]);
+        }
+        subshell_init(capture_fds[1]);
+        return 0;
+    }
+
+    if (g_job_control)
+    {
+        setpgid(pid, pid); // Also done by the child, whichever comes first
+    }
+    int pidfd = -1;
+    *slot = job_create(&pid, &pidfd, 1, background, text, &start_time);
+    g_jobs[*slot].pgid = g_job_control ? pid : 0;
+    if (capture_fds[0] != -1)
+    {
+        close(capture_fds[1]);
+        fcntl(capture_fds[0], F_SETFL, O_NONBLOCK);
+        job_capture(*slot, capture_fds[0]);
+    }
+    if (!background)
+    {
+        terminal_give(*slot);
+    }
+    return pid;
+}
+
+// Runs a list item that is more than a single pipeline in the background, e.g. `(make && make install) &`
+// - a copy of the shell made with `fork` runs it, and is a job of the shell like a program would be
+void run_subshell(command_node *node)
+{
+    int slot;
+    pid_t pid = subshell_fork(node->source, 1, &slot);
+    if (pid == -1)
+    {
+        return;
+    }
+    if (pid == 0)
+    {
+        node->background = 0;
+        node->next = NULL;
+        run_list(node);
+        while (g_num_background_jobs > 0)
+        {
+            wait_for_children(); // Like a script, the background jobs of the list are part of it
+        }
+        writers_close_all();
+        fflush(stdout);
+        _exit(g_last_status); // Not `exit`, the shell's exit handlers are not for the copy
+    }
+
+    printf("Started process with PID %d\n", pid);
+    g_last_status = 0;
+}
+
+// Runs one item of a list, `&&` and `||` look at the status the left side left in `g_last_status`
+void run_node(command_node *node)
+{
+    switch (node->type)
+    {
+    case NODE_PIPELINE:
+        run_pipeline(node->text, node->background);
+        break;
+    case NODE_AND:
+    case NODE_OR:
+        run_node(node->left);
+        if ((g_last_status == 0) == (node->type == NODE_AND) && !g_interrupted && g_last_status != 128 + SIGINT)
+        {
+            run_node(node->right);
+        }
+        break;
+    case NODE_GROUP:
+        run_list(node->left); // In the shell itself, so e.g. an `export` inside stays
+        break;
+    }
+}
+
+// Runs the items of a list one after the other, a Ctrl+C of one of them stops the rest like in other shells
+void run_list(command_node *list)
+{
+    for (command_node *node = list; node != NULL; node = node->next)
+    {
+        if (node->background && node->type != NODE_PIPELINE)
+        {
+            run_subshell(node);
+        }
+        else
+        {
+            run_node(node);
+        }
+        if (g_interrupted || g_last_status == 128 + SIGINT)
+        {
+            break;
+        }
+    }
+}
+
+void handle_input(char *input_str)
+{
+#ifdef ALLOC_STATS
+    unsigned long allocs_before = g_alloc_count, frees_before = g_free_count;
+#endif
 
-    // Variables for posix_spawn
-    pid_t pid;
-    // Initialize file actions - these behind the scenes use the usual `open()`, `close()`, `dup2()` functions
-    posix_spawn_file_actions_t file_actions;
-    posix_spawn_file_actions_init(&file_actions);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int tracing = (g_trace.events != NULL);
+    char trace_text[TRACE_TEXT];
+    if (tracing)
+    {
+        snprintf(trace_text, sizeof(trace_text), "%s", input_str); // The parser cuts the line apart
+    }
 
-    // If output redirection is specified, add file actions to redirect stdout
-    if (output_file != NULL)
+    // Split the input into its list of pipelines, each one is split into its words and redirections when it runs
+    command_node *list;
+    int parsed = parse_command_list(input_str, &list);
+    trace_span(TRACE_PARSE, &start, NULL, 0, 0, 0, NULL);
+    if (parsed == -1)
     {
-        int fd = open(output_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
-        if (fd == -1)
+        g_last_status = 2; // Same status a regular shell uses for a syntax error
+        g_metrics.syntax_errors++;
+    }
+    else if (list != NULL) // CHECK: input is not empty
+    {
+        g_metrics.commands++;
+        run_list(list);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        histogram_observe(&g_metrics.command_time, elapsed_seconds(&start, &end));
+        if (tracing)
         {
-            fprintf(stderr, ANSI_COLOR_RED "imcsh: Failed to open file '%s' for writing\n" ANSI_COLOR_RESET, output_file);
-            posix_spawn_file_actions_destroy(&file_actions);
-            free(argv);
-            return;
+            trace_span(TRACE_COMMAND, &start, &end, 0, 0, g_last_status, trace_text);
         }
+    }
+
+#ifdef ALLOC_STATS
+    fprintf(stderr, "imcsh: alloc stats: %lu allocations, %lu frees, %zu bytes from the arena\n",
+            g_alloc_count - allocs_before, g_free_count - frees_before, arena_used(&g_arena));
+#endif
+    arena_reset(&g_arena); // Everything the command allocated is gone in one go
+}
 
-        // Redirect stdout to the file
-        posix_spawn_file_actions_adddup2(&file_actions, fd, STDOUT_FILENO); // Redirect the stdout to the fd
-        posix_spawn_file_actions_addclose(&file_actions, fd);               // Close the file
+// ----------------------
+// |   Signal handler   |
+// ----------------------
+// Signal handler for SIGCHLD, only notes that there are children to reap
+// - writing to a pipe is async-signal-safe, the actual reaping and printing is done by `reap_untracked`
+void sigchld_handler(int sig)
+{
+    (void)sig;               // Marked as unused to suppress warning
+    int saved_errno = errno; // Save errno, as it might be modified - interfering with main program's error state
+    write(g_sigchld_pipe[1], "x", 1); // The pipe is non-blocking, when it is full there is already a wake-up pending
+    errno = saved_errno;              // Restore errno
+}
+
+// Signal handler for SIGINT with job control, where Ctrl+C only reaches the shell while it has the terminal itself
+// - notes it for the builtin that is waiting (e.g. `wait`), and wakes up the event loop through the self-pipe
+// - a handled signal gets its default back with `exec`, unlike an ignored one, so the children still get interrupted
+void sigint_handler(int sig)
+{
+    g_interrupted = 1;
+    sigchld_handler(sig);
+}
+
+// Prints how the shell can be started, for invalid command line options
+void print_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s                 interactive shell (or read commands from a pipe)\n", program);
+    fprintf(stderr, "       %s -c \"command\"    run the given command(s) and exit\n", program);
+    fprintf(stderr, "       %s script.imc      run the commands of a file, one per line\n", program);
+    fprintf(stderr, "       %s --parse-bench file  only parse the lines of a file and report the parser's throughput\n", program);
+    fprintf(stderr, "       %s --spawn-bench N     run `true` N times with every spawn backend and report the latencies\n", program);
+    fprintf(stderr, "       %s --serve socket      run the commands clients send over a Unix domain socket (see imcsh-client)\n", program);
+    fprintf(stderr, "Options: --spawn=posix_spawn|vfork|clone3  how programs are started (also 'set spawn=')\n");
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double diff = *(const double *)a - *(const double *)b;
+    return (diff > 0) - (diff < 0);
+}
+
+// Runs `true` as a foreground job over and over with every spawn backend, and prints the latency from before the spawn
+// until the exit is reaped, along with the throughput - one `key=value` line per backend
+int spawn_benchmark(long runs)
+{
+    double *latencies = malloc(runs * sizeof(double));
+    if (latencies == NULL)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: allocation error\n" ANSI_COLOR_RESET);
+        exit(EXIT_FAILURE);
     }
 
-    // Spawn the new process
-    int status = posix_spawnp(&pid, argv[0], (output_file != NULL) ? &file_actions : NULL, NULL, argv, NULL); // `spawnp` variant to access PATH variables
-    if (status == 0)
+    spawn_backend selected = g_spawn_backend;
+    for (int backend = 0; backend < NUM_SPAWN_BACKENDS; backend++)
     {
-        // If background process just start
-        if (background)
+        g_spawn_backend = (spawn_backend)backend;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long i = 0; i < runs; i++)
+        {
+            char line[] = "true";
+            command_line command;
+            parse_command_line(line, &command);
+            int slot = spawn_pipeline(&command, 0, NULL);
+            arena_reset(&g_arena);
+            if (slot == -1)
+            {
+                free(latencies);
+                return 1;
+            }
+            g_jobs[slot].quiet = 1;
+            wait_for_job(slot);
+            latencies[i] = g_last_job_wall;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (g_spawn_backend != (spawn_backend)backend)
         {
-            printf("Started process with PID %d\n", pid);
-            add_running_process(pid);
+            continue; // Not supported here, it fell back to another one
         }
-        else // Wait for the child process to finish
+
+        qsort(latencies, runs, sizeof(double), compare_doubles);
+        double seconds = elapsed_seconds(&start, &end);
+        printf("backend=%s runs=%ld p50_us=%.1f p99_us=%.1f spawns_per_second=%.0f\n", g_spawn_backend_names[backend], runs,
+               latencies[runs / 2] * 1e6, latencies[(runs * 99) / 100] * 1e6, runs / seconds);
+        fflush(stdout);
+    }
+    g_spawn_backend = selected;
+    free(latencies);
+    return 0;
+}
+
+// Parses every pipeline of a list, like running it would, returns the number of words or -1 for a syntax error
+long parse_list_words(command_node *list)
+{
+    long words = 0;
+    for (command_node *node = list; node != NULL; node = node->next)
+    {
+        long count = 0;
+        if (node->type == NODE_PIPELINE)
         {
-            if (waitpid(pid, &status, 0) == -1)
+            command_line command;
+            if (parse_command_line(node->text, &command) == -1)
             {
-                perror("imcsh");
+                return -1;
             }
-            else
+            for (int i = 0; i < command.num_stages; i++)
             {
-                if (WIFEXITED(status))
-                {
-                    printf("Process %d terminated with exit status %d\n", pid, WEXITSTATUS(status));
-                }
-                else if (WIFSIGNALED(status))
+                for (char **word = command.stages[i].argv; *word != NULL; word++)
                 {
-                    printf("Process %d terminated due to signal %d\n", pid, WTERMSIG(status));
+                    count++;
                 }
             }
         }
+        else
+        {
+            long left = parse_list_words(node->left);
+            long right = parse_list_words(node->right);
+            count = (left == -1 || right == -1) ? -1 : left + right;
+        }
+        if (count == -1)
+        {
+            return -1;
+        }
+        words += count;
     }
-    else
+    return words;
+}
+
+// Parses every line of a file without running any of them, then prints how fast that went in a `key=value` form
+// - a microbenchmark of the command line parser, e.g. `imcsh --parse-bench commands.txt`
+int parse_benchmark(const char *file)
+{
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
     {
-        fprintf(stderr, ANSI_COLOR_RED "imcsh: posix_spawn error: %s\n" ANSI_COLOR_RESET, strerror(status));
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: cannot open '%s': %s\n" ANSI_COLOR_RESET, file, strerror(errno));
+        return 127;
     }
+    line_reader reader;
+    reader_init(&reader, fd);
 
-    // Clean up
-    posix_spawn_file_actions_destroy(&file_actions);
-    free(argv); // Free the allocated sapce for arguments
-}
+    long lines = 0, words = 0, errors = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char *line;
+    while ((line = reader_next_line(&reader)) != NULL)
+    {
+        command_node *list;
+        lines++;
+        long count = (parse_command_list(line, &list) == -1) ? -1 : parse_list_words(list);
+        if (count == -1)
+        {
+            errors++;
+        }
+        else
+        {
+            words += count;
+        }
+        arena_reset(&g_arena);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    reader_destroy(&reader);
 
-// Create a lookup table of the possible functions
-// (It could have been made a hash map for efficiency, but looping should be fine for this few options)
-typedef void (*function_ptr)(char *args, int background, const char *output_file);
-typedef struct
-{
-    const char *name;
-    function_ptr func;
-    int expects_args;        // 1 if the function expects arguments, 0 otherwise
-    int supports_background; // 1 if the function supports background execution, 0 otherwise
-    int supports_output;     // 1 if the function supports output redirection, 0 otherwise
-} function_entry;
+    double seconds = elapsed_seconds(&start, &end);
+    printf("lines=%ld words=%ld errors=%ld seconds=%.6f lines_per_second=%.0f\n", lines, words, errors, seconds,
+           seconds > 0 ? lines / seconds : 0);
+    return errors > 0;
+}
 
-function_entry function_table[] = {
-    {"globalusage", globalusage, 0, 0, 1},
-    {"help", help, 0, 0, 1},
-    {"echo", echo, 1, 0, 1},
-    {"quit", quit_shell, 0, 0, 0},
-    {"exec", execute_program, 1, 1, 1},
-    {NULL, NULL, 0, 0, 0} // Sentinel value to mark the end of the table
-};
+// ----------------------
+// |   Command server   |
+// ----------------------
+// `imcsh --serve /path/sock` runs the command lines clients send over a Unix domain socket, so a task doesn't need a
+// new shell (and its startup) of its own
+// - every connection gets a copy of the shell made with `fork`, with its own job table, variables and settings, the
+//   same way a list in the background does - they can't get in each other's way, and use every CPU
+// - a request is a 4 byte length (big endian) followed by that many bytes of command lines
+// - the response is a 4 byte length, then a 4 byte exit status and everything the commands wrote to stdout and stderr
+// - the output goes into a memfd instead of a pipe, so a program writing a lot never waits for the client to read
+// - `imcsh-client` (imcsh-client.c) speaks this, and has a load test mode
+#define MAX_REQUEST_SIZE (16 * 1024 * 1024)
 
-// ---------------------
-// |   Input handler   |
-// ---------------------
-void handle_input(char *input_str)
+// Reads exactly `size` bytes, returns 1, 0 at EOF before the first byte, -1 for an error or EOF in between
+int read_full(int fd, void *buffer, size_t size)
 {
-    char *function;
-    char *arguments;
-    char *output_file = NULL;
-    int background = 0;
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t bytes = read(fd, (char *)buffer + done, size - done);
+        if (bytes == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            return (bytes == 0 && done == 0) ? 0 : -1;
+        }
+        done += bytes;
+    }
+    return 1;
+}
 
-    // Split the input into function and arguments
-    function = strtok(input_str, " "); // the function for the `imcsh` shell to run, from `string`
-    arguments = strtok(NULL, "");      // Get the rest
-    // printf("User wants to use function: %s\n", function);
-    // printf("With arguments: %s\n", arguments ? arguments : "None");
+int write_full(int fd, const void *buffer, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t bytes = send(fd, (const char *)buffer + done, size - done, MSG_NOSIGNAL); // A gone client is no SIGPIPE
+        if (bytes == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            return -1;
+        }
+        done += bytes;
+    }
+    return 0;
+}
 
-    // CHECK: input is not empty
-    if (function == NULL)
+// Runs the requests of one client, in the copy of the shell forked for it, until it disconnects
+void serve_client(int fd)
+{
+    subshell_init(-1);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int output = memfd_create("imcsh-output", MFD_CLOEXEC);
+    if (null_fd == -1 || output == -1)
     {
-        return;
+        _exit(EXIT_FAILURE);
     }
+    dup2(null_fd, STDIN_FILENO); // Nothing to read for the programs, the requests come from the socket
+    dup2(output, STDOUT_FILENO);
+    dup2(output, STDERR_FILENO);
+    close(null_fd);
 
-    // CHECK: for modifiers if there are caught arguments
-    if (arguments != NULL)
+    char *request = NULL;
+    size_t capacity = 0;
+    while (1)
     {
-        // Check for background execution '&' at the end
-        size_t len = strlen(arguments);
-        if (len > 0 && arguments[len - 1] == '&')
+        if (g_num_active_jobs > 0)
         {
-            background = 1;
-            arguments[len - 1] = '\0'; // Remove '&'
-
-            // Remove any trailing whitespace
-            while (len > 1 && (arguments[len - 2] == ' ' || arguments[len - 2] == '\t'))
+            run_events(0); // Reports of background jobs go into the next response
+        }
+        wait_for_input(fd);
+        uint32_t header;
+        if (read_full(fd, &header, sizeof(header)) != 1)
+        {
+            break;
+        }
+        size_t size = ntohl(header);
+        if (size > MAX_REQUEST_SIZE)
+        {
+            break;
+        }
+        if (size + 1 > capacity)
+        {
+            capacity = size + 1;
+            request = realloc(request, capacity);
+            if (request == NULL)
             {
-                arguments[len - 2] = '\0';
-                len--;
+                _exit(EXIT_FAILURE);
             }
         }
-
-        // Check for file output modifier `>`
-        char *redir = strchr(arguments, '>');
-        if (redir != NULL)
+        if (size > 0 && read_full(fd, request, size) != 1)
         {
-            *redir = '\0'; // Split the string at '>'
-            redir++;       // Move past '>'
-
-            // Skip any whitespace
-            while (*redir == ' ' || *redir == '\t')
-                redir++;
+            break;
+        }
+        request[size] = '\0';
 
-            if (*redir != '\0')
-            {
-                output_file = strdup(redir); // Duplicate the output file name
-            }
-            else
+        // Every line is a command line of its own, the status is the one of the last
+        g_last_status = 0;
+        for (char *line = request; line != NULL;)
+        {
+            char *newline = strchr(line, '\n');
+            if (newline != NULL)
             {
-                fprintf(stderr, ANSI_COLOR_RED "imcsh: No output file specified after '>'\n" ANSI_COLOR_RESET);
-                return;
+                *newline++ = '\0';
             }
+            handle_input(line);
+            line = newline;
+        }
+        fflush(stdout);
+
+        struct stat info;
+        if (fstat(output, &info) == -1 || (uint64_t)info.st_size > UINT32_MAX - sizeof(uint32_t))
+        {
+            break;
+        }
+        uint32_t response[2] = {htonl((uint32_t)(sizeof(uint32_t) + info.st_size)), htonl((uint32_t)g_last_status)};
+        if (write_full(fd, response, sizeof(response)) == -1)
+        {
+            break;
+        }
+        off_t offset = 0;
+        while (offset < info.st_size && sendfile(fd, output, &offset, info.st_size - offset) > 0)
+            ;
+        if (offset < info.st_size)
+        {
+            break;
         }
+        ftruncate(output, 0);
+        lseek(output, 0, SEEK_SET); // Also moves the background jobs along, they share the offset
     }
 
-    // Iterate through the function table to find a match
-    for (int i = 0; function_table[i].name != NULL; i++)
+    // Like a script, the background jobs of the client are part of its work
+    while (g_num_background_jobs > 0)
     {
-        if (strcmp(function, function_table[i].name) == 0)
+        wait_for_children();
+    }
+    writers_close_all();
+    _exit(0);
+}
+
+// Accepts clients until SIGINT or SIGTERM, the copies of the shell serving them are jobs of the server
+int serve(const char *path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: socket path '%s' is too long\n" ANSI_COLOR_RESET, path);
+        return 2;
+    }
+    strcpy(address.sun_path, path);
+
+    // A socket left behind by a server that was killed is in the way of `bind`, anything else is left alone
+    struct stat info;
+    if (lstat(path, &info) == 0 && S_ISSOCK(info.st_mode))
+    {
+        unlink(path);
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+        listen(listen_fd, SOMAXCONN) == -1 || event_watch(listen_fd, EVENT_INPUT, 0) == -1)
+    {
+        fprintf(stderr, ANSI_COLOR_RED "imcsh: cannot listen on '%s': %s\n" ANSI_COLOR_RESET, path, strerror(errno));
+        return 1;
+    }
+    printf("Serving on %s\n", path);
+    fflush(stdout);
+
+    long connections = 0;
+    while (!g_interrupted)
+    {
+        g_input_ready = 0;
+        run_events(-1);
+        while (g_input_ready && !g_interrupted)
         {
-            // CHECK: There are arguments given to functions that require it
-            if (function_table[i].expects_args)
-            {
-                if (arguments == NULL || strlen(arguments) == 0)
-                {
-                    fprintf(stderr, ANSI_COLOR_RED "imcsh: '%s' requires arguments to run\n" ANSI_COLOR_RESET, function_table[i].name);
-                    return;
-                }
-            }
-            else
+            int client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (client == -1)
             {
-                if (arguments != NULL && strlen(arguments) > 0)
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
                 {
-                    fprintf(stderr, ANSI_COLOR_RED "imcsh: '%s' does not accept any arguments\n" ANSI_COLOR_RESET, function_table[i].name);
-                    return;
+                    perror("imcsh: accept"); // e.g. out of file descriptors, the client stays in the backlog
                 }
+                break;
             }
 
-            // CHECK: That function can be run in the background if needed
-            if (!function_table[i].supports_background && background)
+            struct timespec start_time;
+            clock_gettime(CLOCK_MONOTONIC, &start_time);
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == 0)
             {
-                fprintf(stderr, ANSI_COLOR_RED "imcsh: '%s' does not support background execution\n" ANSI_COLOR_RESET, function_table[i].name);
-                free(output_file);
-                return;
+                setpgid(0, 0); // A group of its own with the programs it starts, so they can be stopped together
+                close(listen_fd);
+                serve_client(client);
             }
-
-            // CHECK: That output can be caught into a file if needed
-            if (!function_table[i].supports_output && output_file != NULL)
+            close(client);
+            if (pid == -1)
             {
-                fprintf(stderr, ANSI_COLOR_RED "imcsh: '%s' does not support output redirection\n" ANSI_COLOR_RESET, function_table[i].name);
-                free(output_file);
-                return;
+                perror("imcsh: fork");
+                continue;
             }
-
-            // Call the function with the arguments and background flag
-            function_table[i].func(arguments, background, output_file);
-
-            return;
+            char name[32];
+            snprintf(name, sizeof(name), "client %ld", ++connections);
+            int pidfd = -1;
+            setpgid(pid, pid); // Also done by the child, whichever comes first
+            int slot = job_create(&pid, &pidfd, 1, 1, name, &start_time);
+            g_jobs[slot].pgid = pid;
         }
     }
 
-    // If not found in `function_table` print error
-    fprintf(stderr, ANSI_COLOR_RED "imcsh: invalid function '%s'\n" ANSI_COLOR_RESET, function);
+    // The copies serving the clients go too, and with them their programs
+    for (int slot = g_active_head; slot != -1; slot = g_jobs[slot].next)
+    {
+        job_signal(slot, SIGTERM);
+    }
+    close(listen_fd);
+    unlink(path);
+    printf("Stopped serving on %s after %ld connections\n", path, connections);
+    return 0;
 }
 
-// ----------------------
-// |   Signal handler   |
-// ----------------------
-// Signal handler for SIGCHLD to reap background processes
-void sigchld_handler(int sig)
+// -----------------
+// |   Main loop   |
+// -----------------
+int main(int argc, char *argv[])
 {
-    (void)sig;               // Marked as unused to suppress warning
-    int saved_errno = errno; // Save errno, as it might be modified - interfering with main program's error state
-    pid_t pid;               // Init storage of terminated PID
-    int status;              // Init storage of status of the terminated process
+    env_init(); // Everything after this looks variables up in the shell's own table
 
-    // Loop to reap all terminated child processes - avoinding zombies
-    // - loop is apparently used because SIGCHIL signal might indicate more than 1 terminated children
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) // -1 = we wait for any process, WHOHANG means there is no blocking if no zombie child process found
+    // Options in front of everything else
+    const char *program = argv[0];
+    long spawn_bench_runs = 0;
+    const char *serve_path = NULL;
+    while (argc > 1 && strncmp(argv[1], "--spawn=", 8) == 0)
+    {
+        if (set_spawn_backend(argv[1] + 8) == -1)
+        {
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: unknown spawn backend '%s' (posix_spawn, vfork or clone3)\n" ANSI_COLOR_RESET, argv[1] + 8);
+            return 2;
+        }
+        argc--;
+        argv++;
+    }
+
+    // Pick where the commands come from
+    // - `-c "cmd"` runs the given string, a file argument runs that file as a script
+    // - otherwise stdin is read, and only counts as interactive when it is a terminal (`imcsh < cmds.txt` is a batch as well)
+    if (argc == 3 && strcmp(argv[1], "-c") == 0)
+    {
+        reader_init_string(&g_input, argv[2]);
+        g_interactive = 0;
+    }
+    else if (argc == 3 && strcmp(argv[1], "--serve") == 0)
+    {
+        serve_path = argv[2]; // Served below, once the event loop is set up
+        g_interactive = 0;
+    }
+    else if (argc == 3 && strcmp(argv[1], "--parse-bench") == 0)
     {
-        if (WIFEXITED(status))
+        return parse_benchmark(argv[2]);
+    }
+    else if (argc == 3 && strcmp(argv[1], "--spawn-bench") == 0)
+    {
+        spawn_bench_runs = atol(argv[2]); // Run below, once the event loop is set up
+        g_interactive = 0;
+        if (spawn_bench_runs < 1)
         {
-            printf("\nBackground process %d terminated with exit status %d\n", pid, WEXITSTATUS(status));
+            print_usage(program);
+            return 2;
         }
-        else if (WIFSIGNALED(status))
+    }
+    else if (argc == 2 && argv[1][0] != '-')
+    {
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
         {
-            printf("\nBackground process %d terminated due to signal %d\n", pid, WTERMSIG(status));
+            fprintf(stderr, ANSI_COLOR_RED "imcsh: cannot open '%s': %s\n" ANSI_COLOR_RESET, argv[1], strerror(errno));
+            return 127;
         }
-        remove_running_process(pid);
-        prompt_user();
-        fflush(stdout); // Ensure the message is printed immediately - disregarding current input wait
+        reader_init(&g_input, fd);
+        g_interactive = 0;
+    }
+    else if (argc == 1)
+    {
+        reader_init(&g_input, STDIN_FILENO);
+        g_interactive = isatty(STDIN_FILENO);
+    }
+    else
+    {
+        print_usage(program);
+        return 2;
     }
-    errno = saved_errno; // Restore errno
-}
 
-// -----------------
-// |   Main loop   |
-// -----------------
-int main()
-{
     // Initialize shell - set username and host as global variables
     initialize_shell();
-    display_title();
+    if (g_interactive)
+    {
+        editor_init();
+        job_control_init();
+        display_title();
+    }
+
+    events_init();
 
     // Set up the SIGCHLD handler to handle background process termination
     // - Neccessary because if we are simply forking processes and and don't wait for them and reap them, we create zombie processes
     // - Possible sources: https://docs.oracle.com/cd/E19455-01/806-4750/signals-7/index.html
     // - GNU docs: https://www.gnu.org/software/libc/manual/html_node/Signal-Handling.html
     struct sigaction sa;
-    sa.sa_handler = &sigchld_handler;        // Handler to call when subprocess finishes
-    sigemptyset(&sa.sa_mask);                // Initialize the signal set to exclude all signals
-    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP; // Flags to restart interrupted system calls and ignore stopped children
+    sa.sa_handler = &sigchld_handler; // Handler to call when subprocess finishes
+    sigemptyset(&sa.sa_mask);         // Initialize the signal set to exclude all signals
+    sa.sa_flags = SA_RESTART;         // Flags to restart interrupted system calls, stopped children are reported too (job control)
     if (sigaction(SIGCHLD, &sa, NULL) == -1)
     {
         perror("imcsh: sigaction");
         exit(EXIT_FAILURE);
     }
+    if (g_job_control)
+    {
+        sa.sa_handler = &sigint_handler;
+        sigaction(SIGINT, &sa, NULL);
+    }
 
-    // Allocate memory for storing the running processes
-    running_processes = malloc(max_processes * sizeof(pid_t));
-    if (running_processes == NULL)
+    if (spawn_bench_runs > 0)
     {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(EXIT_FAILURE);
+        return spawn_benchmark(spawn_bench_runs);
+    }
+    if (serve_path != NULL)
+    {
+        // SIGINT and SIGTERM only wake up the event loop, so the socket file can be removed on the way out
+        sa.sa_handler = &sigint_handler;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        return serve(serve_path);
     }
 
     // Main loop
     while (1)
     {
+        if (g_num_active_jobs > 0)
+        {
+            run_events(0); // Pick up what finished while the last command ran, without waiting
+        }
+        flush_reports();
         prompt_user();
-        char *input = read_input();
+        fflush(stdout); // The prompt has no newline, and in batch mode stdout is fully buffered
+        if (g_interactive)
+        {
+            writers_close_all(); // Idle at the prompt, so the files are complete and closed while the user looks at them
+        }
+        g_at_prompt = g_interactive;
+        char *input = g_editor.enabled ? editor_read_line() : reader_next_line(&g_input);
+        g_at_prompt = 0;
         if (input == NULL)
         {
-            // EOF encountered (e.g., Ctrl+D)
-            printf("\n");
+            // EOF encountered (e.g., Ctrl+D), the editor already moved to a new line
+            if (g_interactive && !g_editor.enabled)
+            {
+                printf("\n");
+            }
             break;
         }
-        handle_input(input);
-        free(input); // Free the allocated memory
+        if (g_interactive)
+        {
+            history_add(input);
+        }
+        g_interrupted = 0; // A Ctrl+C from before doesn't cancel the next command
+        handle_input(input); // The line lives in the reader's buffer, nothing to free
+    }
+
+    // A script's background jobs are part of its work, let them finish (and get reported) before exiting
+    if (!g_interactive)
+    {
+        while (g_num_background_jobs > 0)
+        {
+            wait_for_children();
+        }
     }
 
     // Clean up
-    free(running_processes);
-    return 0;
-}
\ No newline at end of file
+    metrics_export();
+    trace_stop();
+    history_close();
+    job_control_exit();
+    writers_close_all();
+    reader_destroy(&g_input);
+    return g_last_status;
+}